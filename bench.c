@@ -0,0 +1,1082 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "lowlevel.h"
+#include "datalog-decode.h"
+#include "test-support.h"
+#include "flash-image.h"
+#include "live-fix.h"
+#include "fix-shm.h"
+#include "nmea.h"
+#include "message-decode.h"
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+ * Benchmarks for the hot paths and for a whole dump from the simulator. Not
+ * part of the default build: "make skytraq-bench", or "make bench" to run all
+ * of them and compare with bench-baseline.json. The baseline depends on the
+ * machine and is not part of the sources; the first "make bench" writes it.
+ */
+
+#define MAX_RESULTS         64
+#define DEFAULT_TOLERANCE   20      /* percent a result may be worse than the baseline */
+#define DUMP_SECTORS        4
+
+typedef struct bench_result {
+    char        name[48];
+    double      value;
+    const char* unit;
+    int         higher_is_better;
+} bench_result;
+
+static bench_result results[MAX_RESULTS];
+static int result_count = 0;
+
+/* directory of skytraq-bench, the other programs are expected next to it */
+static char program_dir[256] = ".";
+
+/**
+  * Record a result for the JSON output and the comparison with the baseline.
+  */
+static void result( const char* name, double value, const char* unit, int higher_is_better ) {
+    bench_result* r;
+
+    if ( result_count == MAX_RESULTS )
+        return;
+    r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->value = value;
+    r->unit = unit;
+    r->higher_is_better = higher_is_better;
+}
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* geodetic to ECEF, used to create test points all over the world */
+static void geo_to_ecef( double lat, double lon, double h, double* x, double* y, double* z ) {
+    const double a = 6378137.0, f = 1/298.257223563, e2 = 2*f-f*f;
+    double phi = lat*M_PI/180, lambda = lon*M_PI/180;
+    double N = a/sqrt(1 - e2*sin(phi)*sin(phi));
+
+    *x = (N+h)*cos(phi)*cos(lambda);
+    *y = (N+h)*cos(phi)*sin(lambda);
+    *z = (N*(1-e2)+h)*sin(phi);
+}
+
+/* the logger stores whole meters */
+static void random_points( double* x, double* y, double* z, int n ) {
+    int i;
+
+    srand(4711);
+    for ( i = 0; i < n; i++ ) {
+        geo_to_ecef(rand() / (double)RAND_MAX * 178 - 89,
+                    rand() / (double)RAND_MAX * 360 - 180,
+                    rand() / (double)RAND_MAX * 10000 - 500,
+                    &x[i], &y[i], &z[i]);
+        x[i] = rint(x[i]);
+        y[i] = rint(y[i]);
+        z[i] = rint(z[i]);
+    }
+}
+
+static int bench_ecef( int n, int rounds ) {
+    double *x, *y, *z, *lon, *lat, *h, *ref;
+    double start, scalar_time, batch_time, max_diff = 0;
+    int i, r, differences = 0;
+
+    x = malloc(n * sizeof(double));
+    y = malloc(n * sizeof(double));
+    z = malloc(n * sizeof(double));
+    lon = malloc(n * sizeof(double));
+    lat = malloc(n * sizeof(double));
+    h = malloc(n * sizeof(double));
+    ref = malloc(3 * n * sizeof(double));
+    random_points(x, y, z, n);
+
+    /* accuracy: compare against the scalar function */
+    ecef_to_geo_batch(x, y, z, lon, lat, h, n);
+    for ( i = 0; i < n; i++ ) {
+        double d[3];
+        ecef_to_geo(x[i], y[i], z[i], &ref[3*i], &ref[3*i+1], &ref[3*i+2]);
+        d[0] = fabs(lon[i] - ref[3*i]);
+        d[1] = fabs(lat[i] - ref[3*i+1]);
+        d[2] = fabs(h[i] - ref[3*i+2]);
+        if ( memcmp(&lon[i], &ref[3*i], sizeof(double)) || memcmp(&lat[i], &ref[3*i+1], sizeof(double))
+             || memcmp(&h[i], &ref[3*i+2], sizeof(double)) )
+            differences++;
+        for ( r = 0; r < 3; r++ ) {
+            if ( d[r] > max_diff )
+                max_diff = d[r];
+        }
+    }
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        for ( i = 0; i < n; i++ )
+            ecef_to_geo(x[i], y[i], z[i], &ref[3*i], &ref[3*i+1], &ref[3*i+2]);
+    }
+    scalar_time = now() - start;
+
+    start = now();
+    for ( r = 0; r < rounds; r++ )
+        ecef_to_geo_batch(x, y, z, lon, lat, h, n);
+    batch_time = now() - start;
+
+    printf("ecef: %d points, %d not bit-identical, max difference %g\n", n, differences, max_diff);
+    printf("ecef: scalar %.2f Mpoints/s, batch %.2f Mpoints/s (%.2fx)\n",
+           n * (double)rounds / scalar_time / 1e6, n * (double)rounds / batch_time / 1e6,
+           scalar_time / batch_time);
+    result("ecef.scalar", n * (double)rounds / scalar_time / 1e6, "Mpoints/s", 1);
+    result("ecef.batch", n * (double)rounds / batch_time / 1e6, "Mpoints/s", 1);
+
+    free(x); free(y); free(z);
+    free(lon); free(lat); free(h);
+    free(ref);
+    return differences == 0 ? 0 : 1;
+}
+
+/* random track points, one to five seconds apart */
+static output_point* random_track( int n ) {
+    output_point* p = malloc(n * sizeof(output_point));
+    long time = 1224168929;
+    int i;
+
+    srand(4711);
+    for ( i = 0; i < n; i++ ) {
+        time += 1 + rand() % 5;
+        p[i].time = time;
+        p[i].latitude = rand() / (double)RAND_MAX * 180 - 90;
+        p[i].longitude = rand() / (double)RAND_MAX * 360 - 180;
+        p[i].height = rand() / (double)RAND_MAX * 10000 - 500;
+        p[i].speed = rand() % 256;
+        p[i].new_segment = 0;
+    }
+    return p;
+}
+
+static int bench_gpx( int n, int rounds ) {
+    output_point* p = random_track(n);
+    const output_format* gpx = output_format_find("gpx");
+    char *expected, *actual;
+    size_t expected_size, actual_size;
+    FILE *out, *null = fopen("/dev/null", "w");
+    output_writer w;
+    double start, printf_time, writer_time;
+    int i, r, precision, differences = 0;
+
+    /* the same text as output_gpx_trk_point() */
+    out = open_memstream(&expected, &expected_size);
+    for ( i = 0; i < n; i++ )
+        output_gpx_trk_point(out, p[i].time, p[i].latitude, p[i].longitude, p[i].height, p[i].speed);
+    fclose(out);
+    out = open_memstream(&actual, &actual_size);
+    output_writer_init(&w, out, gpx, OUTPUT_DEFAULT_PRECISION);
+    for ( i = 0; i < n; i++ )
+        output_track_point(&w, &p[i]);
+    output_writer_close(&w);
+    fclose(out);
+    if ( expected_size != actual_size || memcmp(expected, actual, expected_size) )
+        differences++;
+    free(expected);
+    free(actual);
+
+    /* the other precisions against printf */
+    for ( precision = 0; precision <= OUTPUT_MAX_PRECISION; precision++ ) {
+        char buffer[64];
+
+        output_writer_init(&w, NULL, gpx, precision);
+        for ( i = 0; i < 3 * n; i++ ) {
+            double value = i % 3 == 0 ? p[i/3].latitude : i % 3 == 1 ? p[i/3].longitude / 1e4 : p[i/3].height;
+            int length = snprintf(buffer, sizeof(buffer), "%.*f", precision, value);
+
+            w.length = 0;
+            output_write_double(&w, value);
+            if ( w.length != length || memcmp(w.buffer, buffer, length) )
+                differences++;
+        }
+        w.length = 0;
+        output_writer_close(&w);
+    }
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        for ( i = 0; i < n; i++ )
+            output_gpx_trk_point(null, p[i].time, p[i].latitude, p[i].longitude, p[i].height, p[i].speed);
+    }
+    fflush(null);
+    printf_time = now() - start;
+
+    start = now();
+    output_writer_init(&w, null, gpx, OUTPUT_DEFAULT_PRECISION);
+    for ( r = 0; r < rounds; r++ ) {
+        for ( i = 0; i < n; i++ )
+            output_track_point(&w, &p[i]);
+    }
+    output_writer_close(&w);
+    fflush(null);
+    writer_time = now() - start;
+
+    printf("gpx: %d points, %d differences to printf\n", n, differences);
+    printf("gpx: printf %.2f Mpoints/s, writer %.2f Mpoints/s (%.2fx)\n",
+           n * (double)rounds / printf_time / 1e6, n * (double)rounds / writer_time / 1e6,
+           printf_time / writer_time);
+    result("gpx.printf", n * (double)rounds / printf_time / 1e6, "Mpoints/s", 1);
+    result("gpx.writer", n * (double)rounds / writer_time / 1e6, "Mpoints/s", 1);
+
+    fclose(null);
+    free(p);
+    return differences == 0 ? 0 : 1;
+}
+
+/*
+ * Synthetic log: full sectors, sectors that end in erased flash after a
+ * quarter, and sectors with a run of garbage in the middle. Every
+ * <long_every>th entry is a long one.
+ */
+static gbuint8** synthetic_sectors( int count, int* lengths, int long_every ) {
+    gbuint8** sectors = malloc(count * sizeof(gbuint8*));
+    long time = 1224168929;
+    int s;
+
+    srand(4711);
+    for ( s = 0; s < count; s++ ) {
+        gbuint8* d = sectors[s] = malloc(SKYTRAQ_SECTOR_SIZE + 3);
+        int offset = 0, used = SKYTRAQ_SECTOR_SIZE, n = 0;
+
+        memset(d, 0xff, SKYTRAQ_SECTOR_SIZE + 3);
+        if ( s % 3 == 1 )
+            used = SKYTRAQ_SECTOR_SIZE / 4;
+        while ( offset + 18 <= used ) {
+            if ( s % 3 == 2 && offset >= 2048 && offset < 2048 + 256 ) {
+                memset(d + offset, 0, 256);
+                offset += 256;
+            } else if ( n++ % long_every == 0 ) {
+                put_long_entry(d + offset, time, 3800000 + rand() % 1000, 880000 + rand() % 1000,
+                               5000000 + rand() % 1000, rand() % 256);
+                offset += 18;
+            } else {
+                put_short_entry(d + offset, 5, rand() % 100 - 50, rand() % 100 - 50, rand() % 100 - 50, rand() % 256);
+                time += 5;
+                offset += 8;
+            }
+        }
+        lengths[s] = SKYTRAQ_SECTOR_SIZE;
+    }
+    return sectors;
+}
+
+/* the entry loop of process_buffer() before the lookup table */
+static long decode_branches( const gbuint8* buffer, int length, decode_state* st ) {
+    long entries = 0;
+    int offset = 0, speed;
+
+    while ( offset < length ) {
+        if ( buffer[offset] & 0x40 ) {
+            decode_long_entry(buffer+offset, &st->time, &st->ecef_x, &st->ecef_y, &st->ecef_z, &speed);
+            offset += 18;
+            entries++;
+        } else if ( buffer[offset] == 0x80 ) {
+            decode_short_entry(buffer+offset, &st->time, &st->ecef_x, &st->ecef_y, &st->ecef_z, &speed);
+            offset += 8;
+            entries++;
+        } else {
+            offset++;
+        }
+        st->last_timestamp = st->time;
+    }
+    return entries;
+}
+
+static void bench_decode_sectors( const char* name, const gbuint8* const* sectors, const int* lengths,
+                                  int count, int rounds ) {
+    skytraq_point* points = malloc(SKYTRAQ_SECTOR_POINTS * sizeof(skytraq_point));
+    double start, branch_time, table_time, decode_time;
+    long bytes = 0, entries = 0, found = 0, n = 0;
+    decode_state st;
+    char key[48];
+    int r, s;
+
+    for ( s = 0; s < count; s++ ) {
+        if ( lengths[s] > 0 )
+            bytes += lengths[s];
+    }
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        decode_init(&st, 0);
+        for ( s = 0; s < count; s++ ) {
+            decode_start_sector(&st, st.last_timestamp);
+            if ( lengths[s] > 0 )
+                entries += decode_branches(sectors[s], lengths[s], &st);
+        }
+    }
+    branch_time = now() - start;
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        decode_init(&st, 0);
+        for ( s = 0; s < count; s++ ) {
+            int offset = 0;
+
+            decode_start_sector(&st, st.last_timestamp);
+            while ( offset < lengths[s] )
+                found += decode_entry(sectors[s], &offset, lengths[s], &st, NULL);
+        }
+    }
+    table_time = now() - start;
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        decode_init(&st, 0);
+        for ( s = 0; s < count; s++ ) {
+            if ( lengths[s] > 0 )
+                n += skytraq_decode_points(sectors[s], lengths[s], &st, points, SKYTRAQ_SECTOR_POINTS);
+        }
+    }
+    decode_time = now() - start;
+
+    printf("decode %s: %d sectors, %ld long, %ld short, %ld bytes skipped, %ld bytes erased\n", name, count,
+           st.stats.long_entries, st.stats.short_entries, st.stats.skipped_bytes, st.stats.erased_bytes);
+    printf("decode %s: entries with branches %.0f MB/s (%ld found), with table %.0f MB/s (%ld found)\n", name,
+           bytes * (double)rounds / branch_time / 1e6, entries / rounds,
+           bytes * (double)rounds / table_time / 1e6, found / rounds);
+    printf("decode %s: full decode %.0f MB/s, %.2f Mpoints/s\n", name,
+           bytes * (double)rounds / decode_time / 1e6, n / decode_time / 1e6);
+
+    snprintf(key, sizeof(key), "decode.%s.entries", name);
+    result(key, bytes * (double)rounds / table_time / 1e6, "MB/s", 1);
+    snprintf(key, sizeof(key), "decode.%s.full", name);
+    result(key, bytes * (double)rounds / decode_time / 1e6, "MB/s", 1);
+    free(points);
+}
+
+static int bench_decode( const char* image_file ) {
+    int count = 256, s;
+    int* lengths = malloc(count * sizeof(int));
+    gbuint8** sectors = synthetic_sectors(count, lengths, 32);
+
+    bench_decode_sectors("synthetic", (const gbuint8* const*)sectors, lengths, count, 20);
+
+    /* garbage without a single lead byte, e.g. a damaged sector */
+    for ( s = 0; s < count; s++ )
+        memset(sectors[s], 0, SKYTRAQ_SECTOR_SIZE);
+    bench_decode_sectors("garbage", (const gbuint8* const*)sectors, lengths, count, 20);
+
+    for ( s = 0; s < count; s++ )
+        free(sectors[s]);
+    free(sectors);
+    free(lengths);
+
+    if ( image_file != NULL ) {
+        flash_image image;
+        const gbuint8** image_sectors;
+
+        if ( flash_image_open(image_file, &image) != SUCCESS ) {
+            fprintf(stderr, "cannot read %s\n", image_file);
+            return 1;
+        }
+        count = image.info.sector_count;
+        image_sectors = malloc(count * sizeof(gbuint8*) + 1);
+        lengths = malloc(count * sizeof(int) + 1);
+        for ( s = 0; s < count; s++ )
+            image_sectors[s] = flash_image_sector(&image, s, &lengths[s]);
+        bench_decode_sectors("image", image_sectors, lengths, count, 20);
+        free(image_sectors);
+        free(lengths);
+        flash_image_close(&image);
+    }
+    return 0;
+}
+
+/* decode all sectors, returns the number of points */
+static long decode_all( const gbuint8* const* sectors, const int* lengths, int count, int fast_geo,
+                        skytraq_point* points, decode_stats* stats ) {
+    decode_state st;
+    long n = 0;
+    int s;
+
+    decode_init(&st, 0);
+    st.fast_geo = fast_geo;
+    for ( s = 0; s < count; s++ )
+        n += skytraq_decode_points(sectors[s], lengths[s], &st, points + n, SKYTRAQ_SECTOR_POINTS);
+    if ( stats != NULL )
+        *stats = st.stats;
+    return n;
+}
+
+static int bench_geo( int rounds ) {
+    int count = 256, s, r;
+    long i, n = 0;
+    int* lengths = malloc(count * sizeof(int));
+    gbuint8** sectors = synthetic_sectors(count, lengths, 1000);
+    const gbuint8* const* data = (const gbuint8* const*)sectors;
+    skytraq_point* exact = malloc(count * SKYTRAQ_SECTOR_POINTS * sizeof(skytraq_point));
+    skytraq_point* fast = malloc(count * SKYTRAQ_SECTOR_POINTS * sizeof(skytraq_point));
+    double start, exact_time, fast_time;
+    double max_lat = 0, max_lon = 0, max_height = 0, max_meters = 0;
+    int differences = 0;
+    decode_stats stats;
+
+    start = now();
+    for ( r = 0; r < rounds; r++ )
+        n = decode_all(data, lengths, count, 0, exact, NULL);
+    exact_time = now() - start;
+
+    start = now();
+    for ( r = 0; r < rounds; r++ )
+        decode_all(data, lengths, count, 1, fast, &stats);
+    fast_time = now() - start;
+
+    for ( i = 0; i < n; i++ ) {
+        double dlat = fabs(fast[i].latitude - exact[i].latitude);
+        double dlon = fabs(fast[i].longitude - exact[i].longitude);
+        double dh = fabs(fast[i].height - exact[i].height);
+        double meters = hypot(dlat * M_PI / 180 * 6378137.0,
+                              dlon * M_PI / 180 * 6378137.0 * cos(exact[i].latitude * M_PI / 180));
+        char a[64], b[64];
+
+        if ( dlat > max_lat ) max_lat = dlat;
+        if ( dlon > max_lon ) max_lon = dlon;
+        if ( dh > max_height ) max_height = dh;
+        if ( meters > max_meters ) max_meters = meters;
+        snprintf(a, sizeof(a), "%f %f %f", exact[i].latitude, exact[i].longitude, exact[i].height);
+        snprintf(b, sizeof(b), "%f %f %f", fast[i].latitude, fast[i].longitude, fast[i].height);
+        if ( strcmp(a, b) )
+            differences++;
+    }
+
+    printf("geo: %ld points, %ld linearized, %ld anchors\n", n, stats.linearized, n - stats.linearized);
+    printf("geo: max error latitude %.2g deg, longitude %.2g deg, horizontal %.3f m, height %.3f m\n",
+           max_lat, max_lon, max_meters, max_height);
+    printf("geo: %d points (%.1f%%) differ in the GPX text with 6 digits\n", differences, 100.0 * differences / n);
+    printf("geo: exact %.2f Mpoints/s, linearized %.2f Mpoints/s (%.2fx)\n",
+           n * (double)rounds / exact_time / 1e6, n * (double)rounds / fast_time / 1e6, exact_time / fast_time);
+    result("geo.exact", n * (double)rounds / exact_time / 1e6, "Mpoints/s", 1);
+    result("geo.linearized", n * (double)rounds / fast_time / 1e6, "Mpoints/s", 1);
+    result("geo.max_error", max_meters, "m", 0);
+
+    for ( s = 0; s < count; s++ )
+        free(sectors[s]);
+    free(sectors);
+    free(lengths);
+    free(exact);
+    free(fast);
+    return 0;
+}
+
+/*
+ * What the serial line carries while the client talks to a logger: NMEA
+ * sentences, ACKs, version and log status answers, and now and then some
+ * noise. The stream is a little longer than <*size>, which is set to its
+ * actual length. Sets <*packages> to the number of packages in it.
+ */
+static gbuint8* recorded_stream( size_t* size, long* packages ) {
+    static const char* nmea =
+        "$GPGGA,120000.000,5320.0000,N,01000.0000,E,1,08,1.0,25.0,M,45.0,M,,0000*6A\r\n"
+        "$GPRMC,120000.000,A,5320.0000,N,01000.0000,E,0.00,0.00,161008,,,A*6B\r\n";
+    gbuint8 ack[2] = { SKYTRAQ_RESPONSE_ACK, SKYTRAQ_COMMAND_GET_CONFIG };
+    gbuint8 version[14] = { SKYTRAQ_RESPONSE_SOFTWARE_VERSION, 1, 0, 1, 2, 3, 0, 4, 5, 6, 0, 8, 10, 16 };
+    gbuint8 status[35];
+    gbuint8* stream = malloc(*size + 512);
+    size_t length = 0;
+    int i;
+
+    memset(status, 0, sizeof(status));
+    status[0] = 0x94;
+    srand(4711);
+    *packages = 0;
+    while ( length < *size ) {
+        memcpy(stream + length, nmea, strlen(nmea));
+        length += strlen(nmea);
+        length += skytraq_frame_package(stream + length, ack, sizeof(ack));
+        if ( rand() % 2 )
+            length += skytraq_frame_package(stream + length, version, sizeof(version));
+        else
+            length += skytraq_frame_package(stream + length, status, sizeof(status));
+        *packages += 2;
+        if ( rand() % 4 == 0 ) {
+            for ( i = rand() % 16; i > 0; i-- )
+                stream[length++] = rand() % 0xa0;
+        }
+    }
+    *size = length;
+    return stream;
+}
+
+/**
+  * Framer throughput on a byte stream, fed in pieces of the size read() returns
+  * at 115200 baud. <file> is a recording of the serial line, e.g. from
+  * "cat /dev/ttyUSB0"; without one a synthetic recording is used.
+  */
+static int bench_framer( const char* file, int rounds ) {
+    skytraq_framer framer;
+    gbuint8* stream;
+    size_t length;
+    long expected = -1, packages = 0;
+    double start, elapsed;
+    int r;
+
+    if ( file != NULL ) {
+        FILE* f = fopen(file, "rb");
+        if ( f == NULL ) {
+            fprintf(stderr, "cannot read %s\n", file);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        length = ftell(f);
+        rewind(f);
+        stream = malloc(length + 1);
+        length = fread(stream, 1, length, f);
+        fclose(f);
+    } else {
+        length = 4 << 20;
+        stream = recorded_stream(&length, &expected);
+    }
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        size_t offset = 0;
+
+        packages = 0;
+        skytraq_framer_init(&framer);
+        while ( offset < length ) {
+            unsigned piece = length - offset < 64 ? length - offset : 64;
+            unsigned consumed;
+            SkyTraqPackage* p = skytraq_framer_feed(&framer, stream + offset, piece, &consumed);
+
+            offset += consumed;
+            if ( p != NULL ) {
+                packages++;
+                skytraq_free_package(p);
+            }
+        }
+    }
+    elapsed = now() - start;
+
+    printf("framer: %zu bytes, %ld packages", length, packages);
+    if ( expected >= 0 )
+        printf(" (%ld expected)", expected);
+    printf("\nframer: %.0f MB/s, %.2f Mpackages/s\n",
+           length * (double)rounds / elapsed / 1e6, packages * (double)rounds / elapsed / 1e6);
+    result("framer.throughput", length * (double)rounds / elapsed / 1e6, "MB/s", 1);
+
+    free(stream);
+    return expected < 0 || packages == expected ? 0 : 1;
+}
+
+#define NMEA_RATE           10      /* epochs per second of the stream */
+
+/* append "$<body>*hh\r\n" */
+static size_t put_sentence( char* d, const char* body ) {
+    gbuint8 checksum = skytraq_xor_checksum((const gbuint8*)body, strlen(body));
+
+    return sprintf(d, "$%s*%02X\r\n", body, checksum);
+}
+
+/*
+ * <epochs> epochs of a receiver sending at NMEA_RATE Hz: GGA, GSA, three
+ * GSV, RMC and VTG, on a track heading north-east.
+ */
+static char* nmea_stream( int epochs, size_t* size, long* sentences ) {
+    char* stream = malloc(epochs * 640l);
+    char body[128];
+    size_t length = 0;
+    int e, i;
+
+    for ( e = 0; e < epochs; e++ ) {
+        int ms = e * (1000 / NMEA_RATE);
+        int hms = (ms / 3600000 % 24) * 10000 + (ms / 60000 % 60) * 100 + ms / 1000 % 60;
+        double minutes = 20 + e * 1e-4;
+
+        snprintf(body, sizeof(body), "GPGGA,%06d.%03d,53%07.4f,N,010%07.4f,E,1,09,0.9,%.1f,M,45.0,M,,0000",
+                 hms, ms % 1000, minutes, minutes, 25 + e % 100 * 0.1);
+        length += put_sentence(stream + length, body);
+        length += put_sentence(stream + length, "GPGSA,A,3,02,05,07,09,13,16,20,26,30,,,,1.6,0.9,1.3");
+        for ( i = 1; i <= 3; i++ ) {
+            snprintf(body, sizeof(body), "GPGSV,3,%d,11,%02d,45,120,%d,%02d,30,200,38,%02d,12,310,,%02d,67,045,44",
+                     i, i * 4, 30 + e % 15, i * 4 + 1, i * 4 + 2, i * 4 + 3);
+            length += put_sentence(stream + length, body);
+        }
+        snprintf(body, sizeof(body), "GPRMC,%06d.%03d,A,53%07.4f,N,010%07.4f,E,21.60,45.00,161008,,,A",
+                 hms, ms % 1000, minutes, minutes);
+        length += put_sentence(stream + length, body);
+        length += put_sentence(stream + length, "GPVTG,45.00,T,,M,21.60,N,40.00,K,A");
+    }
+    *size = length;
+    *sentences = epochs * 7l;
+    return stream;
+}
+
+typedef struct nmea_totals {
+    long    sentences;
+    long    fixes;
+    double  latitude;           /* of the last fix */
+} nmea_totals;
+
+static void count_sentence( const nmea_sentence* sentence, void* context ) {
+    ((nmea_totals*)context)->sentences++;
+}
+
+static void count_fix( const skytraq_fix* fix, void* context ) {
+    nmea_totals* totals = context;
+
+    totals->fixes++;
+    totals->latitude = fix->latitude;
+}
+
+/**
+  * Parse an hour of NMEA output at NMEA_RATE Hz, in pieces of the size
+  * read() returns from the serial port, and merge it into fixes.
+  */
+static int bench_nmea( int rounds ) {
+    const int epochs = 3600 * NMEA_RATE;
+    nmea_parser parser;
+    fix_builder builder;
+    nmea_totals totals;
+    size_t length, offset;
+    long expected;
+    char* stream = nmea_stream(epochs, &length, &expected);
+    double start, parse, fixes;
+    int r;
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        memset(&totals, 0, sizeof(totals));
+        nmea_parser_init(&parser);
+        for ( offset = 0; offset < length; offset += 256 )
+            nmea_parse(&parser, (gbuint8*)stream + offset, length - offset < 256 ? length - offset : 256,
+                       count_sentence, &totals);
+    }
+    parse = now() - start;
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        memset(&totals, 0, sizeof(totals));
+        fix_builder_init(&builder);
+        for ( offset = 0; offset < length; offset += 256 )
+            fix_builder_feed(&builder, (gbuint8*)stream + offset, length - offset < 256 ? length - offset : 256,
+                             count_fix, &totals);
+        fix_builder_flush(&builder, count_fix, &totals);
+    }
+    fixes = now() - start;
+
+    printf("nmea: %zu bytes, %ld sentences (%ld expected), %lu checksum errors, %lu malformed\n",
+           length, parser.sentences, expected, parser.checksum_errors, parser.malformed);
+    printf("nmea: %.0f MB/s, %.2f Msentences/s, %.0f times a %d Hz receiver\n",
+           length * (double)rounds / parse / 1e6, expected * (double)rounds / parse / 1e6,
+           epochs * (double)rounds / parse / NMEA_RATE, NMEA_RATE);
+    printf("nmea: %ld fixes, %.2f Mfixes/s\n", totals.fixes, epochs * (double)rounds / fixes / 1e6);
+    result("nmea.throughput", length * (double)rounds / parse / 1e6, "MB/s", 1);
+    result("nmea.fixes", epochs * (double)rounds / fixes / 1e6, "Mfixes/s", 1);
+
+    free(stream);
+    return parser.sentences == expected && totals.fixes == epochs &&
+           fabs(totals.latitude - (53 + (20 + (epochs - 1) * 1e-4) / 60)) < 1e-6 ? 0 : 1;
+}
+
+static void put_int32_be( gbuint8* d, long value ) {
+    d[0] = (value >> 24) & 0xff;
+    d[1] = (value >> 16) & 0xff;
+    d[2] = (value >> 8) & 0xff;
+    d[3] = value & 0xff;
+}
+
+/**
+  * The same hour as "nmea", as binary navigation data: framing, the message
+  * table and the conversion to fixes.
+  */
+static int bench_navigation( int rounds ) {
+    const int epochs = 3600 * NMEA_RATE;
+    gbuint8* stream = malloc(epochs * 66l);
+    gbuint8 payload[59];
+    skytraq_framer framer;
+    skytraq_message message;
+    skytraq_fix fix;
+    size_t length = 0, offset;
+    long fixes = 0;
+    double start, elapsed;
+    int e, r;
+
+    memset(payload, 0, sizeof(payload));
+    payload[0] = SKYTRAQ_RESPONSE_NAVIGATION_DATA;
+    payload[1] = 2;
+    payload[2] = 9;
+    for ( e = 0; e < epochs; e++ ) {
+        put_int32_be(payload + 5, e * (100 / NMEA_RATE));
+        put_int32_be(payload + 9, (53 + (20 + e * 1e-4) / 60) * 1e7);
+        put_int32_be(payload + 13, (10 + (20 + e * 1e-4) / 60) * 1e7);
+        put_int32_be(payload + 47, 420 + e % 7);
+        length += skytraq_frame_package(stream + length, payload, sizeof(payload));
+    }
+
+    start = now();
+    for ( r = 0; r < rounds; r++ ) {
+        fixes = 0;
+        skytraq_framer_init(&framer);
+        for ( offset = 0; offset < length; ) {
+            unsigned piece = length - offset < 256 ? length - offset : 256;
+            unsigned consumed;
+            SkyTraqPackage* p = skytraq_framer_feed(&framer, stream + offset, piece, &consumed);
+
+            offset += consumed;
+            if ( p != NULL ) {
+                if ( skytraq_decode_message(p->data, p->length, &message) == SUCCESS &&
+                     message.id == SKYTRAQ_RESPONSE_NAVIGATION_DATA ) {
+                    fix_from_navigation(&message.data.navigation, &fix);
+                    fixes++;
+                }
+                skytraq_free_package(p);
+            }
+        }
+    }
+    elapsed = now() - start;
+
+    printf("navigation: %zu bytes, %ld fixes, %.0f bytes per fix\n", length, fixes, length / (double)fixes);
+    printf("navigation: %.2f Mfixes/s\n", epochs * (double)rounds / elapsed / 1e6);
+    result("navigation.fixes", epochs * (double)rounds / elapsed / 1e6, "Mfixes/s", 1);
+
+    free(stream);
+    return fixes == epochs ? 0 : 1;
+}
+
+static volatile int shm_writer_running;
+
+/**
+  * Publish fixes as fast as possible until told to stop.
+  */
+static void* shm_writer( void* arg ) {
+    skytraq_fix fix;
+
+    memset(&fix, 0, sizeof(fix));
+    fix.fields = FIX_HAS_POSITION;
+    while ( shm_writer_running ) {
+        fix.time += 0.1;
+        fix.latitude = fix.time;
+        fix.longitude = fix.time;
+        fix_shm_publish(arg, &fix);
+    }
+    return NULL;
+}
+
+/**
+  * Time reads of the latest fix from shared memory, with an idle writer and
+  * with one that updates all the time. A torn read shows up as a fix whose
+  * latitude and longitude differ.
+  */
+static int bench_shm( int n ) {
+    char name[64];
+    skytraq_fix_shm* shm;
+    const skytraq_fix_shm* reader;
+    fix_shm_record fix;
+    skytraq_fix first;
+    pthread_t writer;
+    long torn = 0, failed = 0;
+    double start, idle, busy;
+    int i;
+
+    snprintf(name, sizeof(name), "/skytraq-bench-%d", (int)getpid());
+    shm = fix_shm_create(name);
+    reader = fix_shm_open(name);
+    if ( shm == NULL || reader == NULL )
+        return 1;
+    memset(&first, 0, sizeof(first));
+    fix_shm_publish(shm, &first);
+
+    start = now();
+    for ( i = 0; i < n; i++ )
+        failed += fix_shm_read(reader, &fix) < 0;
+    idle = now() - start;
+
+    shm_writer_running = 1;
+    pthread_create(&writer, NULL, shm_writer, shm);
+    start = now();
+    for ( i = 0; i < n; i++ ) {
+        if ( fix_shm_read(reader, &fix) < 0 )
+            failed++;
+        else
+            torn += fix.latitude != fix.longitude;
+    }
+    busy = now() - start;
+    shm_writer_running = 0;
+    pthread_join(writer, NULL);
+
+    printf("shm: %.1f ns per read, %.1f ns while the writer is busy (%llu updates), %ld torn, %ld failed\n",
+           idle / n * 1e9, busy / n * 1e9, (unsigned long long)shm->sequence / 2, torn, failed);
+    result("shm.read", idle / n * 1e9, "ns", 0);
+    result("shm.read_contended", busy / n * 1e9, "ns", 0);
+
+    fix_shm_unmap(reader);
+    fix_shm_close(shm);
+    shm_unlink(name);
+    return torn == 0 && failed == 0 ? 0 : 1;
+}
+
+static pid_t spawn( char* const* argv ) {
+    pid_t pid = fork();
+
+    if ( pid == 0 ) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+  * Dump <image> from the simulator at <rate> without changing the rate.
+  * Returns the wall time in seconds or -1 if the dump failed.
+  */
+static double timed_dump( const char* image, unsigned rate ) {
+    char sim[300], logger[300], link[64], rate_text[16];
+    char* sim_argv[] = { sim, "--link", link, "--baud-rate", rate_text, (char*)image, NULL };
+    char* logger_argv[] = { logger, "--device", link, "--baud-rate", rate_text, "--no-upshift", "--dump", NULL };
+    double start, elapsed = -1;
+    pid_t sim_pid, logger_pid;
+    int i, status;
+
+    snprintf(sim, sizeof(sim), "%s/skytraq-sim", program_dir);
+    snprintf(logger, sizeof(logger), "%s/skytraq-datalogger", program_dir);
+    snprintf(link, sizeof(link), "/tmp/skytraq-bench-%d.tty", (int)getpid());
+    snprintf(rate_text, sizeof(rate_text), "%u", rate);
+    if ( access(sim, X_OK) != 0 || access(logger, X_OK) != 0 ) {
+        fprintf(stderr, "dump: needs %s and %s\n", sim, logger);
+        return -1;
+    }
+
+    unlink(link);
+    sim_pid = spawn(sim_argv);
+    for ( i = 0; i < 200 && access(link, F_OK) != 0; i++ )
+        usleep(10000);
+
+    start = now();
+    logger_pid = spawn(logger_argv);
+    if ( logger_pid > 0 && waitpid(logger_pid, &status, 0) == logger_pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0 )
+        elapsed = now() - start;
+
+    kill(sim_pid, SIGTERM);
+    waitpid(sim_pid, NULL, 0);
+    return elapsed;
+}
+
+/**
+  * Whole dumps of a small log from skytraq-sim at several baud-rates. The line
+  * usage is the share of the time the line was busy with sector data.
+  */
+static int bench_dump( void ) {
+    static const unsigned rates[] = { 19200, 57600, 115200 };
+    char image[64], key[48];
+    int lengths[DUMP_SECTORS];
+    gbuint8** sectors = synthetic_sectors(DUMP_SECTORS, lengths, 32);
+    FILE* f;
+    int i, failed = 0;
+
+    /* the write pointer in the middle of the last sector */
+    memset(sectors[DUMP_SECTORS - 1] + SKYTRAQ_SECTOR_SIZE / 2, 0xff, SKYTRAQ_SECTOR_SIZE / 2);
+    snprintf(image, sizeof(image), "/tmp/skytraq-bench-%d.img", (int)getpid());
+    f = fopen(image, "wb");
+    for ( i = 0; i < DUMP_SECTORS; i++ ) {
+        fwrite(sectors[i], 1, SKYTRAQ_SECTOR_SIZE, f);
+        free(sectors[i]);
+    }
+    fclose(f);
+    free(sectors);
+
+    for ( i = 0; i < sizeof(rates) / sizeof(rates[0]); i++ ) {
+        double seconds = timed_dump(image, rates[i]);
+        double line_time = DUMP_SECTORS * (SKYTRAQ_SECTOR_SIZE + 19) * 10.0 / rates[i];
+
+        if ( seconds < 0 ) {
+            printf("dump: %u baud failed\n", rates[i]);
+            failed = 1;
+            continue;
+        }
+        printf("dump: %d sectors at %u baud in %.2f s, line busy %.0f%% of the time\n",
+               DUMP_SECTORS, rates[i], seconds, 100 * line_time / seconds);
+        snprintf(key, sizeof(key), "dump.%u.time", rates[i]);
+        result(key, seconds, "s", 0);
+        snprintf(key, sizeof(key), "dump.%u.line_usage", rates[i]);
+        result(key, 100 * line_time / seconds, "%", 1);
+    }
+
+    unlink(image);
+    return failed;
+}
+
+/**
+  * Write the results as JSON, one result per line.
+  */
+static int write_json( const char* path ) {
+    FILE* f = fopen(path, "w");
+    int i;
+
+    if ( f == NULL ) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return 1;
+    }
+    fprintf(f, "{\n  \"results\": [\n");
+    for ( i = 0; i < result_count; i++ ) {
+        fprintf(f, "    {\"name\": \"%s\", \"value\": %.6g, \"unit\": \"%s\", \"better\": \"%s\"}%s\n",
+                results[i].name, results[i].value, results[i].unit,
+                results[i].higher_is_better ? "higher" : "lower", i + 1 < result_count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0 ? 0 : 1;
+}
+
+/**
+  * Compare the results with a file written by write_json(). Returns 1 if a
+  * result is more than <tolerance> percent worse than its baseline.
+  */
+static int compare_baseline( const char* path, int tolerance ) {
+    FILE* f = fopen(path, "r");
+    char line[256], name[48];
+    double baseline;
+    int i, regressions = 0;
+
+    if ( f == NULL ) {
+        fprintf(stderr, "no baseline %s\n", path);
+        return 0;
+    }
+
+    printf("\n%-28s %12s %12s %8s\n", "result", "baseline", "now", "change");
+    while ( fgets(line, sizeof(line), f) != NULL ) {
+        if ( sscanf(line, " {\"name\": \"%47[^\"]\", \"value\": %lf", name, &baseline) != 2 )
+            continue;
+        for ( i = 0; i < result_count; i++ ) {
+            bench_result* r = &results[i];
+            double change;
+            int worse;
+
+            if ( strcmp(r->name, name) != 0 || baseline == 0 )
+                continue;
+            change = 100 * (r->value - baseline) / baseline;
+            worse = r->higher_is_better ? change < -tolerance : change > tolerance;
+            regressions += worse;
+            printf("%-28s %12.4g %12.4g %+7.1f%%%s\n", name, baseline, r->value, change,
+                   worse ? "  REGRESSION" : "");
+        }
+    }
+    fclose(f);
+
+    if ( regressions > 0 )
+        printf("%d results more than %d%% worse than the baseline\n", regressions, tolerance);
+    return regressions > 0;
+}
+
+static void usage( void ) {
+    fprintf(stderr, "Usage: skytraq-bench [OPTIONS] BENCHMARK [ARGS]\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "  --json <FILE>       write the results as JSON\n");
+    fprintf(stderr, "  --baseline <FILE>   compare with results written by --json before,\n");
+    fprintf(stderr, "                      fail if one is worse than the tolerance\n");
+    fprintf(stderr, "  --tolerance <PCT>   default is %d\n", DEFAULT_TOLERANCE);
+    fprintf(stderr, "BENCHMARKS\n");
+    fprintf(stderr, "  all        everything below without arguments\n");
+    fprintf(stderr, "  ecef       ECEF to geodetic conversion, scalar vs. batch\n");
+    fprintf(stderr, "  gpx        GPX track point output, printf vs. output_writer\n");
+    fprintf(stderr, "  geo        accuracy and speed of --fast-geo on a log of short entries\n");
+    fprintf(stderr, "  decode [IMAGE]\n");
+    fprintf(stderr, "             entry classification and decoding of synthetic sectors and\n");
+    fprintf(stderr, "             of an image written by --dump-raw\n");
+    fprintf(stderr, "  framer [RECORDING]\n");
+    fprintf(stderr, "             package framing of a recording of the serial line\n");
+    fprintf(stderr, "  dump       whole dumps from skytraq-sim at several baud-rates\n");
+    fprintf(stderr, "  nmea       NMEA parsing and merging into fixes at %d Hz output\n", NMEA_RATE);
+    fprintf(stderr, "  navigation the same from binary navigation data\n");
+    fprintf(stderr, "  shm        reads of the latest fix from shared memory\n");
+}
+
+static int run( const char* name, const char* arg ) {
+    if ( strcmp(name, "ecef") == 0 )
+        return bench_ecef(1 << 16, 50);
+    if ( strcmp(name, "gpx") == 0 )
+        return bench_gpx(1 << 16, 20);
+    if ( strcmp(name, "geo") == 0 )
+        return bench_geo(20);
+    if ( strcmp(name, "decode") == 0 )
+        return bench_decode(arg);
+    if ( strcmp(name, "framer") == 0 )
+        return bench_framer(arg, 10);
+    if ( strcmp(name, "dump") == 0 )
+        return bench_dump();
+    if ( strcmp(name, "nmea") == 0 )
+        return bench_nmea(5);
+    if ( strcmp(name, "navigation") == 0 )
+        return bench_navigation(5);
+    if ( strcmp(name, "shm") == 0 )
+        return bench_shm(1 << 24);
+    if ( strcmp(name, "all") == 0 ) {
+        static const char* all[] = { "ecef", "gpx", "geo", "decode", "framer", "nmea", "navigation", "dump", "shm" };
+        int i, failed = 0;
+        for ( i = 0; i < sizeof(all) / sizeof(all[0]); i++ )
+            failed |= run(all[i], NULL);
+        return failed;
+    }
+    return -1;
+}
+
+int main( int argc, char** argv ) {
+    const char* json = NULL;
+    const char* baseline = NULL;
+    const char* slash = strrchr(argv[0], '/');
+    int i, failed, tolerance = DEFAULT_TOLERANCE;
+
+    if ( slash != NULL )
+        snprintf(program_dir, sizeof(program_dir), "%.*s", (int)(slash - argv[0]), argv[0]);
+
+    for ( i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2 ) {
+        if ( strcmp(argv[i], "--json") == 0 )
+            json = argv[i+1];
+        else if ( strcmp(argv[i], "--baseline") == 0 )
+            baseline = argv[i+1];
+        else if ( strcmp(argv[i], "--tolerance") == 0 )
+            tolerance = atoi(argv[i+1]);
+        else
+            break;
+    }
+    if ( i >= argc ) {
+        usage();
+        return 2;
+    }
+
+    failed = run(argv[i], i + 1 < argc ? argv[i+1] : NULL);
+    if ( failed < 0 ) {
+        usage();
+        return 2;
+    }
+
+    if ( json != NULL )
+        failed |= write_json(json);
+    if ( baseline != NULL )
+        failed |= compare_baseline(baseline, tolerance);
+    return failed;
+}
@@ -0,0 +1,669 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+/*
+ * Daemon mode: one process owns the serial port and shares it.
+ *
+ * Everything the receiver sends is scanned twice: NMEA sentences are merged
+ * into fixes, binary packages are either navigation data (also fixes) or the
+ * answer to the command in flight. Fixes go to every client of the Unix
+ * socket as JSON lines. Clients send commands as text lines; they are queued
+ * and sent to the device one at a time while the stream keeps running.
+ *
+ * Every client has a bounded queue. A client whose queue is full is
+ * disconnected, so a slow client never stops the reading of the serial port.
+ *
+ * With --shm the latest fix is also kept in shared memory (fix-shm.h), for
+ * readers that only need the current position.
+ */
+
+#include "datalogger.h"
+#include "lowlevel.h"
+#include "live-fix.h"
+#include "daemon.h"
+#include "fix-shm.h"
+#include "message-decode.h"
+#include "trace.h"
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CLIENTS         32
+#define CLIENT_QUEUE_SIZE   65536   /* bytes waiting to be sent to one client */
+#define LINE_LENGTH         256     /* longest command line from a client */
+#define MAX_REQUESTS        16      /* commands waiting for the device */
+#define COMMAND_TIMEOUT     2000    /* ms */
+#define MESSAGE_SIZE        512
+#define READ_SIZE           4096
+
+#define RESPONSE_NONE       -1
+
+enum { WAIT_NONE, WAIT_ACK, WAIT_RESPONSE };
+enum { REQUEST_INFO, REQUEST_VERSION, REQUEST_CONFIG, REQUEST_WRITE_CONFIG, REQUEST_OUTPUT };
+
+static const char* request_names[] = { "info", "version", "config", "config", "output" };
+
+typedef struct client {
+    int             fd;             /* -1 if the slot is free */
+    unsigned long   id;             /* never reused, requests refer to it */
+    char*           queue;          /* CLIENT_QUEUE_SIZE bytes */
+    unsigned        head, tail;     /* free running, head - tail bytes are queued */
+    char            line[LINE_LENGTH];
+    int             length;
+} client;
+
+typedef struct request {
+    unsigned long   client;
+    int             kind;           /* REQUEST_* */
+    char            arguments[LINE_LENGTH];
+    skytraq_config  config;         /* REQUEST_WRITE_CONFIG */
+} request;
+
+typedef struct server {
+    int             fd;             /* serial port */
+    int             listener;       /* -1 without a socket */
+    skytraq_fix_shm* shm;           /* NULL without shared memory */
+    client          clients[MAX_CLIENTS];
+    unsigned long   next_id;
+    request         requests[MAX_REQUESTS];
+    int             first, count;   /* ring of queued requests, the first one may be in flight */
+    int             wait;           /* WAIT_* for the first request */
+    gbuint8         command;        /* message id sent for it */
+    int             response;       /* message id of the answer or RESPONSE_NONE */
+    double          sent, deadline;
+    skytraq_framer  framer;
+    fix_builder     nmea;
+    unsigned long   fixes, dropped;
+} server;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop( int sig ) {
+    stop_requested = 1;
+}
+
+static void drop_client( client* c, const char* reason ) {
+    DEBUG("client %lu: %s\n", c->id, reason);
+    close(c->fd);
+    free(c->queue);
+    c->fd = -1;
+    c->queue = NULL;
+}
+
+/**
+  * Send as much of the queue as the socket takes without blocking.
+  */
+static void flush_client( client* c ) {
+    while ( c->head != c->tail ) {
+        unsigned start = c->tail % CLIENT_QUEUE_SIZE;
+        unsigned length = c->head - c->tail;
+        ssize_t n;
+
+        if ( length > CLIENT_QUEUE_SIZE - start )
+            length = CLIENT_QUEUE_SIZE - start;
+        n = send(c->fd, c->queue + start, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if ( n < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+                drop_client(c, "disconnected");
+            return;
+        }
+        c->tail += n;
+    }
+}
+
+/**
+  * Queue <length> bytes for <c>. A client without room for the message is
+  * dropped instead of waiting for it.
+  */
+static void send_to_client( server* s, client* c, const char* message, int length ) {
+    unsigned start, first;
+
+    if ( length > CLIENT_QUEUE_SIZE - (int)(c->head - c->tail) ) {
+        fprintf(stderr, "Dropping client %lu, it does not keep up.\n", c->id);
+        drop_client(c, "queue full");
+        s->dropped++;
+        return;
+    }
+    start = c->head % CLIENT_QUEUE_SIZE;
+    first = CLIENT_QUEUE_SIZE - start;
+    if ( first > (unsigned)length )
+        first = length;
+    memcpy(c->queue + start, message, first);
+    memcpy(c->queue, message + first, length - first);
+    c->head += length;
+    flush_client(c);
+}
+
+static client* find_client( server* s, unsigned long id ) {
+    int i;
+
+    for ( i = 0; i < MAX_CLIENTS; i++ )
+        if ( s->clients[i].fd != -1 && s->clients[i].id == id )
+            return &s->clients[i];
+    return NULL;
+}
+
+static void reply( server* s, unsigned long id, const char* message ) {
+    client* c = find_client(s, id);
+
+    /* the client may have gone while its command was running */
+    if ( c != NULL )
+        send_to_client(s, c, message, strlen(message));
+}
+
+static void reply_error( server* s, unsigned long id, const char* command, const char* text ) {
+    char message[MESSAGE_SIZE];
+
+    snprintf(message, sizeof(message), "{\"type\": \"error\", \"command\": \"%.32s\", \"message\": \"%.128s\"}\n",
+             command, text);
+    reply(s, id, message);
+}
+
+static void publish_fix( const skytraq_fix* fix, void* context ) {
+    server* s = context;
+    char message[MESSAGE_SIZE];
+    int length = fix_to_json(fix, message, sizeof(message));
+    int i;
+
+    s->fixes++;
+    if ( s->shm != NULL )
+        fix_shm_publish(s->shm, fix);
+    for ( i = 0; i < MAX_CLIENTS; i++ )
+        if ( s->clients[i].fd != -1 )
+            send_to_client(s, &s->clients[i], message, length);
+}
+
+static void send_command( server* s, const gbuint8* payload, int length, int response ) {
+    gbuint8 frame[SKYTRAQ_FRAME_OVERHEAD + SKYTRAQ_CONFIG_PAYLOAD_SIZE];
+    int frame_length = skytraq_frame_package(frame, payload, length);
+
+    s->command = payload[0];
+    s->response = response;
+    s->wait = WAIT_ACK;
+    s->sent = monotonic_time();
+    s->deadline = s->sent + COMMAND_TIMEOUT / 1000.0;
+    if ( write_buffer(s->fd, frame, frame_length) != frame_length )
+        s->deadline = s->sent; /* counts as a timeout */
+}
+
+/**
+  * Send the command for the first queued request.
+  */
+static void start_request( server* s ) {
+    request* r = &s->requests[s->first];
+    gbuint8 command[SKYTRAQ_CONFIG_PAYLOAD_SIZE];
+
+    switch ( r->kind ) {
+    case REQUEST_INFO:
+    case REQUEST_CONFIG:
+        command[0] = SKYTRAQ_COMMAND_GET_CONFIG;
+        send_command(s, command, 1, SKYTRAQ_RESPONSE_LOG_STATUS);
+        break;
+    case REQUEST_VERSION:
+        command[0] = SKYTRAQ_COMMAND_QUERY_SOFTWARE_VERSION;
+        command[1] = 1;
+        send_command(s, command, 2, SKYTRAQ_RESPONSE_SOFTWARE_VERSION);
+        break;
+    case REQUEST_WRITE_CONFIG:
+        skytraq_config_payload(&r->config, command);
+        send_command(s, command, SKYTRAQ_CONFIG_PAYLOAD_SIZE, RESPONSE_NONE);
+        break;
+    case REQUEST_OUTPUT:
+        command[0] = SKYTRAQ_COMMAND_CONFIGURE_MESSAGE_TYPE;
+        command[1] = !strcmp(r->arguments, "nmea") ? 1 : !strcmp(r->arguments, "binary") ? 2 : 0;
+        command[2] = 0;  /* 1 = permanent */
+        send_command(s, command, 3, RESPONSE_NONE);
+        break;
+    }
+}
+
+/**
+  * The first request is answered (or failed): go on with the next one.
+  */
+static void finish_request( server* s ) {
+    s->wait = WAIT_NONE;
+    s->first = (s->first + 1) % MAX_REQUESTS;
+    s->count--;
+    if ( s->count > 0 )
+        start_request(s);
+}
+
+static void queue_request( server* s, client* c, int kind, const char* arguments ) {
+    request* r;
+
+    if ( s->count == MAX_REQUESTS ) {
+        reply_error(s, c->id, request_names[kind], "too many commands waiting");
+        return;
+    }
+    r = &s->requests[(s->first + s->count) % MAX_REQUESTS];
+    r->client = c->id;
+    r->kind = kind;
+    snprintf(r->arguments, sizeof(r->arguments), "%s", arguments);
+    s->count++;
+    if ( s->count == 1 )
+        start_request(s);
+}
+
+/**
+  * Parse the value of a numeric setting: a whole word of digits that fits the
+  * 32 bit fields of the configuration. Returns ERROR for anything else.
+  */
+static int parse_setting( const char* value, gbuint32* number ) {
+    char* end;
+    long n;
+
+    errno = 0;
+    n = strtol(value, &end, 10);
+    if ( end == value || *end != 0 || errno != 0 || n < 0 || n > 0xffffffffl )
+        return ERROR;
+    *number = n;
+    return SUCCESS;
+}
+
+/**
+  * Apply "key=value ..." from a config command to <config>. Returns the
+  * offending word or NULL.
+  */
+static const char* apply_settings( char* arguments, skytraq_config* config ) {
+    char* word;
+
+    for ( word = strtok(arguments, " \t"); word != NULL; word = strtok(NULL, " \t") ) {
+        char* value = strchr(word, '=');
+        int ok = 1;
+
+        if ( value == NULL )
+            return word;
+        *value++ = 0;
+        if ( !strcmp(word, "time") ) {
+            ok = parse_setting(value, &config->min_time) == SUCCESS;
+        } else if ( !strcmp(word, "max-time") ) {
+            ok = parse_setting(value, &config->max_time) == SUCCESS;
+        } else if ( !strcmp(word, "dist") ) {
+            ok = parse_setting(value, &config->min_distance) == SUCCESS;
+        } else if ( !strcmp(word, "max-dist") ) {
+            ok = parse_setting(value, &config->max_distance) == SUCCESS;
+        } else if ( !strcmp(word, "speed") ) {
+            ok = parse_setting(value, &config->min_speed) == SUCCESS;
+        } else if ( !strcmp(word, "max-speed") ) {
+            ok = parse_setting(value, &config->max_speed) == SUCCESS;
+        } else if ( !strcmp(word, "log") && (!strcmp(value, "on") || !strcmp(value, "off")) ) {
+            config->datalog_enable = !strcmp(value, "on");
+        } else if ( !strcmp(word, "mode") && (!strcmp(value, "fifo") || !strcmp(value, "stop")) ) {
+            config->log_fifo_mode = !strcmp(value, "fifo");
+        } else {
+            ok = 0;
+        }
+        if ( !ok ) {
+            value[-1] = '=';
+            return word;
+        }
+    }
+    return NULL;
+}
+
+/**
+  * The answer to the first request arrived.
+  */
+static void handle_response( server* s, const skytraq_message* m ) {
+    request* r = &s->requests[s->first];
+    char message[MESSAGE_SIZE];
+
+    if ( r->kind == REQUEST_VERSION ) {
+        const skytraq_version* v = &m->data.version;
+
+        snprintf(message, sizeof(message), "{\"type\": \"version\", \"kernel\": \"%d.%d.%d\", "
+                 "\"odm\": \"%d.%d.%d\", \"revision\": \"20%02d-%02d-%02d\"}\n",
+                 v->kernel[0], v->kernel[1], v->kernel[2], v->odm[0], v->odm[1], v->odm[2],
+                 v->revision[0], v->revision[1], v->revision[2]);
+        reply(s, r->client, message);
+    } else if ( r->kind == REQUEST_INFO ) {
+        const skytraq_config* config = &m->data.config;
+
+        snprintf(message, sizeof(message), "{\"type\": \"info\", \"log_wr_ptr\": %lu, \"sectors_left\": %u, "
+                 "\"total_sectors\": %u, \"min_time\": %lu, \"max_time\": %lu, \"min_distance\": %lu, "
+                 "\"max_distance\": %lu, \"min_speed\": %lu, \"max_speed\": %lu, \"log\": %s, \"mode\": \"%s\"}\n",
+                 config->log_wr_ptr, config->sectors_left, config->total_sectors, config->min_time,
+                 config->max_time, config->min_distance, config->max_distance, config->min_speed,
+                 config->max_speed, config->datalog_enable ? "true" : "false",
+                 config->log_fifo_mode ? "fifo" : "stop");
+        reply(s, r->client, message);
+    } else {
+        const char* wrong;
+        int i;
+
+        r->config = m->data.config;
+        wrong = apply_settings(r->arguments, &r->config);
+        if ( wrong != NULL ) {
+            snprintf(message, sizeof(message), "bad setting %.64s", wrong);
+            for ( i = 0; message[i] != 0; i++ )
+                if ( message[i] == '"' || message[i] == '\\' || (unsigned char)message[i] < ' ' )
+                    message[i] = '?';
+            reply_error(s, r->client, "config", message);
+        } else {
+            /* the same request goes on with writing the changed configuration */
+            r->kind = REQUEST_WRITE_CONFIG;
+            start_request(s);
+            return;
+        }
+    }
+    finish_request(s);
+}
+
+static void handle_package( server* s, const SkyTraqPackage* p ) {
+    request* r = &s->requests[s->first];
+    skytraq_message m;
+
+    if ( skytraq_decode_message(p->data, p->length, &m) != SUCCESS ) {
+        /* a short answer to the command in flight fails it at the deadline */
+        return;
+    } else if ( m.id == SKYTRAQ_RESPONSE_NAVIGATION_DATA ) {
+        skytraq_fix fix;
+
+        fix_from_navigation(&m.data.navigation, &fix);
+        publish_fix(&fix, s);
+    } else if ( s->wait == WAIT_ACK && (m.id == SKYTRAQ_RESPONSE_ACK || m.id == SKYTRAQ_RESPONSE_NACK) &&
+                m.data.command == s->command ) {
+        skytraq_count_command(s->fd, s->command, m.id == SKYTRAQ_RESPONSE_ACK ? ACK : NACK, s->sent);
+        if ( m.id == SKYTRAQ_RESPONSE_NACK ) {
+            reply_error(s, r->client, request_names[r->kind], "the device rejected the command");
+            finish_request(s);
+        } else if ( s->response == RESPONSE_NONE ) {
+            char message[MESSAGE_SIZE];
+
+            snprintf(message, sizeof(message), "{\"type\": \"ok\", \"command\": \"%s\"}\n",
+                     request_names[r->kind]);
+            reply(s, r->client, message);
+            finish_request(s);
+        } else {
+            s->wait = WAIT_RESPONSE;
+            s->deadline = monotonic_time() + COMMAND_TIMEOUT / 1000.0;
+        }
+    } else if ( s->wait == WAIT_RESPONSE && m.id == s->response ) {
+        handle_response(s, &m);
+    }
+}
+
+static void handle_timeout( server* s ) {
+    request* r = &s->requests[s->first];
+
+    if ( s->wait == WAIT_ACK )
+        skytraq_count_command(s->fd, s->command, ERROR, s->sent);
+    else
+        trace_error(s->fd, "no answer 0x%02x to command 0x%02x", s->response, s->command);
+    reply_error(s, r->client, request_names[r->kind], "no answer from the device");
+    finish_request(s);
+}
+
+static void handle_serial( server* s ) {
+    gbuint8 buffer[READ_SIZE];
+    int length = read_available(s->fd, buffer, sizeof(buffer));
+    unsigned offset = 0;
+
+    if ( length < 0 ) {
+        fprintf(stderr, "Cannot read from the device: %s\n", strerror(errno));
+        stop_requested = 1;
+        return;
+    }
+    fix_builder_feed(&s->nmea, buffer, length, publish_fix, s);
+    while ( offset < (unsigned)length ) {
+        unsigned consumed;
+        SkyTraqPackage* p = skytraq_framer_feed(&s->framer, buffer + offset, length - offset, &consumed);
+
+        offset += consumed;
+        if ( p != NULL ) {
+            handle_package(s, p);
+            skytraq_free_package(p);
+        }
+    }
+}
+
+/**
+  * One line from a client: a command for the device.
+  */
+static void handle_command( server* s, client* c, char* line ) {
+    char* arguments;
+
+    while ( *line == ' ' || *line == '\t' )
+        line++;
+    arguments = line + strcspn(line, " \t");
+    if ( *arguments != 0 )
+        *arguments++ = 0;
+    arguments += strspn(arguments, " \t");
+
+    if ( *line == 0 ) {
+        return;
+    } else if ( !strcmp(line, "info") ) {
+        queue_request(s, c, REQUEST_INFO, "");
+    } else if ( !strcmp(line, "version") ) {
+        queue_request(s, c, REQUEST_VERSION, "");
+    } else if ( !strcmp(line, "config") && *arguments == 0 ) {
+        /* nothing to change, writing the flash would be for nothing */
+        reply_error(s, c->id, line, "config needs key=value settings, use info to read them");
+    } else if ( !strcmp(line, "config") ) {
+        queue_request(s, c, REQUEST_CONFIG, arguments);
+    } else if ( !strcmp(line, "output") && (!strcmp(arguments, "nmea") || !strcmp(arguments, "binary") ||
+                                            !strcmp(arguments, "off")) ) {
+        queue_request(s, c, REQUEST_OUTPUT, arguments);
+    } else {
+        char* p;
+
+        /* the name goes back in a JSON string */
+        for ( p = line; *p != 0; p++ )
+            if ( !isalnum((unsigned char)*p) && *p != '-' )
+                *p = '?';
+        reply_error(s, c->id, line, "unknown command, use info, version, config or output");
+    }
+}
+
+static void handle_client_input( server* s, client* c ) {
+    char buffer[READ_SIZE];
+    ssize_t n = recv(c->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    int i;
+
+    if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+        drop_client(c, "disconnected");
+        return;
+    }
+    for ( i = 0; i < n && c->fd != -1; i++ ) {
+        if ( buffer[i] == '\n' ) {
+            c->line[c->length] = 0;
+            if ( c->length > 0 && c->line[c->length - 1] == '\r' )
+                c->line[c->length - 1] = 0;
+            c->length = 0;
+            handle_command(s, c, c->line);
+        } else if ( c->length < LINE_LENGTH - 1 ) {
+            c->line[c->length++] = buffer[i];
+        }
+    }
+}
+
+static void accept_client( server* s, const char* device ) {
+    char message[MESSAGE_SIZE];
+    int fd = accept(s->listener, NULL, NULL);
+    client* c;
+    int i;
+
+    if ( fd < 0 )
+        return;
+    for ( i = 0; i < MAX_CLIENTS && s->clients[i].fd != -1; i++ )
+        ;
+    if ( i == MAX_CLIENTS ) {
+        fprintf(stderr, "Too many clients, refusing a connection.\n");
+        close(fd);
+        return;
+    }
+    c = &s->clients[i];
+    c->queue = malloc(CLIENT_QUEUE_SIZE);
+    if ( c->queue == NULL ) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->id = ++s->next_id;
+    c->head = c->tail = 0;
+    c->length = 0;
+    DEBUG("client %lu connected\n", c->id);
+
+    snprintf(message, sizeof(message), "{\"type\": \"hello\", \"device\": \"%s\", \"client\": %lu}\n",
+             device, c->id);
+    send_to_client(s, c, message, strlen(message));
+}
+
+static int open_socket( const char* path ) {
+    struct sockaddr_un address;
+    int fd;
+
+    if ( strlen(path) >= sizeof(address.sun_path) ) {
+        fprintf(stderr, "Socket name %s is too long.\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( fd < 0 ) {
+        perror("socket");
+        return -1;
+    }
+    /* a socket left over from a daemon that was killed */
+    unlink(path);
+    if ( bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 8) < 0 ) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+  * Serve fixes and device commands to clients of the Unix socket
+  * <socket_path> and publish the fixes in the shared memory <shm_name>, until
+  * SIGINT or SIGTERM. Either may be NULL. <fd> is the port of a device that
+  * has already been detected.
+  */
+int skytraq_run_daemon( int fd, const char* device, const char* socket_path, const char* shm_name ) {
+    struct pollfd fds[2 + MAX_CLIENTS];
+    client* polled[2 + MAX_CLIENTS];
+    struct sigaction action;
+    server* s;
+    int i;
+
+    s = calloc(1, sizeof(server));
+    if ( s == NULL )
+        return ERROR;
+    s->fd = fd;
+    for ( i = 0; i < MAX_CLIENTS; i++ )
+        s->clients[i].fd = -1;
+    skytraq_framer_init(&s->framer);
+    fix_builder_init(&s->nmea);
+
+    s->listener = -1;
+    if ( socket_path != NULL && (s->listener = open_socket(socket_path)) < 0 ) {
+        free(s);
+        return ERROR;
+    }
+    if ( shm_name != NULL && (s->shm = fix_shm_create(shm_name)) == NULL ) {
+        if ( s->listener != -1 ) {
+            close(s->listener);
+            unlink(socket_path);
+        }
+        free(s);
+        return ERROR;
+    }
+
+    /* no SA_RESTART: poll() has to return to see the request */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "Serving %s on %s%s%s\n", device, socket_path ? socket_path : "",
+            socket_path && shm_name ? " and " : "", shm_name ? shm_name : "");
+
+    while ( !stop_requested ) {
+        int count = 2, timeout = -1;
+
+        fds[0].fd = s->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = s->listener; /* ignored by poll() if -1 */
+        fds[1].events = POLLIN;
+        for ( i = 0; i < MAX_CLIENTS; i++ ) {
+            client* c = &s->clients[i];
+
+            if ( c->fd == -1 )
+                continue;
+            fds[count].fd = c->fd;
+            fds[count].events = POLLIN | (c->head != c->tail ? POLLOUT : 0);
+            polled[count++] = c;
+        }
+        if ( s->wait != WAIT_NONE ) {
+            timeout = (s->deadline - monotonic_time()) * 1000 + 1;
+            if ( timeout < 0 )
+                timeout = 0;
+        }
+
+        if ( poll(fds, count, timeout) < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            perror("poll");
+            break;
+        }
+
+        /* the serial port first: it must never fall behind */
+        if ( fds[0].revents & (POLLIN | POLLERR | POLLHUP) )
+            handle_serial(s);
+        if ( s->wait != WAIT_NONE && monotonic_time() >= s->deadline )
+            handle_timeout(s);
+
+        for ( i = 2; i < count; i++ ) {
+            client* c = polled[i];
+
+            if ( c->fd != fds[i].fd )
+                continue; /* dropped while serving the port */
+            if ( fds[i].revents & POLLOUT )
+                flush_client(c);
+            if ( c->fd != -1 && (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) )
+                handle_client_input(s, c);
+        }
+        if ( fds[1].revents & POLLIN )
+            accept_client(s, device);
+    }
+
+    fprintf(stderr, "Stopping: %lu fixes served, %lu slow clients dropped, %lu NMEA checksum errors\n",
+             s->fixes, s->dropped, s->nmea.parser.checksum_errors);
+    for ( i = 0; i < MAX_CLIENTS; i++ )
+        if ( s->clients[i].fd != -1 )
+            drop_client(&s->clients[i], "stopping");
+    if ( s->listener != -1 ) {
+        close(s->listener);
+        unlink(socket_path);
+    }
+    if ( s->shm != NULL )
+        fix_shm_close(s->shm);
+    free(s);
+    return SUCCESS;
+}
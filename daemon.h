@@ -0,0 +1,31 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef daemon_h
+#define daemon_h
+
+/* the socket clients connect to unless --daemon names another one */
+#define DAEMON_DEFAULT_SOCKET "/tmp/skytraq-datalogger.sock"
+
+int skytraq_run_daemon( int fd, const char* device, const char* socket_path, const char* shm_name );
+
+#endif
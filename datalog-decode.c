@@ -21,7 +21,9 @@
  */
 
 #include "datalogger.h"
+#include "datalog-decode.h"
 #include <time.h>
+#include <stdint.h>
 
 
 void ecef_to_geo( double X, double Y, double Z, double* longitude, double* latitude, double* height) {
@@ -64,7 +66,8 @@ unsigned long gsp_time_to_timestamp( int wno, int tow) {
 }
 
 void timestamp_to_iso8601str(char *time_string, time_t timestamp) {
-    struct tm *tm = gmtime(&timestamp);
+    struct tm tm_buf;
+    struct tm *tm = gmtime_r(&timestamp, &tm_buf);
     char *format;
     int n;
     /* sample of iso8601 time in UTC: 2008-10-16T14:55:29Z */
@@ -79,13 +82,13 @@ void timestamp_to_iso8601str(char *time_string, time_t timestamp) {
     time_string[n++] = 'Z';
 }
 
-void output_gpx_trk_point( const long timestamp, const double latitude, const double longitude, const double height, const int speed) {
+void output_gpx_trk_point( FILE* out, const long timestamp, const double latitude, const double longitude, const double height, const int speed) {
     char iso8601str[] = "2008-10-16T14:55:29Z";
     timestamp_to_iso8601str(iso8601str, timestamp);
-    printf(" <trkpt lat=\"%f\" lon=\"%f\"><ele>%f</ele><time>%s</time><speed>%d</speed></trkpt>\n", latitude, longitude,height,iso8601str, speed);
+    fprintf(out, " <trkpt lat=\"%f\" lon=\"%f\"><ele>%f</ele><time>%s</time><speed>%d</speed></trkpt>\n", latitude, longitude,height,iso8601str, speed);
 }
 
-void decode_long_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed) {
+static inline void long_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed) {
     int wno, tow;
 
     *speed = d[1];
@@ -98,7 +101,7 @@ void decode_long_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y,
     *time = gsp_time_to_timestamp(wno,tow);
 }
 
-void decode_short_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed ) {
+static inline void short_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed ) {
     int dt, dx,dy,dz;
     *speed = d[1];
     dt = (d[2] << 8) + d[3];
@@ -123,58 +126,350 @@ void decode_short_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y,
     *ecef_z = *ecef_z + dz;
 }
 
-/** returns the last recorded timestamp */
-long process_buffer(const gbuint8* buffer, const int length, const long first_timestamp ) {
-    int offset = 0;
-    long time;
-    int ecef_x,  ecef_y, ecef_z,  speed;
-    double latitude, longitude, height;
-    int tagged_entry = 0;
-    long last_timestamp = first_timestamp;
+void decode_long_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed ) {
+    long_entry(d, time, ecef_x, ecef_y, ecef_z, speed);
+}
 
-    DEBUG("processing %d bytes\n", length);
+void decode_short_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed ) {
+    short_entry(d, time, ecef_x, ecef_y, ecef_z, speed);
+}
+
+/*
+ * Length of the entry starting with a given byte: 18 for long entries (bit 6
+ * set), 8 for short entries (0x80), 0 for bytes that do not start an entry.
+ */
+#define ENTRY_LENGTH(b) (((b) & 0x40) ? 18 : ((b) == 0x80) ? 8 : 0)
+#define ENTRY_LENGTH4(b) ENTRY_LENGTH(b), ENTRY_LENGTH(b+1), ENTRY_LENGTH(b+2), ENTRY_LENGTH(b+3)
+#define ENTRY_LENGTH16(b) ENTRY_LENGTH4(b), ENTRY_LENGTH4(b+4), ENTRY_LENGTH4(b+8), ENTRY_LENGTH4(b+12)
+#define ENTRY_LENGTH64(b) ENTRY_LENGTH16(b), ENTRY_LENGTH16(b+16), ENTRY_LENGTH16(b+32), ENTRY_LENGTH16(b+48)
 
-    printf("<!-- next sector -->\n");
+static const gbuint8 entry_length[256] = {
+    ENTRY_LENGTH64(0), ENTRY_LENGTH64(64), ENTRY_LENGTH64(128), ENTRY_LENGTH64(192)
+};
 
-    while ( offset < length ) {
+/* erased flash reads as 0xFF; a run this long cannot be a long entry */
+#define ERASED_RUN 18
 
+/* length of the run of 0xFF bytes at <p>, at most <max> */
+static int erased_run( const gbuint8* p, int max ) {
+    int n = 0;
 
-        if ( buffer[offset] & 0x40 ) {
-            /* long entry */
-            decode_long_entry(buffer+offset,  &time, &ecef_x,&ecef_y, &ecef_z, &speed);
-            ecef_to_geo(ecef_x, ecef_y,ecef_z ,&longitude, &latitude, &height);
-            if ( buffer[offset] & 0x20 ) {
-                tagged_entry = 1;
-            }
+    while ( n + 8 <= max ) {
+        uint64_t word;
 
-            if ( (last_timestamp >  0) && (time > (last_timestamp + 3600l) )) {
-                /* start a new track segment if the time difference between
-                  two points is more than one hour */
-                printf("</trkseg>\n<trkseg>\n");
-            }
-            output_gpx_trk_point( time, latitude, longitude, height, speed);
-
-            offset += 18;
-        } else if (  buffer[offset] == 0x80 ) {
-            /* short entry */
-            decode_short_entry(buffer+offset,  &time, &ecef_x,&ecef_y, &ecef_z, &speed);
-            ecef_to_geo(ecef_x, ecef_y,ecef_z ,&longitude, &latitude, &height);
-
-            if ( (last_timestamp >  0) && (time > (last_timestamp + 3600l) )) {
-                /* start a new track segment if the time difference between
-                  two points is more than one hour */
-                printf("</trkseg>\n<trkseg>\n");
+        memcpy(&word, p + n, 8);
+        if ( word != ~(uint64_t)0 )
+            break;
+        n += 8;
+    }
+    while ( n < max && p[n] == 0xff )
+        n++;
+    return n;
+}
+
+/*
+ * Length of the run at <p> (at most <max>) that holds no lead byte. Whole words
+ * are skipped while none of their bytes has bit 6 set or equals 0x80.
+ */
+static int garbage_run( const gbuint8* p, int max ) {
+    const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+    int n = 0;
+
+    while ( n + 8 <= max ) {
+        uint64_t word, x;
+
+        memcpy(&word, p + n, 8);
+        x = word ^ highs;
+        if ( (word & (ones << 6)) || ((x - ones) & ~x & highs) )
+            break;
+        n += 8;
+    }
+    while ( n < max && entry_length[p[n]] == 0 )
+        n++;
+    return n;
+}
+
+/**
+  * Start decoding with <first_timestamp> as the time of the previous point and
+  * clear the statistics.
+  */
+void decode_init( decode_state* st, long first_timestamp ) {
+    memset(&st->stats, 0, sizeof(decode_stats));
+    st->fast_geo = 0;
+    decode_start_sector(st, first_timestamp);
+}
+
+/**
+  * Reset the decoder state at the beginning of a sector.
+  */
+void decode_start_sector( decode_state* st, long last_timestamp ) {
+    st->anchor.valid = 0;
+    st->gap = 0;
+    st->time = last_timestamp;
+    st->ecef_x = 0;
+    st->ecef_y = 0;
+    st->ecef_z = 0;
+    st->last_timestamp = last_timestamp;
+}
+
+/**
+  * Decode the entry at <*offset> and advance <*offset> to the next entry. Returns 1
+  * and fills <point> (if not NULL) when the entry is a track point, 0 if bytes
+  * up to the next possible entry or a run of erased flash had to be skipped
+  * (never beyond <end>). Nothing after <end> is read, an entry cut off there
+  * is skipped. The geodetic coordinates are not computed here.
+  */
+int decode_entry( const gbuint8* buffer, int* offset, int end, decode_state* st, skytraq_point* point ) {
+    const gbuint8* d = buffer + *offset;
+    int speed, kind, tagged = 0;
+    long last_timestamp = st->last_timestamp;
+
+    if ( *offset + entry_length[d[0]] > end ) {
+        int rest = end - *offset;
+        if ( erased_run(d, rest) == rest )
+            st->stats.erased_bytes += rest;
+        else
+            st->stats.skipped_bytes += rest;
+        st->last_timestamp = st->time;
+        st->gap = 1;
+        *offset = end;
+        return 0;
+    }
+
+    switch ( entry_length[d[0]] ) {
+    case 18:
+        if ( d[0] == 0xff ) {
+            int run = erased_run(d, end - *offset);
+            if ( run >= ERASED_RUN ) {
+                st->stats.erased_bytes += run;
+                st->last_timestamp = st->time;
+                st->gap = 1;
+                *offset += run;
+                return 0;
             }
-            output_gpx_trk_point( time, latitude, longitude, height, speed);
+        }
+        long_entry(d,  &st->time, &st->ecef_x,&st->ecef_y, &st->ecef_z, &speed);
+        kind = SKYTRAQ_ENTRY_LONG;
+        tagged = (d[0] & 0x20) != 0;
+        st->stats.long_entries++;
+        *offset += 18;
+        break;
+    case 8:
+        short_entry(d,  &st->time, &st->ecef_x,&st->ecef_y, &st->ecef_z, &speed);
+        kind = SKYTRAQ_ENTRY_SHORT;
+        st->stats.short_entries++;
+        *offset += 8;
+        break;
+    default: {
+        /* search for valid entry */
+        int skip = 1;
+        if ( *offset + 1 < end )
+            skip += garbage_run(d + 1, end - *offset - 1);
+        st->stats.skipped_bytes += skip;
+        st->last_timestamp = st->time;
+        st->gap = 1;
+        *offset += skip;
+        return 0;
+    }
+    }
 
-            offset += 8;
-        } else {
-            /* search for valid entry */
-            offset++;
+    st->last_timestamp = st->time;
+    if ( point != NULL ) {
+        point->time = st->time;
+        point->ecef_x = st->ecef_x;
+        point->ecef_y = st->ecef_y;
+        point->ecef_z = st->ecef_z;
+        point->speed = speed;
+        point->kind = kind;
+        point->tagged = tagged;
+        point->after_gap = st->gap;
+        /* start a new track segment if the time difference between
+          two points is more than one hour */
+        point->new_segment = (last_timestamp > 0) && (st->time > (last_timestamp + 3600l));
+    }
+    st->gap = 0;
+    return 1;
+}
+
+/*
+ * Fast conversion: long entries, points after skipped bytes and points too
+ * far from the anchor are converted exactly and become the new anchor, the
+ * others are linearized.
+ */
+static void convert_linearized( decode_state* st, skytraq_point* points,
+                                const double* x, const double* y, const double* z, int n ) {
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        skytraq_point* p = &points[i];
+
+        if ( p->kind == SKYTRAQ_ENTRY_SHORT && !p->after_gap &&
+             geo_anchor_convert(&st->anchor, x[i], y[i], z[i], &p->longitude, &p->latitude, &p->height) ) {
+            st->stats.linearized++;
+            continue;
         }
+        ecef_to_geo(x[i], y[i], z[i], &p->longitude, &p->latitude, &p->height);
+        geo_anchor_set(&st->anchor, x[i], y[i], z[i], p->longitude, p->latitude, p->height);
+    }
+}
+
+/**
+  * Decode entries from <*offset> up to <end> into <points> until <max_points>
+  * are found, and convert their coordinates in one batch. Returns the number of
+  * points.
+  */
+static int decode_batch( const gbuint8* buffer, int* offset, int end, decode_state* st,
+                         skytraq_point* points, int max_points ) {
+    double x[SKYTRAQ_SECTOR_POINTS], y[SKYTRAQ_SECTOR_POINTS], z[SKYTRAQ_SECTOR_POINTS];
+    double longitude[SKYTRAQ_SECTOR_POINTS], latitude[SKYTRAQ_SECTOR_POINTS], height[SKYTRAQ_SECTOR_POINTS];
+    int i, n = 0;
+
+    if ( max_points > SKYTRAQ_SECTOR_POINTS )
+        max_points = SKYTRAQ_SECTOR_POINTS;
+
+    while ( *offset < end && n < max_points ) {
+        if ( decode_entry(buffer, offset, end, st, &points[n]) ) {
+            x[n] = points[n].ecef_x;
+            y[n] = points[n].ecef_y;
+            z[n] = points[n].ecef_z;
+            n++;
+        }
+    }
+    if ( n == 0 )
+        return 0;
+
+    if ( st->fast_geo ) {
+        convert_linearized(st, points, x, y, z, n);
+        return n;
+    }
+
+    ecef_to_geo_batch(x, y, z, longitude, latitude, height, n);
+    for ( i = 0; i < n; i++ ) {
+        points[i].latitude = latitude[i];
+        points[i].longitude = longitude[i];
+        points[i].height = height[i];
+    }
+    return n;
+}
+
+static int decode_range( const gbuint8* buffer, int* offset, int end, decode_state* st,
+                         skytraq_point_callback callback, void* context ) {
+    skytraq_point points[SKYTRAQ_SECTOR_POINTS];
+    int n, total = 0;
+
+    while ( *offset < end ) {
+        n = decode_batch(buffer, offset, end, st, points, SKYTRAQ_SECTOR_POINTS);
+        total += n;
+        if ( n > 0 && callback(points, n, context) != 0 )
+            break;
+    }
+    return total;
+}
+
+/**
+  * Decode the track points in a sector of <length> bytes and pass them to
+  * <callback> in batches. Nothing is allocated or printed, so this can be used
+  * from any thread. Set up <st> with decode_init() before the first sector and
+  * pass the sectors in order. No byte after <length> is read; an entry cut
+  * off at <length> counts as skipped. Returns the number of points passed to
+  * <callback>.
+  */
+int skytraq_decode_sector( const gbuint8* buffer, int length, decode_state* st,
+                           skytraq_point_callback callback, void* context ) {
+    int offset = 0;
+
+    decode_start_sector(st, st->last_timestamp);
+    return decode_range(buffer, &offset, length, st, callback, context);
+}
+
+/**
+  * Like skytraq_decode_sector() but stores the points in <points>. Decoding
+  * stops after <max_points> points; SKYTRAQ_SECTOR_POINTS always holds a whole
+  * sector. Returns the number of points stored.
+  */
+int skytraq_decode_points( const gbuint8* buffer, int length, decode_state* st,
+                           skytraq_point* points, int max_points ) {
+    int offset = 0, n = 0;
+
+    decode_start_sector(st, st->last_timestamp);
+    while ( offset < length && n < max_points )
+        n += decode_batch(buffer, &offset, length, st, points + n, max_points - n);
+    return n;
+}
 
-        last_timestamp = time;
+/**
+  * Find the time range of a sector without converting any coordinates: <*first>
+  * is the time of the first long entry, <*last> the time of the last point.
+  * Like skytraq_decode_sector() it reads nothing after <length>. Returns
+  * ERROR if the sector has no long entry, then the times are unknown.
+  */
+int skytraq_sector_times( const gbuint8* buffer, int length, long* first, long* last ) {
+    decode_state st;
+    int offset = 0, found = 0;
+
+    decode_init(&st, 0);
+    decode_start_sector(&st, 0);
+    while ( offset < length ) {
+        if ( !decode_entry(buffer, &offset, length, &st, NULL) )
+            continue;
+        if ( !found && st.stats.long_entries > 0 ) {
+            *first = st.time;
+            found = 1;
+        }
+        if ( found )
+            *last = st.time;
+    }
+    return found ? SUCCESS : ERROR;
+}
+
+static int write_points( const skytraq_point* points, int count, void* context ) {
+    output_writer* w = context;
+    int i;
+
+    for ( i = 0; i < count; i++ ) {
+        output_point p;
+
+        p.time = points[i].time;
+        p.latitude = points[i].latitude;
+        p.longitude = points[i].longitude;
+        p.height = points[i].height;
+        p.speed = points[i].speed;
+        p.new_segment = points[i].new_segment;
+        output_track_point(w, &p);
     }
+    return 0;
+}
+
+/**
+  * Decode the entries from <offset> up to <end> and write them as track points
+  * to <w>. Returns the offset after the last decoded entry.
+  */
+int decode_entries( output_writer* w, const gbuint8* buffer, int offset, int end, decode_state* st ) {
+    decode_range(buffer, &offset, end, st, write_points, w);
+    return offset;
+}
 
+/** returns the last recorded timestamp */
+long process_buffer_to( output_writer* w, const gbuint8* buffer, const int length, decode_state* st ) {
+    DEBUG("processing %d bytes\n", length);
+
+    output_sector(w);
+
+    decode_start_sector(st, st->last_timestamp);
+    decode_entries(w, buffer, 0, length, st);
+
+    return st->last_timestamp;
+}
+
+/** returns the last recorded timestamp */
+long process_buffer(const gbuint8* buffer, const int length, const long first_timestamp ) {
+    output_writer w;
+    decode_state st;
+    long last_timestamp;
+
+    decode_init(&st, first_timestamp);
+    output_writer_init(&w, stdout, output_format_find(NULL), OUTPUT_DEFAULT_PRECISION);
+    last_timestamp = process_buffer_to(&w, buffer, length, &st);
+    output_writer_close(&w);
     return last_timestamp;
 }
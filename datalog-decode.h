@@ -0,0 +1,122 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef datalog_decode_h
+#define datalog_decode_h
+
+#include "output-writer.h"
+
+/* what the decoder found in the log */
+typedef struct decode_stats {
+    long    long_entries;
+    long    short_entries;
+    long    skipped_bytes;  /* bytes that do not start an entry */
+    long    erased_bytes;   /* runs of erased flash (0xFF) */
+    long    linearized;     /* points converted with the fast approximation */
+} decode_stats;
+
+/*
+ * Linearization of the ECEF to geodetic conversion around an exactly converted
+ * point, for the short entries that follow a long one. Points up to
+ * GEO_ANCHOR_RADIUS meters from the anchor are converted with the Jacobian.
+ * The error is the neglected second order term, of the order d^2/2R for a
+ * distance d from the anchor and the earth radius R, i.e. about 0.08 m at
+ * 1000 m. The bound is 0.2 m horizontally and in height (skytraq-bench geo
+ * measures 0.13 m and 0.08 m against ecef_to_geo()). This is more than the
+ * last digit printed by default, so the output differs from the exact one.
+ * Within 0.01 rad of the poles the anchor is not used.
+ */
+#define GEO_ANCHOR_RADIUS 1000.0
+
+typedef struct geo_anchor {
+    int     valid;
+    double  x, y, z;
+    double  longitude, latitude, height;
+    double  jacobian[3][3];     /* d(longitude, latitude, height) / d(x, y, z) */
+} geo_anchor;
+
+/* decoder state carried from one log entry to the next */
+typedef struct decode_state {
+    long            time;
+    int             ecef_x;
+    int             ecef_y;
+    int             ecef_z;
+    long            last_timestamp;
+    int             gap;        /* bytes skipped since the last point */
+    int             fast_geo;   /* convert short entries with geo_anchor */
+    geo_anchor      anchor;
+    decode_stats    stats;
+} decode_state;
+
+/* kinds of log entries */
+enum { SKYTRAQ_ENTRY_LONG, SKYTRAQ_ENTRY_SHORT };
+
+/* a sector holds at most this many track points */
+#define SKYTRAQ_SECTOR_POINTS (SKYTRAQ_SECTOR_SIZE / 8 + 1)
+
+/* a decoded track point */
+typedef struct skytraq_point {
+    long    time;           /* seconds since 1970, UTC */
+    int     ecef_x;         /* position as recorded, ECEF in meters */
+    int     ecef_y;
+    int     ecef_z;
+    double  latitude;       /* degrees */
+    double  longitude;      /* degrees */
+    double  height;         /* meters */
+    int     speed;          /* km/h */
+    int     kind;           /* SKYTRAQ_ENTRY_LONG or SKYTRAQ_ENTRY_SHORT */
+    int     tagged;         /* long entry with the tag bit (0x20) set */
+    int     new_segment;    /* more than an hour after the previous point */
+    int     after_gap;      /* bytes were skipped in front of it */
+} skytraq_point;
+
+/*
+ * Receives decoded track points. <points> is only valid during the call.
+ * Return 0 to continue decoding, anything else to stop.
+ */
+typedef int (*skytraq_point_callback)( const skytraq_point* points, int count, void* context );
+
+void ecef_to_geo( double X, double Y, double Z, double* longitude, double* latitude, double* height );
+void ecef_to_geo_batch( const double* x, const double* y, const double* z,
+                        double* longitude, double* latitude, double* height, int n );
+void geo_anchor_set( geo_anchor* anchor, double x, double y, double z,
+                     double longitude, double latitude, double height );
+int geo_anchor_convert( const geo_anchor* anchor, double x, double y, double z,
+                        double* longitude, double* latitude, double* height );
+void decode_long_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed );
+void decode_short_entry( const gbuint8* d, long* time, int* ecef_x, int* ecef_y, int* ecef_z, int* speed );
+void decode_init( decode_state* st, long first_timestamp );
+void decode_start_sector( decode_state* st, long last_timestamp );
+int decode_entry( const gbuint8* buffer, int* offset, int end, decode_state* st, skytraq_point* point );
+int skytraq_decode_sector( const gbuint8* buffer, int length, decode_state* st,
+                           skytraq_point_callback callback, void* context );
+int skytraq_decode_points( const gbuint8* buffer, int length, decode_state* st,
+                           skytraq_point* points, int max_points );
+int skytraq_sector_times( const gbuint8* buffer, int length, long* first, long* last );
+void timestamp_to_iso8601str( char* time_string, time_t timestamp );
+void output_gpx_trk_point( FILE* out, const long timestamp, const double latitude, const double longitude, const double height, const int speed );
+int decode_entries( output_writer* w, const gbuint8* buffer, int offset, int end, decode_state* st );
+long process_buffer_to( output_writer* w, const gbuint8* buffer, const int length, decode_state* st );
+int process_buffer_parallel( output_writer* w, const gbuint8* const* sectors, const int* lengths, int count,
+                             decode_state* st, int threads );
+
+#endif
@@ -21,33 +21,23 @@
  */
 #include "datalogger.h"
 #include "lowlevel.h"
+#include "trace.h"
 #include "agps-download.h"
 
-#define SKYTRAQ_COMMAND_SYSTEM_RESTART           0x01
-#define SKYTRAQ_COMMAND_QUERY_SOFTWARE_VERSION   0x02
-#define SKYTRAQ_COMMAND_QUERY_SOFTWARE_CRC       0x03
-#define SKYTRAQ_COMMAND_SET_FACTORY_DEFAULTS     0x04
-#define SKYTRAQ_COMMAND_CONFIGURE_SERIAL_PORT    0x05
-#define SKYTRAQ_COMMAND_CONFIGURE_NMEA_MESSAGE   0x08
-#define SKYTRAQ_COMMAND_CONFIGURE_MESSAGE_TYPE   0x09
-#define SKYTRAQ_COMMAND_GET_CONFIG               0x17
-#define SKYTRAQ_COMMAND_WRITE_CONFIG             0x18
-#define SKYTRAQ_COMMAND_ERASE                    0x19
-#define SKYTRAQ_COMMAND_READ_SECTOR              0x1b
-#define SKYTRAQ_COMMAND_GET_EPHERMERIS           0x30
-#define SKYTRAQ_COMMAND_SET_EPHEMERIS            0x31
-#define SKYTRAQ_COMMAND_READ_AGPS_STATUS         0x34
-#define SKYTRAQ_COMMAND_SEND_AGPS_DATA           0x35
-#define SKYTRAQ_RESPONSE_SOFTWARE_VERSION        0x80
-#define SKYTRAQ_RESPONSE_SOFTWARE_CRC            0x81
-#define SKYTRAQ_RESPONSE_ACK                     0x83
-#define SKYTRAQ_RESPONSE_NACK                    0x84
-#define SKYTRAQ_RESPONSE_EPHEMERIS_DATA          0xb1
-
 #define TIMEOUT  2000l
-#define AGPS_UPLOAD_BLOCKSIZE 8192
+#define SECTOR_TRAILER_SIZE 16
 
-int skytraq_read_software_version( int fd) {
+static skytraq_protocol_stats protocol_stats;
+
+const skytraq_protocol_stats* skytraq_get_protocol_stats( void ) {
+    return &protocol_stats;
+}
+
+/**
+  * Query the software version without printing it. <version> may be NULL
+  * if only the response matters.
+  */
+int skytraq_query_software_version( int fd, skytraq_version* version ) {
     int result = ERROR;
     SkyTraqPackage* request = skytraq_new_package(2);
     request->data[0] = SKYTRAQ_COMMAND_QUERY_SOFTWARE_VERSION;
@@ -57,12 +47,15 @@ int skytraq_read_software_version( int fd) {
         if ( response != NULL) {
             skytraq_dump_package(response);
 
-            printf("kernel version: %d.%d.%d -- ODM version: %d.%d.%d -- revision: 20%02d-%02d-%02d\n",
-                   response->data[3],response->data[4],response->data[5],
-                   response->data[7],response->data[8],response->data[9],
-                   response->data[11],response->data[12],response->data[13]);
+            if ( response->data[0] == SKYTRAQ_RESPONSE_SOFTWARE_VERSION && response->length >= 14 ) {
+                if ( version != NULL ) {
+                    memcpy(version->kernel, response->data+3, 3);
+                    memcpy(version->odm, response->data+7, 3);
+                    memcpy(version->revision, response->data+11, 3);
+                }
+                result = SUCCESS;
+            }
             skytraq_free_package(response);
-            result = SUCCESS;
         }
     }
 
@@ -71,35 +64,82 @@ int skytraq_read_software_version( int fd) {
     return result;
 }
 
+/**
+  * Query the CRC of the device's software.
+  */
+int skytraq_query_software_crc( int fd, unsigned* crc ) {
+    int result = ERROR;
+    SkyTraqPackage* request = skytraq_new_package(2);
+    request->data[0] = SKYTRAQ_COMMAND_QUERY_SOFTWARE_CRC;
+    request->data[1] = 1;
+    if ( ACK == skytraq_write_package_with_response(fd,request,TIMEOUT)) {
+        SkyTraqPackage* response = skytraq_read_next_package(fd,TIMEOUT);
+        if ( response != NULL) {
+            skytraq_dump_package(response);
+
+            if ( response->data[0] == SKYTRAQ_RESPONSE_SOFTWARE_CRC && response->length >= 4 ) {
+                *crc = (response->data[2] << 8) | response->data[3];
+                result = SUCCESS;
+            }
+            skytraq_free_package(response);
+        }
+    }
+
+    skytraq_free_package(request);
+
+    return result;
+}
+
+int skytraq_read_software_version( int fd) {
+    skytraq_version version;
+
+    if ( skytraq_query_software_version(fd, &version) != SUCCESS )
+        return ERROR;
+
+    printf("kernel version: %d.%d.%d -- ODM version: %d.%d.%d -- revision: 20%02d-%02d-%02d\n",
+           version.kernel[0],version.kernel[1],version.kernel[2],
+           version.odm[0],version.odm[1],version.odm[2],
+           version.revision[0],version.revision[1],version.revision[2]);
+    return SUCCESS;
+}
+
+/**
+  * Build the SKYTRAQ_COMMAND_WRITE_CONFIG payload for <config> in <data>,
+  * SKYTRAQ_CONFIG_PAYLOAD_SIZE bytes.
+  */
+void skytraq_config_payload( const skytraq_config* config, gbuint8* data ) {
+    data[0] = SKYTRAQ_COMMAND_WRITE_CONFIG;
+    data[1] = (config->max_time>>24) & 0xff;
+    data[2] = (config->max_time>>16) & 0xff;
+    data[3] = (config->max_time>>8) & 0xff;
+    data[4] = config->max_time & 0xff;
+    data[5] = (config->min_time>>24) & 0xff;
+    data[6] = (config->min_time>>16) & 0xff;
+    data[7] = (config->min_time>>8) & 0xff;
+    data[8] = config->min_time & 0xff;
+    data[9] = 00;
+    data[10] = 00;
+    data[11] = 03;
+    data[12] = 0xE8;
+    data[13] = 00;
+    data[14] = 00;
+    data[15] = 00;  /* distance HIGH */
+    data[16] = config->min_distance & 0xff;
+    data[17] = 00;
+    data[18] = 00;
+    data[19] = 03;
+    data[20] = 0xE8;
+    data[21] = 00;
+    data[22] = 00;
+    data[23] = (config->min_speed>>8) & 0xff;
+    data[24] = config->min_speed & 0xff;
+    data[25] = config->datalog_enable;
+    data[26] = config->log_fifo_mode;
+}
+
 void skytraq_write_datalogger_config( int fd, skytraq_config* config) {
-    SkyTraqPackage* request = skytraq_new_package(27);
-    request->data[0] = SKYTRAQ_COMMAND_WRITE_CONFIG;
-    request->data[1] = (config->max_time>>24) & 0xff;
-    request->data[2] = (config->max_time>>16) & 0xff;
-    request->data[3] = (config->max_time>>8) & 0xff;
-    request->data[4] = config->max_time & 0xff;
-    request->data[5] = (config->min_time>>24) & 0xff;
-    request->data[6] = (config->min_time>>16) & 0xff;
-    request->data[7] = (config->min_time>>8) & 0xff;
-    request->data[8] = config->min_time & 0xff;
-    request->data[9] = 00;
-    request->data[10] = 00;
-    request->data[11] = 03;
-    request->data[12] = 0xE8;
-    request->data[13] = 00;
-    request->data[14] = 00;
-    request->data[15] = 00;  /* distance HIGH */
-    request->data[16] = config->min_distance & 0xff;
-    request->data[17] = 00;
-    request->data[18] = 00;
-    request->data[19] = 03;
-    request->data[20] = 0xE8;
-    request->data[21] = 00;
-    request->data[22] = 00;
-    request->data[23] = (config->min_speed>>8) & 0xff;
-    request->data[24] = config->min_speed & 0xff;
-    request->data[25] = config->datalog_enable;
-    request->data[26] = config->log_fifo_mode;
+    SkyTraqPackage* request = skytraq_new_package(SKYTRAQ_CONFIG_PAYLOAD_SIZE);
+    skytraq_config_payload(config, request->data);
     skytraq_write_package_with_response(fd,request,TIMEOUT);
     skytraq_free_package(request);
 }
@@ -113,6 +153,23 @@ unsigned uint16_from_buffer( gbuint8* buffer, int offset ) {
     return buffer[offset]| (buffer[offset+1]<<8);
 }
 
+/**
+  * Fill <config> from the answer to SKYTRAQ_COMMAND_GET_CONFIG.
+  */
+void skytraq_parse_config( const SkyTraqPackage* response, skytraq_config* config ) {
+    config->log_wr_ptr = uint32_from_buffer(response->data,1);
+    config->sectors_left = uint16_from_buffer(response->data,5);
+    config->total_sectors = uint16_from_buffer(response->data,7);
+    config->max_time = uint32_from_buffer(response->data,9);
+    config->min_time  = uint32_from_buffer(response->data,13);
+    config->max_distance   = uint32_from_buffer(response->data,17);
+    config->min_distance  = uint32_from_buffer(response->data,21);
+    config->max_speed = uint32_from_buffer(response->data,25);
+    config->min_speed = uint32_from_buffer(response->data,29);
+    config->datalog_enable = response->data[33];
+    config->log_fifo_mode = response->data[34];
+}
+
 int skytraq_read_datalogger_config( int fd, skytraq_config* config ) {
     int result = ERROR;
     SkyTraqPackage* request = skytraq_new_package(1);
@@ -121,19 +178,7 @@ int skytraq_read_datalogger_config( int fd, skytraq_config* config ) {
         SkyTraqPackage* response = skytraq_read_next_package(fd,TIMEOUT);
         if ( response != NULL) {
             skytraq_dump_package(response);
-
-            config->log_wr_ptr = uint32_from_buffer(response->data,1);
-            config->sectors_left = uint16_from_buffer(response->data,5);
-            config->total_sectors = uint16_from_buffer(response->data,7);
-            config->max_time = uint32_from_buffer(response->data,9);
-            config->min_time  = uint32_from_buffer(response->data,13);
-            config->max_distance   = uint32_from_buffer(response->data,17);
-            config->min_distance  = uint32_from_buffer(response->data,21);
-            config->max_speed = uint32_from_buffer(response->data,25);
-            config->min_speed = uint32_from_buffer(response->data,29);
-            config->datalog_enable = response->data[33];
-            config->log_fifo_mode = response->data[34];
-
+            skytraq_parse_config(response, config);
             skytraq_free_package(response);
             result = SUCCESS;
         }
@@ -154,64 +199,45 @@ void skytraq_clear_datalog( int fd) {
  * Returns number of bytes read.
  */
 int skytraq_read_datalog_sector( int fd, gbuint8 sector, gbuint8* buffer ) {
+    int result = -1;
+
     if ( buffer != NULL ) {
-        SkyTraqPackage* request= skytraq_new_package(2);;
-        request->data[0] = 0x1b;
+        SkyTraqPackage* request= skytraq_new_package(2);
+        request->data[0] = SKYTRAQ_COMMAND_READ_SECTOR;
         request->data[1] = sector;
         if ( ACK == skytraq_write_package_with_response(fd,request,TIMEOUT)) {
-            int i,len, count = 0;
-            gbuint8 c, lastByte1, lastByte2,cs,checksum;
+            gbuint8 trailer[SECTOR_TRAILER_SIZE];
+            int len;
 
             DEBUG("START READING DATA\n");
 
-            cs = 0;
-            len = read_with_timeout( fd, &c, 1,TIMEOUT);
-            while ( len > 0 ) {
-                if ( (lastByte2 == 'E') && (lastByte1 == 'N') && (c == 'D')) {
-                    /* remove last two bytes from checksum */
-                    cs = cs ^'N';
-                    cs = cs ^'E';
-
-                    DEBUG("DONE\n");
-                    break;
-                }
-
-
-                if ( count >=2 ) {
-                    buffer[count-2] = lastByte2;
+            /* the data block is terminated by "END" */
+            len = read_until(fd, buffer, SKYTRAQ_SECTOR_SIZE + 3, (const gbuint8*)"END", 3, TIMEOUT);
+
+            if ( len >= 0 ) {
+                DEBUG("DONE\n");
+
+                /* remaining characters after data block, the checksum is the 11th byte */
+                if ( read_with_timeout(fd, trailer, SECTOR_TRAILER_SIZE, TIMEOUT) == SECTOR_TRAILER_SIZE &&
+                        skytraq_xor_checksum(buffer, len) == trailer[10] ) {
+                    protocol_stats.sectors_read++;
+                    result = len;
+                } else {
+                    protocol_stats.sector_checksum_errors++;
+                    fprintf(stderr, "wrong checksum for sector %d\n", sector);
+                    trace_error(fd, "wrong checksum for sector %d", sector);
                 }
-
-                cs = cs ^ c;
-
-                lastByte2 = lastByte1;
-                lastByte1 = c;
-                count++;
-                len = read_with_timeout( fd, &c, 1,TIMEOUT);
-            }
-
-
-            /* remaining characters after data block */
-            for ( i=0; i<10; i++)
-                read_with_timeout( fd, &c, 1, TIMEOUT);
-
-            read_with_timeout( fd, &checksum, 1, TIMEOUT);
-
-            for ( i=0; i<5; i++)
-                read_with_timeout( fd, &c, 1, TIMEOUT);
-
-
-            if ( cs == checksum )
-                return count-2;
-            else {
-                fprintf(stderr, "wrong checksum for sector %d\n", sector);
-                return -1;
+            } else {
+                protocol_stats.sectors_incomplete++;
+                fprintf(stderr, "no end of data for sector %d\n", sector);
+                trace_error(fd, "no end of data for sector %d", sector);
             }
         }
 
         skytraq_free_package(request);
     }
 
-    return -1;
+    return result;
 }
 
 
@@ -245,12 +271,88 @@ int skytraq_set_serial_speed( int fd, int speed, int permanent) {
     request->data[3] = permanent & 1;
     if ( ACK != skytraq_write_package_with_response(fd, request,TIMEOUT) ) {
         fprintf( stderr, "setting line speed FAILED\n");
+        skytraq_free_package(request);
         return 1;
     }
     skytraq_free_package(request);
     return 0;
 }
 
+/**
+  * Switch device and host from <current> to <rate> (not permanently) and check
+  * the link with a version query. Returns SUCCESS if the device answers at the
+  * new rate, ERROR if nothing was changed because the host or the device refused
+  * the rate and SPEED_LINK_DOWN if the device switched but does not respond.
+  */
+int skytraq_switch_speed( int fd, unsigned current, unsigned rate ) {
+    if ( skytraq_mkspeed(rate) == ERROR )
+        return ERROR;
+
+    /* make sure the host supports the rate before telling the device */
+    if ( set_port_speed(fd, rate) != SUCCESS ) {
+        DEBUG("host does not support %d baud\n", rate);
+        return ERROR;
+    }
+    set_port_speed(fd, current);
+
+    if ( skytraq_set_serial_speed(fd, skytraq_mkspeed(rate), 0) != 0 )
+        return ERROR;
+
+    set_port_speed(fd, rate);
+    flush_input(fd);
+
+    if ( skytraq_query_software_version(fd, NULL) != SUCCESS ) {
+        DEBUG("no response at %d baud\n", rate);
+        return SPEED_LINK_DOWN;
+    }
+    return SUCCESS;
+}
+
+static const unsigned upshift_rates[] = { 115200, 57600, 38400, 19200 };
+
+/**
+  * Raise the speed of the serial line as far as device and host allow, trying
+  * the rates from the fastest down. The change is not written to FLASH.
+  * Returns the rate now in use or 0 if the device got lost.
+  */
+unsigned skytraq_upshift_speed( int fd, unsigned baud_rate ) {
+    unsigned current = baud_rate;
+    int i;
+
+    for ( i = 0; i < sizeof(upshift_rates)/sizeof(unsigned) && upshift_rates[i] > current; i++ ) {
+        int result = skytraq_switch_speed(fd, current, upshift_rates[i]);
+        if ( result == SUCCESS ) {
+            return upshift_rates[i];
+        }
+        if ( result == SPEED_LINK_DOWN ) {
+            /* find the device again and go on with the next lower rate */
+            current = skytraq_determine_speed(fd);
+            if ( current == 0 )
+                return 0;
+        }
+    }
+
+    return current;
+}
+
+/**
+  * Go back from <current> to <baud_rate> after skytraq_upshift_speed().
+  * Returns the rate now in use or 0 if the device got lost.
+  */
+unsigned skytraq_restore_speed( int fd, unsigned current, unsigned baud_rate ) {
+    if ( current == baud_rate )
+        return current;
+
+    if ( skytraq_switch_speed(fd, current, baud_rate) == SUCCESS )
+        return baud_rate;
+
+    current = skytraq_determine_speed(fd);
+    if ( current != baud_rate ) {
+        fprintf(stderr, "could not restore baud-rate %d\n", baud_rate);
+    }
+    return current;
+}
+
 
 /*unsigned baud_rates[] = { 115200, 9600,57600 ,1200,2400,4800,19200, 38400 };*/
 unsigned baud_rates[] = { 9600,115200, 57600, 38400, 19200, 9600, 4800, 2400, 1200 };
@@ -286,8 +388,12 @@ int skytraq_determine_speed( int fd) {
     int nmea_detection_succeded=0;
     int binary_detection_succeded=0;
     int len,i;
+    double start = monotonic_time();
+
+    protocol_stats.speed_detections++;
     for ( i = 0; i< (sizeof(baud_rates)/sizeof(int)); i++) {
         DEBUG("testing for %d baud-rate\n", baud_rates[i]);
+        protocol_stats.rates_tried++;
         set_port_speed(fd, baud_rates[i]);
         /* If baud rate is right we will receive some NMEA data first
          * otherwise at least we will let device enough characters
@@ -312,7 +418,7 @@ int skytraq_determine_speed( int fd) {
             /* try binary detection */
 
             /* send "QUERY SOFTWARE VERSION" command to GPS unit */
-            write(fd, request, 9);
+            write_buffer(fd, request, 9);
 
             len = read_with_timeout(fd, buffer, buf_size,200);
 #ifdef DEBUG_ALL
@@ -335,11 +441,13 @@ int skytraq_determine_speed( int fd) {
 
         if (binary_detection_succeded || nmea_detection_succeded) {
             free(buffer);
+            protocol_stats.detection_time += monotonic_time() - start;
             return baud_rates[i];
         }
     }
 
     free(buffer);
+    protocol_stats.detection_time += monotonic_time() - start;
     set_port_speed(fd, 38400); /* since we unlucky we set port speed to something high again */
     return 0;
 }
@@ -24,6 +24,7 @@
 #define datalogger_h
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +38,9 @@
 enum {ERROR=-1, SUCCESS};
 enum {NACK=-1, ACK};
 
+/* skytraq_switch_speed(): the device changed its speed but does not respond */
+#define SPEED_LINK_DOWN 1
+
 #define gbuint8 unsigned char
 #define gbuint32 unsigned long
 #define gbuint16 unsigned int
@@ -48,6 +52,33 @@ enum {NACK=-1, ACK};
 #define DEBUG(fmt, args...)
 #endif
 
+/* message IDs of the binary protocol */
+#define SKYTRAQ_COMMAND_SYSTEM_RESTART           0x01
+#define SKYTRAQ_COMMAND_QUERY_SOFTWARE_VERSION   0x02
+#define SKYTRAQ_COMMAND_QUERY_SOFTWARE_CRC       0x03
+#define SKYTRAQ_COMMAND_SET_FACTORY_DEFAULTS     0x04
+#define SKYTRAQ_COMMAND_CONFIGURE_SERIAL_PORT    0x05
+#define SKYTRAQ_COMMAND_CONFIGURE_NMEA_MESSAGE   0x08
+#define SKYTRAQ_COMMAND_CONFIGURE_MESSAGE_TYPE   0x09
+#define SKYTRAQ_COMMAND_GET_CONFIG               0x17
+#define SKYTRAQ_COMMAND_WRITE_CONFIG             0x18
+#define SKYTRAQ_COMMAND_ERASE                    0x19
+#define SKYTRAQ_COMMAND_READ_SECTOR              0x1b
+#define SKYTRAQ_COMMAND_GET_EPHERMERIS           0x30
+#define SKYTRAQ_COMMAND_SET_EPHEMERIS            0x31
+#define SKYTRAQ_COMMAND_READ_AGPS_STATUS         0x34
+#define SKYTRAQ_COMMAND_SEND_AGPS_DATA           0x35
+#define SKYTRAQ_RESPONSE_SOFTWARE_VERSION        0x80
+#define SKYTRAQ_RESPONSE_SOFTWARE_CRC            0x81
+#define SKYTRAQ_RESPONSE_ACK                     0x83
+#define SKYTRAQ_RESPONSE_NACK                    0x84
+#define SKYTRAQ_RESPONSE_LOG_STATUS              0x94
+#define SKYTRAQ_RESPONSE_NAVIGATION_DATA         0xa8
+#define SKYTRAQ_RESPONSE_EPHEMERIS_DATA          0xb1
+
+/* AGPS data is uploaded in blocks of this size, each answered with "OK" */
+#define AGPS_UPLOAD_BLOCKSIZE   8192
+
 #define SKYTRAQ_SPEED_4800      0
 #define SKYTRAQ_SPEED_9600      1
 #define SKYTRAQ_SPEED_19200     2
@@ -55,12 +86,19 @@ enum {NACK=-1, ACK};
 #define SKYTRAQ_SPEED_57600     4
 #define SKYTRAQ_SPEED_115200    5
 
+/* a sector of the log memory; buffers for skytraq_read_datalog_sector()
+   need room for SKYTRAQ_SECTOR_SIZE+3 bytes (data plus END marker) */
+#define SKYTRAQ_SECTOR_SIZE     4096
+
 typedef struct SkyTraqPackage {
     gbuint8	length;
     gbuint8* 	data;
     gbuint8 	checksum;
 } SkyTraqPackage;
 
+/* length of the SKYTRAQ_COMMAND_WRITE_CONFIG payload */
+#define SKYTRAQ_CONFIG_PAYLOAD_SIZE 27
+
 typedef struct skytraq_config {
     gbuint32    log_wr_ptr;
     gbuint16    sectors_left;
@@ -77,15 +115,38 @@ typedef struct skytraq_config {
     unsigned	agps_hours_left;
 } skytraq_config;
 
+typedef struct skytraq_version {
+    gbuint8     kernel[3];
+    gbuint8     odm[3];
+    gbuint8     revision[3]; /* year (without century), month, day */
+} skytraq_version;
+
+typedef struct skytraq_protocol_stats {
+    unsigned long   sectors_read;           /* sectors received with a valid checksum */
+    unsigned long   sector_checksum_errors;
+    unsigned long   sectors_incomplete;     /* no END marker before the timeout */
+    unsigned long   speed_detections;
+    unsigned long   rates_tried;            /* by the speed detection */
+    double          detection_time;         /* seconds spent detecting the speed */
+} skytraq_protocol_stats;
+
+const skytraq_protocol_stats* skytraq_get_protocol_stats( void );
+int skytraq_query_software_version( int fd, skytraq_version* version );
+int skytraq_query_software_crc( int fd, unsigned* crc );
 int skytraq_read_software_version( int fd);
 int skytraq_read_datalogger_config( int fd, skytraq_config* config);
+void skytraq_parse_config( const SkyTraqPackage* response, skytraq_config* config );
 int skytraq_read_datalog_sector( int fd, gbuint8 sector, gbuint8* buffer );
 void skytraq_clear_datalog( int fd);
 void skytraq_write_datalogger_config( int fd, skytraq_config* config);
+void skytraq_config_payload( const skytraq_config* config, gbuint8* data );
 long process_buffer(const gbuint8* buffer,const  int length,const  long last_timestamp);
 int skytraq_determine_speed( int fd) ;
 unsigned skytraq_mkspeed(unsigned br);
 int skytraq_set_serial_speed( int fd, int speed, int permanent);
+int skytraq_switch_speed( int fd, unsigned current, unsigned rate );
+unsigned skytraq_upshift_speed( int fd, unsigned baud_rate );
+unsigned skytraq_restore_speed( int fd, unsigned current, unsigned baud_rate );
 void skytraq_read_agps_status(int fd, skytraq_config* config);
 int skytraq_output_disable( int fd );
 int skytraq_output_enable_nmea( int fd );
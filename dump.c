@@ -0,0 +1,782 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "lowlevel.h"
+#include "dump.h"
+#include "sector-cache.h"
+#include "flash-image.h"
+#include "datalog-decode.h"
+#include "live-fix.h"
+#include <signal.h>
+#include <pthread.h>
+
+#define SECTOR_RETRIES      3
+#define FIXED_DELAY         1000  /* ms, the pause older versions made after every sector */
+#define MIN_BACKOFF         100   /* ms */
+#define MAX_BACKOFF         2000  /* ms */
+#define QUEUE_SLOTS         8     /* sectors read ahead of the decoder */
+
+typedef struct sector_slot {
+    gbuint8     data[SKYTRAQ_SECTOR_SIZE + 4];
+    int         length;
+} sector_slot;
+
+/*
+ * Bounded queue between the thread reading sectors from the serial line
+ * and the thread decoding them. The slots are used round-robin, a slot is
+ * filled by the reader and handed back once the decoder is done with it.
+ */
+typedef struct sector_queue {
+    sector_slot     slots[QUEUE_SLOTS];
+    int             head;       /* next slot to fill */
+    int             tail;       /* next slot to decode */
+    int             count;      /* filled slots */
+    int             done;       /* reader has finished */
+    long            depth_sum;  /* sum of queue depths seen by the reader */
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+} sector_queue;
+
+typedef struct dump_job {
+    int                         fd;
+    int                         used_sectors;
+    int                         first_sector;   /* where the time window starts */
+    long                        first_timestamp;/* last point in front of it, 0 if unknown */
+    int                         window;         /* only sectors in [from,to] are read */
+    sector_slot**               probes;         /* sectors read while searching the window */
+    int                         sectors_done;   /* sectors taken from the queue */
+    const skytraq_dump_options* options;
+    skytraq_dump_report*        report;
+    sector_cache*               cache;
+    int                         cache_sectors;  /* the cache keeps sectors, not only the time index */
+    flash_image_writer*         image;
+    output_writer               output;
+    sector_queue                queue;
+} dump_job;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_interrupt( int sig ) {
+    interrupted = sig;
+}
+
+int skytraq_parse_pacing( const char* name ) {
+    if ( !strcmp(name, "adaptive") )
+        return PACING_ADAPTIVE;
+    if ( !strcmp(name, "none") )
+        return PACING_NONE;
+    if ( !strcmp(name, "fixed") )
+        return PACING_FIXED;
+    return ERROR;
+}
+
+static int days_in_month( int year, int month ) {
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    int leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+
+    return days[month - 1] + (month == 2 && leap);
+}
+
+/**
+  * Parse a point in time (UTC) for --from and --to: seconds since 1970 or
+  * "YYYY-MM-DD[THH:MM[:SS]][Z]". A date alone means the start of the day, or
+  * its end if <end_of_day> is set. Returns ERROR if the text cannot be parsed
+  * or names a day or time that does not exist.
+  */
+int skytraq_parse_time( const char* text, int end_of_day, long* seconds ) {
+    struct tm tm;
+    char* end;
+    int n = 0, fields;
+
+    *seconds = strtol(text, &end, 10);
+    if ( *text && *end == 0 )
+        return SUCCESS;
+
+    memset(&tm, 0, sizeof(tm));
+    fields = sscanf(text, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n);
+    if ( fields != 3 )
+        return ERROR;
+    text += n;
+    if ( *text == 'T' || *text == ' ' ) {
+        n = 0;
+        if ( sscanf(text + 1, "%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &n) != 2 )
+            return ERROR;
+        text += 1 + n;
+        if ( *text == ':' ) {
+            n = 0;
+            if ( sscanf(text + 1, "%2d%n", &tm.tm_sec, &n) != 1 )
+                return ERROR;
+            text += 1 + n;
+        }
+    } else if ( end_of_day ) {
+        tm.tm_hour = 23;
+        tm.tm_min = 59;
+        tm.tm_sec = 59;
+    }
+    if ( *text == 'Z' )
+        text++;
+    if ( *text != 0 || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 ||
+            tm.tm_mday > days_in_month(tm.tm_year, tm.tm_mon) ||
+            tm.tm_hour < 0 || tm.tm_hour > 23 || tm.tm_min < 0 || tm.tm_min > 59 ||
+            tm.tm_sec < 0 || tm.tm_sec > 60 )
+        return ERROR;
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *seconds = timegm(&tm);
+    return SUCCESS;
+}
+
+/**
+  * Pause before the next request. After a failure the device may still be
+  * sending the rest of the sector, so anything that arrived meanwhile is
+  * thrown away.
+  */
+static void pause_ms( int fd, unsigned delay, skytraq_dump_report* report ) {
+    double start = monotonic_time();
+    usleep(delay * 1000);
+    flush_input(fd);
+    report->wait_time += monotonic_time() - start;
+}
+
+/**
+  * Calculate the pause before the next request. The adaptive strategy sends
+  * the next request as soon as a sector has been read and only backs off
+  * (exponentially) while ACKs time out or checksums fail.
+  */
+static unsigned next_delay( int pacing, unsigned delay, int failed ) {
+    switch ( pacing ) {
+    case PACING_FIXED:
+        return FIXED_DELAY;
+    case PACING_NONE:
+        return 0;
+    default:
+        if ( failed ) {
+            delay = delay ? delay * 2 : MIN_BACKOFF;
+            return delay > MAX_BACKOFF ? MAX_BACKOFF : delay;
+        }
+        delay = delay / 2;
+        return delay < MIN_BACKOFF ? 0 : delay;
+    }
+}
+
+static int query_device( int fd, skytraq_version* version, unsigned* crc ) {
+    if ( skytraq_query_software_version(fd, version) != SUCCESS ||
+            skytraq_query_software_crc(fd, crc) != SUCCESS ) {
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/**
+  * Name of the device in the sector cache, derived from the software version and CRC.
+  */
+static int device_id( int fd, char* id, int size ) {
+    skytraq_version version;
+    unsigned crc;
+
+    if ( query_device(fd, &version, &crc) != SUCCESS )
+        return ERROR;
+
+    snprintf(id, size, "%d.%d.%d-%d.%d.%d-%02d%02d%02d-%04x",
+             version.kernel[0], version.kernel[1], version.kernel[2],
+             version.odm[0], version.odm[1], version.odm[2],
+             version.revision[0], version.revision[1], version.revision[2], crc);
+    return SUCCESS;
+}
+
+/**
+  * Open the sector cache. For a time window it is opened in the default place
+  * even without --cache because of the time index, the sectors are only kept
+  * if the cache is enabled.
+  */
+static sector_cache* open_cache( int fd, const skytraq_config* info, const skytraq_dump_options* options ) {
+    sector_cache* cache;
+    char* dir;
+    char id[64];
+
+    if ( options->cache_id != NULL ) {
+        snprintf(id, sizeof(id), "%s", options->cache_id);
+    } else if ( device_id(fd, id, sizeof(id)) != SUCCESS ) {
+        fprintf(stderr, "could not identify the device, not using the sector cache\n");
+        return NULL;
+    }
+
+    if ( options->cache_dir != NULL )
+        return sector_cache_open(options->cache_dir, id, info->log_wr_ptr);
+
+    dir = sector_cache_default_dir();
+    cache = sector_cache_open(dir, id, info->log_wr_ptr);
+    free(dir);
+    return cache;
+}
+
+/**
+  * Remove the sector cache and time index of the device, called when its log
+  * is erased.
+  */
+void skytraq_clear_cache( int fd, const skytraq_dump_options* options ) {
+    char* dir;
+    char id[64];
+
+    if ( options->cache_id != NULL ) {
+        snprintf(id, sizeof(id), "%s", options->cache_id);
+    } else if ( device_id(fd, id, sizeof(id)) != SUCCESS ) {
+        fprintf(stderr, "could not identify the device, sector cache not cleared\n");
+        return;
+    }
+
+    if ( options->cache_dir != NULL ) {
+        sector_cache_clear(options->cache_dir, id);
+    } else {
+        dir = sector_cache_default_dir();
+        sector_cache_clear(dir, id);
+        free(dir);
+    }
+}
+
+static flash_image_writer* create_image( int fd, const skytraq_config* info, int sector_count, const char* path ) {
+    flash_image_info image_info;
+    flash_image_writer* writer;
+
+    memset(&image_info, 0, sizeof(image_info));
+    image_info.sector_count = sector_count;
+    image_info.log_wr_ptr = info->log_wr_ptr;
+    image_info.total_sectors = info->total_sectors;
+    image_info.sectors_left = info->sectors_left;
+    if ( query_device(fd, &image_info.version, &image_info.crc) != SUCCESS ) {
+        fprintf(stderr, "could not identify the device\n");
+    }
+
+    writer = flash_image_create(path, &image_info);
+    if ( writer == NULL ) {
+        fprintf(stderr, "cannot create %s\n", path);
+    }
+    return writer;
+}
+
+/**
+  * Read one sector, retrying and pausing according to the pacing strategy.
+  * Returns the number of bytes read or -1.
+  */
+static int read_sector( dump_job* job, int sector, gbuint8* buf, unsigned* delay ) {
+    skytraq_dump_report* report = job->report;
+    int len, retries_left = SECTOR_RETRIES;
+
+    for (;;) {
+        double t;
+
+        if ( *delay > 0 )
+            pause_ms(job->fd, *delay, report);
+
+        t = monotonic_time();
+        len = skytraq_read_datalog_sector(job->fd,sector,buf);
+        report->transfer_time += monotonic_time() - t;
+
+        *delay = next_delay(job->options->pacing, *delay, len == -1);
+        if ( len != -1 || retries_left == 0 || interrupted )
+            return len;
+
+        /* retry to read the sector */
+        retries_left--;
+        report->retries++;
+    }
+}
+
+/**
+  * Put a sector read from the device into the cache and the time index.
+  */
+static void remember_sector( dump_job* job, int sector, const gbuint8* buf, int length ) {
+    long first, last;
+
+    if ( job->cache != NULL && length != -1 ) {
+        if ( job->cache_sectors )
+            sector_cache_store(job->cache, sector, buf, length);
+        if ( skytraq_sector_times(buf, length, &first, &last) == SUCCESS )
+            sector_cache_store_times(job->cache, sector, first, last);
+    }
+}
+
+/**
+  * Get a sector from the cache or the device and add it to the time index.
+  * Returns the number of bytes or -1.
+  */
+static int fetch_sector( dump_job* job, int sector, gbuint8* buf, unsigned* delay ) {
+    int length = -1;
+
+    if ( job->cache != NULL && job->cache_sectors ) {
+        length = sector_cache_load(job->cache, sector, buf);
+        if ( length != -1 ) {
+            job->report->cached_sectors++;
+            return length;
+        }
+    }
+
+    length = read_sector(job, sector, buf, delay);
+    remember_sector(job, sector, buf, length);
+    return length;
+}
+
+/**
+  * Make sure the cache still belongs to the log on the device by comparing
+  * the first sector, read from the device. The sector is kept in the probes
+  * for the reader thread. Without the first sector the cache cannot be
+  * trusted and is not used.
+  */
+static void check_cache( dump_job* job ) {
+    sector_slot* slot;
+    unsigned delay = 0;
+
+    if ( job->cache == NULL || job->cache->final_sectors == 0 )
+        return;
+
+    slot = malloc(sizeof(sector_slot));
+    slot->length = read_sector(job, 0, slot->data, &delay);
+    if ( slot->length == -1 ) {
+        fprintf(stderr, "could not read the first sector, not using the sector cache\n");
+        sector_cache_close(job->cache);
+        job->cache = NULL;
+        free(slot);
+        return;
+    }
+    sector_cache_verify(job->cache, slot->data, slot->length);
+    remember_sector(job, 0, slot->data, slot->length);
+    job->probes[0] = slot;
+}
+
+/**
+  * Time of the first long entry of a sector, from the time index or by reading
+  * the sector. A sector read here is kept for the reader thread. Returns ERROR
+  * if the time is unknown.
+  */
+static int sector_first_time( dump_job* job, int sector, unsigned* delay, long* first ) {
+    sector_slot* slot;
+    long last;
+
+    if ( job->cache != NULL && sector_cache_times(job->cache, sector, first, &last) == SUCCESS )
+        return SUCCESS;
+
+    if ( job->probes[sector] == NULL ) {
+        slot = malloc(sizeof(sector_slot));
+        slot->length = fetch_sector(job, sector, slot->data, delay);
+        job->probes[sector] = slot;
+    }
+    slot = job->probes[sector];
+    if ( slot->length == -1 )
+        return ERROR;
+    return skytraq_sector_times(slot->data, slot->length, first, &last);
+}
+
+/**
+  * Binary search for the last sector whose first long entry was recorded
+  * before the start of the window. The log is written in chronological order.
+  * A sector with unknown time is treated as being after the start, which can
+  * only make the dump begin earlier than needed.
+  */
+static int find_first_sector( dump_job* job, long from, unsigned* delay ) {
+    int low = 0, high = job->used_sectors - 1;
+
+    while ( low < high && !interrupted ) {
+        int middle = (low + high + 1) / 2;
+        long first;
+
+        if ( sector_first_time(job, middle, delay, &first) == SUCCESS && first <= from )
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+/**
+  * Decide whether a sector is needed for the time window, from the time index
+  * or from the sector itself if it has been read (<slot>, may be NULL): 1 if it
+  * is needed, 0 if it lies before the window and -1 if it and all following
+  * sectors lie after it. Every sector begins with a long entry, points in front
+  * of it could not be located anyway.
+  */
+static int sector_wanted( dump_job* job, int sector, const sector_slot* slot ) {
+    const skytraq_dump_options* options = job->options;
+    long first, last;
+
+    if ( !job->window )
+        return 1;
+    if ( job->cache == NULL || sector_cache_times(job->cache, sector, &first, &last) != SUCCESS ) {
+        if ( slot == NULL || slot->length == -1 ||
+                skytraq_sector_times(slot->data, slot->length, &first, &last) != SUCCESS )
+            return 1;
+    }
+    if ( first > options->to )
+        return -1;
+    if ( last < options->from )
+        return 0;
+    return 1;
+}
+
+/**
+  * Reader thread: keeps the serial line busy and fills the queue.
+  */
+static void* read_sectors( void* arg ) {
+    dump_job* job = arg;
+    sector_queue* q = &job->queue;
+    unsigned delay = 0;
+    int i;
+
+    for ( i = job->first_sector; i< job->used_sectors && !interrupted ; i++ ) {
+        sector_slot* slot;
+        int wanted = sector_wanted(job, i, job->probes != NULL ? job->probes[i] : NULL);
+
+        if ( wanted < 0 )
+            break;
+        if ( wanted == 0 )
+            continue;
+
+        pthread_mutex_lock(&q->lock);
+        if ( q->count == QUEUE_SLOTS )
+            job->report->reader_stalls++;
+        while ( q->count == QUEUE_SLOTS )
+            pthread_cond_wait(&q->not_full, &q->lock);
+        slot = &q->slots[q->head];
+        pthread_mutex_unlock(&q->lock);
+
+        if ( job->probes != NULL && job->probes[i] != NULL ) {
+            memcpy(slot, job->probes[i], sizeof(sector_slot));
+            free(job->probes[i]);
+            job->probes[i] = NULL;
+        } else {
+            slot->length = fetch_sector(job, i, slot->data, &delay);
+            if ( sector_wanted(job, i, slot) < 0 ) {
+                /* the first sector after the window */
+                job->report->probed_sectors++;
+                break;
+            }
+        }
+
+        job->report->sectors++;
+        if ( slot->length == -1 )
+            job->report->failed_sectors++;
+
+        pthread_mutex_lock(&q->lock);
+        q->head = (q->head + 1) % QUEUE_SLOTS;
+        q->count++;
+        q->depth_sum += q->count;
+        if ( q->count > job->report->max_queue_depth )
+            job->report->max_queue_depth = q->count;
+        pthread_cond_signal(&q->not_empty);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->done = 1;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+/**
+  * Decoder: drains the queue and writes the track points, or the sectors
+  * to the flash image. Runs until the reader is done and the queue is empty.
+  */
+static void decode_sectors( dump_job* job ) {
+    sector_queue* q = &job->queue;
+    decode_state st;
+
+    decode_init(&st, job->first_timestamp);
+    st.fast_geo = job->options->fast_geo;
+    for (;;) {
+        sector_slot* slot;
+        double t;
+
+        pthread_mutex_lock(&q->lock);
+        if ( q->count == 0 && !q->done )
+            job->report->decoder_stalls++;
+        while ( q->count == 0 && !q->done )
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        if ( q->count == 0 ) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        slot = &q->slots[q->tail];
+        pthread_mutex_unlock(&q->lock);
+
+        t = monotonic_time();
+        if ( job->image != NULL ) {
+            if ( flash_image_write_sector(job->image, job->sectors_done, slot->data, slot->length) != SUCCESS )
+                fprintf(stderr, "cannot write sector %d to the image\n", job->sectors_done);
+        } else {
+            process_buffer_to(&job->output, slot->data, slot->length, &st);
+        }
+        job->report->decode_time += monotonic_time() - t;
+        job->sectors_done++;
+
+        pthread_mutex_lock(&q->lock);
+        q->tail = (q->tail + 1) % QUEUE_SLOTS;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+        pthread_mutex_unlock(&q->lock);
+    }
+    job->report->decode = st.stats;
+}
+
+/**
+  * Decode a flash image written by --dump-raw to STDOUT, without a
+  * device. The work is spread over <threads> threads, 0 means one per CPU.
+  * Returns ERROR if the image cannot be read or decoded.
+  */
+int skytraq_decode_image( const char* path, int threads, const skytraq_dump_options* options, skytraq_dump_report* report ) {
+    flash_image image;
+    output_writer output;
+    decode_state st;
+    const gbuint8** sectors;
+    int* lengths;
+    double start = monotonic_time();
+    gbuint32 i;
+    int result;
+
+    memset(report, 0, sizeof(skytraq_dump_report));
+    if ( flash_image_open(path, &image) != SUCCESS )
+        return ERROR;
+
+    if ( threads <= 0 )
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    sectors = malloc(image.info.sector_count * sizeof(gbuint8*));
+    lengths = malloc(image.info.sector_count * sizeof(int));
+    if ( image.info.sector_count > 0 && (sectors == NULL || lengths == NULL) ) {
+        fprintf(stderr, "not enough memory for %lu sectors\n", (unsigned long)image.info.sector_count);
+        free(sectors);
+        free(lengths);
+        flash_image_close(&image);
+        return ERROR;
+    }
+    for ( i = 0; i < image.info.sector_count; i++ ) {
+        sectors[i] = flash_image_sector(&image, i, &lengths[i]);
+        report->sectors++;
+        if ( lengths[i] == -1 )
+            report->failed_sectors++;
+    }
+
+    output_writer_init(&output, stdout, options->format, options->precision);
+    output_writer_window(&output, options->from, options->to);
+    output_header(&output);
+    decode_init(&st, 0);
+    st.fast_geo = options->fast_geo;
+    result = process_buffer_parallel(&output, sectors, lengths, image.info.sector_count, &st, threads);
+    report->decode = st.stats;
+    output_footer(&output);
+    output_writer_close(&output);
+
+    free(sectors);
+    free(lengths);
+    flash_image_close(&image);
+    report->decode_time = report->total_time = monotonic_time() - start;
+    return result;
+}
+
+typedef struct nmea_track {
+    output_writer   output;
+    long            last_time;
+} nmea_track;
+
+static void write_fix( const skytraq_fix* fix, void* context ) {
+    nmea_track* track = context;
+    output_point point;
+
+    if ( !(fix->fields & FIX_HAS_POSITION) )
+        return;
+    point.time = (long)fix->time;
+    point.latitude = fix->latitude;
+    point.longitude = fix->longitude;
+    point.height = fix->altitude;
+    point.speed = (int)(fix->speed + 0.5);
+    point.new_segment = track->last_time > 0 && point.time > track->last_time + 3600l;
+    track->last_time = point.time;
+    output_track_point(&track->output, &point);
+}
+
+/**
+  * Convert a log of the receiver's NMEA output (GGA and RMC) to a track on
+  * STDOUT, "-" reads STDIN. Returns ERROR if the file cannot be read.
+  */
+int skytraq_decode_nmea( const char* path, const skytraq_dump_options* options, skytraq_dump_report* report ) {
+    static gbuint8 buffer[65536];
+    fix_builder builder;
+    nmea_track track;
+    double start = monotonic_time();
+    size_t length;
+    FILE* in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+
+    memset(report, 0, sizeof(skytraq_dump_report));
+    if ( in == NULL )
+        return ERROR;
+
+    fix_builder_init(&builder);
+    track.last_time = 0;
+    output_writer_init(&track.output, stdout, options->format, options->precision);
+    output_writer_window(&track.output, options->from, options->to);
+    output_header(&track.output);
+    while ( (length = fread(buffer, 1, sizeof(buffer), in)) > 0 )
+        fix_builder_feed(&builder, buffer, length, write_fix, &track);
+    fix_builder_flush(&builder, write_fix, &track);
+    output_footer(&track.output);
+    output_writer_close(&track.output);
+
+    if ( builder.parser.checksum_errors + builder.parser.malformed > 0 )
+        fprintf(stderr, "%lu NMEA sentences, %lu with checksum errors, %lu malformed\n", builder.parser.sentences,
+                builder.parser.checksum_errors, builder.parser.malformed);
+    if ( in != stdin )
+        fclose(in);
+    report->decode_time = report->total_time = monotonic_time() - start;
+    return SUCCESS;
+}
+
+/**
+  * Dump all used sectors as track to STDOUT. Sectors that are final are taken
+  * from the sector cache if enabled. With a time window only the sectors
+  * overlapping it are read, found with the time index of the cache or a binary
+  * search over the log. A separate thread reads the sectors
+  * into a queue while the calling thread decodes them, so the serial line does
+  * not wait for the output. If requested the transfer runs at the highest
+  * baud-rate possible; the original rate is restored afterwards, also when the
+  * dump is interrupted by SIGINT or SIGTERM. Returns the number of sectors that
+  * could not be read.
+  */
+int skytraq_dump( int fd, unsigned baud_rate, const skytraq_config* info, const skytraq_dump_options* options, skytraq_dump_report* report ) {
+    double start = monotonic_time();
+    dump_job* job = calloc(1, sizeof(dump_job));
+    struct sigaction action, old_int, old_term;
+    pthread_t reader;
+
+    memset(report, 0, sizeof(skytraq_dump_report));
+    job->fd = fd;
+    job->options = options;
+    job->report = report;
+    job->used_sectors = info->total_sectors - info->sectors_left + 1;
+    pthread_mutex_init(&job->queue.lock, NULL);
+    pthread_cond_init(&job->queue.not_empty, NULL);
+    pthread_cond_init(&job->queue.not_full, NULL);
+
+    interrupted = 0;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    report->baud_rate = baud_rate;
+    if ( options->upshift ) {
+        report->baud_rate = skytraq_upshift_speed(fd, baud_rate);
+        if ( report->baud_rate == 0 ) {
+            fprintf(stderr, "lost connection while changing the baud-rate\n");
+            job->used_sectors = 0;
+        }
+    }
+
+    /* a flash image always gets all sectors */
+    job->window = (options->from != LONG_MIN || options->to != LONG_MAX) && options->raw_image == NULL;
+    job->cache_sectors = options->cache_dir != NULL;
+    if ( (job->cache_sectors || job->window) && job->used_sectors > 0 ) {
+        job->cache = open_cache(fd, info, options);
+        if ( job->cache != NULL ) {
+            job->probes = calloc(job->used_sectors, sizeof(sector_slot*));
+            check_cache(job);
+        }
+    }
+
+    if ( options->raw_image != NULL ) {
+        job->image = create_image(fd, info, job->used_sectors, options->raw_image);
+        if ( job->image == NULL )
+            job->used_sectors = 0;
+    } else {
+        output_writer_init(&job->output, stdout, options->format, options->precision);
+        output_writer_window(&job->output, options->from, options->to);
+        output_header(&job->output);
+    }
+
+    if ( job->window && job->used_sectors > 0 ) {
+        long first, last;
+        unsigned delay = 0;
+
+        if ( job->probes == NULL )
+            job->probes = calloc(job->used_sectors, sizeof(sector_slot*));
+        if ( options->from != LONG_MIN )
+            job->first_sector = find_first_sector(job, options->from, &delay);
+        if ( job->first_sector > 0 && job->cache != NULL &&
+                sector_cache_times(job->cache, job->first_sector - 1, &first, &last) == SUCCESS )
+            job->first_timestamp = last;
+        DEBUG("time window starts in sector %d\n", job->first_sector);
+    }
+
+    if ( pthread_create(&reader, NULL, read_sectors, job) == 0 ) {
+        decode_sectors(job);
+        pthread_join(reader, NULL);
+    } else {
+        fprintf(stderr, "could not start reader thread\n");
+    }
+
+    if ( job->image != NULL ) {
+        if ( flash_image_close_writer(job->image) != SUCCESS )
+            fprintf(stderr, "cannot write %s\n", options->raw_image);
+    } else if ( options->raw_image == NULL ) {
+        output_footer(&job->output);
+        output_writer_close(&job->output);
+    }
+
+    if ( job->queue.depth_sum > 0 )
+        report->avg_queue_depth = (double)job->queue.depth_sum / report->sectors;
+
+    if ( job->probes != NULL ) {
+        int i;
+        for ( i = 0; i < job->used_sectors; i++ ) {
+            if ( job->probes[i] != NULL )
+                report->probed_sectors++;
+            free(job->probes[i]);
+        }
+        free(job->probes);
+        if ( !interrupted )
+            report->skipped_sectors = job->used_sectors - report->sectors - report->probed_sectors;
+    }
+
+    pthread_cond_destroy(&job->queue.not_full);
+    pthread_cond_destroy(&job->queue.not_empty);
+    pthread_mutex_destroy(&job->queue.lock);
+    sector_cache_close(job->cache);
+    free(job);
+
+    if ( report->baud_rate != 0 && report->baud_rate != baud_rate ) {
+        flush_input(fd);
+        skytraq_restore_speed(fd, report->baud_rate, baud_rate);
+    }
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    if ( interrupted ) {
+        /* terminate the usual way now that the device is back to normal */
+        fflush(stdout);
+        raise(interrupted);
+    }
+
+    report->total_time = monotonic_time() - start;
+    return report->failed_sectors;
+}
@@ -0,0 +1,72 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef dump_h
+#define dump_h
+
+#include "datalog-decode.h"
+
+/* strategies for spacing the READ_SECTOR commands */
+enum { PACING_ADAPTIVE, PACING_NONE, PACING_FIXED };
+
+typedef struct skytraq_dump_options {
+    int         pacing;
+    int         upshift;        /* raise the baud-rate for the transfer */
+    const char* cache_dir;      /* directory of the sector cache, NULL to disable it */
+    const char* cache_id;       /* name of the device in the cache, NULL to derive it
+                                   from the software version and CRC */
+    const char* raw_image;      /* write the sectors to this flash image instead of
+                                   printing the track */
+    const output_format* format; /* format of the track output */
+    int         precision;      /* digits after the decimal point in text formats */
+    int         fast_geo;       /* linearized coordinates for short entries */
+    long        from;           /* only points recorded from this time on, LONG_MIN for all */
+    long        to;             /* only points recorded up to this time, LONG_MAX for all */
+} skytraq_dump_options;
+
+typedef struct skytraq_dump_report {
+    int         sectors;        /* sectors requested */
+    int         failed_sectors; /* sectors given up after all retries */
+    int         retries;
+    int         cached_sectors; /* sectors taken from the sector cache */
+    int         skipped_sectors;/* sectors outside the time window, not read */
+    int         probed_sectors; /* sectors read only to locate the time window */
+    unsigned    baud_rate;      /* rate used for the transfer */
+    double      transfer_time;  /* seconds spent reading sectors */
+    double      wait_time;      /* seconds spent pausing between requests */
+    double      decode_time;    /* seconds spent decoding and writing the track */
+    int         max_queue_depth;/* most sectors waiting for the decoder */
+    double      avg_queue_depth;/* sectors waiting when a new one was queued */
+    int         reader_stalls;  /* reader waited for a free buffer */
+    int         decoder_stalls; /* decoder waited for a sector */
+    decode_stats decode;        /* entries found in the log */
+    double      total_time;
+} skytraq_dump_report;
+
+int skytraq_parse_pacing( const char* name );
+int skytraq_parse_time( const char* text, int end_of_day, long* seconds );
+int skytraq_decode_image( const char* path, int threads, const skytraq_dump_options* options, skytraq_dump_report* report );
+int skytraq_decode_nmea( const char* path, const skytraq_dump_options* options, skytraq_dump_report* report );
+void skytraq_clear_cache( int fd, const skytraq_dump_options* options );
+int skytraq_dump( int fd, unsigned baud_rate, const skytraq_config* info, const skytraq_dump_options* options, skytraq_dump_report* report );
+
+#endif
@@ -0,0 +1,258 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "datalog-decode.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+/*
+ * Batch version of ecef_to_geo(). The constants are computed once and the
+ * algebraic part runs on 2 (SSE2) or 4 (AVX2) points at a time. The operations
+ * are done in the same order as in ecef_to_geo() and atan()/atan2() come from
+ * libm, so the results are bit for bit the same as those of the scalar function.
+ *
+ * ecef_to_geo() takes the cube root as pow(x, 1/3); the integer division makes
+ * the exponent 0, so the factor s is always 1 and P = F/(27*G*G). This is kept
+ * here to give identical results.
+ */
+static pthread_once_t geo_once = PTHREAD_ONCE_INIT;
+static struct {
+    double  a, b2, e2, ep2, one_e2, e2E2, k54bb, e2e2, k2e2e2, a2_2;
+} geo;
+
+static void init_constants( void ) {
+    double a, f, b, e2, E2;
+
+    a = 6378137.0; /* earth semimajor axis in meters */
+    f = 1/298.257223563; /* reciprocal flattening */
+    b = a*(1-f); /* semi-minor axis */
+    e2 = 2*f-f*f; /* first eccentricity squared */
+    E2 = a*a - b*b;
+
+    geo.a = a;
+    geo.b2 = b*b;
+    geo.e2 = e2;
+    geo.ep2 = f*(2-f)/((1-f)*(1-f)); /* second eccentricity squared */
+    geo.one_e2 = 1-e2;
+    geo.e2E2 = e2*E2;
+    geo.k54bb = 54*b*b;
+    geo.e2e2 = e2*e2;
+    geo.k2e2e2 = 2*e2*e2;
+    geo.a2_2 = a*a/2;
+}
+
+static void convert_scalar( const double* x, const double* y, const double* z,
+                            double* longitude, double* latitude, double* height, int i, int n ) {
+    for ( ; i < n; i++ ) {
+        double X = x[i], Y = y[i], Z = z[i];
+        double r2, r, F, G, P, Q, ro, d, U, V, zo;
+
+        r2 = X*X+Y*Y;
+        r = sqrt(r2);
+        F = geo.k54bb*Z*Z;
+        G = r2 + geo.one_e2*Z*Z - geo.e2E2;
+        P = F/(27*G*G);
+        Q = sqrt(1+geo.k2e2e2*P);
+        ro = -(geo.e2*P*r)/(1+Q) + sqrt(geo.a2_2*(1+1/Q) - (geo.one_e2*P*Z*Z)/(Q*(1+Q)) - P*r2/2);
+        d = r - geo.e2*ro;
+        U = sqrt( d*d + Z*Z );
+        V = sqrt( d*d + geo.one_e2*Z*Z );
+        zo = (geo.b2*Z)/(geo.a*V);
+
+        height[i] = U*( 1 - geo.b2/(geo.a*V));
+        latitude[i] = atan( (Z + geo.ep2*zo)/r )*180/M_PI;
+        longitude[i] = atan2(Y,X)*180/M_PI;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+static int convert_sse2( const double* x, const double* y, const double* z,
+                         double* longitude, double* latitude, double* height, int n ) {
+    const __m128d one = _mm_set1_pd(1), two = _mm_set1_pd(2), k27 = _mm_set1_pd(27);
+    const __m128d a = _mm_set1_pd(geo.a), b2 = _mm_set1_pd(geo.b2), e2 = _mm_set1_pd(geo.e2);
+    const __m128d ep2 = _mm_set1_pd(geo.ep2), one_e2 = _mm_set1_pd(geo.one_e2), e2E2 = _mm_set1_pd(geo.e2E2);
+    const __m128d k54bb = _mm_set1_pd(geo.k54bb), k2e2e2 = _mm_set1_pd(geo.k2e2e2), a2_2 = _mm_set1_pd(geo.a2_2);
+    const __m128d sign = _mm_set1_pd(-0.0);
+    int i, j;
+
+    for ( i = 0; i + 2 <= n; i += 2 ) {
+        __m128d X = _mm_loadu_pd(x+i), Z = _mm_loadu_pd(z+i), Y = _mm_loadu_pd(y+i);
+        __m128d ZZ, r2, r, F, G, P, Q, Q1, ro, d, dd, U, V, aV, zo, t;
+        double lat[2];
+
+        r2 = _mm_add_pd(_mm_mul_pd(X,X), _mm_mul_pd(Y,Y));
+        r = _mm_sqrt_pd(r2);
+        F = _mm_mul_pd(_mm_mul_pd(k54bb,Z),Z);
+        ZZ = _mm_mul_pd(_mm_mul_pd(one_e2,Z),Z);
+        G = _mm_sub_pd(_mm_add_pd(r2, ZZ), e2E2);
+        P = _mm_div_pd(F, _mm_mul_pd(_mm_mul_pd(k27,G),G));
+        Q = _mm_sqrt_pd(_mm_add_pd(one, _mm_mul_pd(k2e2e2,P)));
+        Q1 = _mm_add_pd(one,Q);
+        ro = _mm_div_pd(_mm_xor_pd(sign, _mm_mul_pd(_mm_mul_pd(e2,P),r)), Q1);
+        t = _mm_mul_pd(a2_2, _mm_add_pd(one, _mm_div_pd(one,Q)));
+        t = _mm_sub_pd(t, _mm_div_pd(_mm_mul_pd(_mm_mul_pd(_mm_mul_pd(one_e2,P),Z),Z), _mm_mul_pd(Q,Q1)));
+        t = _mm_sub_pd(t, _mm_div_pd(_mm_mul_pd(P,r2), two));
+        ro = _mm_add_pd(ro, _mm_sqrt_pd(t));
+        d = _mm_sub_pd(r, _mm_mul_pd(e2,ro));
+        dd = _mm_mul_pd(d,d);
+        U = _mm_sqrt_pd(_mm_add_pd(dd, _mm_mul_pd(Z,Z)));
+        V = _mm_sqrt_pd(_mm_add_pd(dd, ZZ));
+        aV = _mm_mul_pd(a,V);
+        zo = _mm_div_pd(_mm_mul_pd(b2,Z), aV);
+
+        _mm_storeu_pd(height+i, _mm_mul_pd(U, _mm_sub_pd(one, _mm_div_pd(b2,aV))));
+        _mm_storeu_pd(lat, _mm_div_pd(_mm_add_pd(Z, _mm_mul_pd(ep2,zo)), r));
+        for ( j = 0; j < 2; j++ ) {
+            latitude[i+j] = atan(lat[j])*180/M_PI;
+            longitude[i+j] = atan2(y[i+j],x[i+j])*180/M_PI;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int convert_avx2( const double* x, const double* y, const double* z,
+                         double* longitude, double* latitude, double* height, int n ) {
+    const __m256d one = _mm256_set1_pd(1), two = _mm256_set1_pd(2), k27 = _mm256_set1_pd(27);
+    const __m256d a = _mm256_set1_pd(geo.a), b2 = _mm256_set1_pd(geo.b2), e2 = _mm256_set1_pd(geo.e2);
+    const __m256d ep2 = _mm256_set1_pd(geo.ep2), one_e2 = _mm256_set1_pd(geo.one_e2), e2E2 = _mm256_set1_pd(geo.e2E2);
+    const __m256d k54bb = _mm256_set1_pd(geo.k54bb), k2e2e2 = _mm256_set1_pd(geo.k2e2e2), a2_2 = _mm256_set1_pd(geo.a2_2);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    int i, j;
+
+    for ( i = 0; i + 4 <= n; i += 4 ) {
+        __m256d X = _mm256_loadu_pd(x+i), Z = _mm256_loadu_pd(z+i), Y = _mm256_loadu_pd(y+i);
+        __m256d ZZ, r2, r, F, G, P, Q, Q1, ro, d, dd, U, V, aV, zo, t;
+        double lat[4];
+
+        r2 = _mm256_add_pd(_mm256_mul_pd(X,X), _mm256_mul_pd(Y,Y));
+        r = _mm256_sqrt_pd(r2);
+        F = _mm256_mul_pd(_mm256_mul_pd(k54bb,Z),Z);
+        ZZ = _mm256_mul_pd(_mm256_mul_pd(one_e2,Z),Z);
+        G = _mm256_sub_pd(_mm256_add_pd(r2, ZZ), e2E2);
+        P = _mm256_div_pd(F, _mm256_mul_pd(_mm256_mul_pd(k27,G),G));
+        Q = _mm256_sqrt_pd(_mm256_add_pd(one, _mm256_mul_pd(k2e2e2,P)));
+        Q1 = _mm256_add_pd(one,Q);
+        ro = _mm256_div_pd(_mm256_xor_pd(sign, _mm256_mul_pd(_mm256_mul_pd(e2,P),r)), Q1);
+        t = _mm256_mul_pd(a2_2, _mm256_add_pd(one, _mm256_div_pd(one,Q)));
+        t = _mm256_sub_pd(t, _mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(one_e2,P),Z),Z), _mm256_mul_pd(Q,Q1)));
+        t = _mm256_sub_pd(t, _mm256_div_pd(_mm256_mul_pd(P,r2), two));
+        ro = _mm256_add_pd(ro, _mm256_sqrt_pd(t));
+        d = _mm256_sub_pd(r, _mm256_mul_pd(e2,ro));
+        dd = _mm256_mul_pd(d,d);
+        U = _mm256_sqrt_pd(_mm256_add_pd(dd, _mm256_mul_pd(Z,Z)));
+        V = _mm256_sqrt_pd(_mm256_add_pd(dd, ZZ));
+        aV = _mm256_mul_pd(a,V);
+        zo = _mm256_div_pd(_mm256_mul_pd(b2,Z), aV);
+
+        _mm256_storeu_pd(height+i, _mm256_mul_pd(U, _mm256_sub_pd(one, _mm256_div_pd(b2,aV))));
+        _mm256_storeu_pd(lat, _mm256_div_pd(_mm256_add_pd(Z, _mm256_mul_pd(ep2,zo)), r));
+        for ( j = 0; j < 4; j++ ) {
+            latitude[i+j] = atan(lat[j])*180/M_PI;
+            longitude[i+j] = atan2(y[i+j],x[i+j])*180/M_PI;
+        }
+    }
+    return i;
+}
+#endif
+
+/**
+  * Convert <n> points from ECEF coordinates to longitude, latitude (degrees)
+  * and height (meters). Same results as calling ecef_to_geo() for each point.
+  */
+void ecef_to_geo_batch( const double* x, const double* y, const double* z,
+                        double* longitude, double* latitude, double* height, int n ) {
+    int done = 0;
+
+    pthread_once(&geo_once, init_constants);
+
+#ifdef HAVE_X86_SIMD
+    if ( __builtin_cpu_supports("avx2") )
+        done = convert_avx2(x, y, z, longitude, latitude, height, n);
+    else if ( __builtin_cpu_supports("sse2") )
+        done = convert_sse2(x, y, z, longitude, latitude, height, n);
+#endif
+
+    convert_scalar(x, y, z, longitude, latitude, height, done, n);
+}
+
+/**
+  * Make <anchor> the point at ECEF <x>, <y>, <z> whose exact coordinates are
+  * <longitude>, <latitude> and <height>, and compute the derivatives of the
+  * geodetic coordinates there. Near the poles the longitude changes too fast
+  * for a linear approximation; the anchor is left invalid then.
+  */
+void geo_anchor_set( geo_anchor* anchor, double x, double y, double z,
+                     double longitude, double latitude, double height ) {
+    const double a = 6378137.0, f = 1/298.257223563, e2 = 2*f-f*f;
+    const double deg = 180/M_PI;
+    double phi = latitude/deg, lambda = longitude/deg;
+    double sp = sin(phi), cp = cos(phi), sl = sin(lambda), cl = cos(lambda);
+    double w = 1 - e2*sp*sp;
+    double N = a/sqrt(w), M = a*(1-e2)/(w*sqrt(w));
+
+    anchor->x = x;
+    anchor->y = y;
+    anchor->z = z;
+    anchor->longitude = longitude;
+    anchor->latitude = latitude;
+    anchor->height = height;
+    anchor->valid = fabs(cp) > 0.01;
+
+    anchor->jacobian[0][0] = -sl/((N+height)*cp)*deg;
+    anchor->jacobian[0][1] = cl/((N+height)*cp)*deg;
+    anchor->jacobian[0][2] = 0;
+    anchor->jacobian[1][0] = -sp*cl/(M+height)*deg;
+    anchor->jacobian[1][1] = -sp*sl/(M+height)*deg;
+    anchor->jacobian[1][2] = cp/(M+height)*deg;
+    anchor->jacobian[2][0] = cp*cl;
+    anchor->jacobian[2][1] = cp*sl;
+    anchor->jacobian[2][2] = sp;
+}
+
+/**
+  * Convert ECEF <x>, <y>, <z> with the linear approximation around <anchor>.
+  * Returns 0 without a result if the point is more than GEO_ANCHOR_RADIUS
+  * meters away from the anchor; see the accuracy note in datalog-decode.h.
+  * Like ecef_to_geo() the longitude is in (-180, 180], also for points across
+  * the antimeridian from the anchor.
+  */
+int geo_anchor_convert( const geo_anchor* anchor, double x, double y, double z,
+                        double* longitude, double* latitude, double* height ) {
+    double dx = x - anchor->x, dy = y - anchor->y, dz = z - anchor->z;
+
+    if ( !anchor->valid || dx*dx + dy*dy + dz*dz > GEO_ANCHOR_RADIUS*GEO_ANCHOR_RADIUS )
+        return 0;
+
+    *longitude = anchor->longitude + anchor->jacobian[0][0]*dx + anchor->jacobian[0][1]*dy;
+    if ( *longitude > 180 )
+        *longitude -= 360;
+    else if ( *longitude <= -180 )
+        *longitude += 360;
+    *latitude = anchor->latitude + anchor->jacobian[1][0]*dx + anchor->jacobian[1][1]*dy + anchor->jacobian[1][2]*dz;
+    *height = anchor->height + anchor->jacobian[2][0]*dx + anchor->jacobian[2][1]*dy + anchor->jacobian[2][2]*dz;
+    return 1;
+}
@@ -0,0 +1,96 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "live-fix.h"
+#include "fix-shm.h"
+#include <errno.h>
+#include <sys/stat.h>
+
+#if FIX_SHM_HAS_POSITION != FIX_HAS_POSITION || FIX_SHM_HAS_ALTITUDE != FIX_HAS_ALTITUDE || \
+    FIX_SHM_HAS_VELOCITY != FIX_HAS_VELOCITY || FIX_SHM_HAS_DATE != FIX_HAS_DATE
+#error "fix-shm.h and live-fix.h disagree about the fields of a fix"
+#endif
+
+/**
+  * Create (or take over) the segment <name> and map it for writing.
+  */
+skytraq_fix_shm* fix_shm_create( const char* name ) {
+    skytraq_fix_shm* shm;
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+
+    if ( fd < 0 ) {
+        fprintf(stderr, "Cannot create shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if ( ftruncate(fd, sizeof(skytraq_fix_shm)) < 0 ) {
+        fprintf(stderr, "Cannot resize shared memory %s: %s\n", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    shm = mmap(NULL, sizeof(skytraq_fix_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( shm == MAP_FAILED ) {
+        fprintf(stderr, "Cannot map shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    /* readers that still have the old contents see a stopped writer */
+    __atomic_store_n(&shm->magic, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->sequence, 0, __ATOMIC_RELEASE);
+    memset(&shm->fix, 0, sizeof(fix_shm_record));
+    shm->version = FIX_SHM_VERSION;
+    shm->size = sizeof(skytraq_fix_shm);
+    shm->writer = getpid();
+    __atomic_store_n(&shm->magic, FIX_SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+/**
+  * Make <fix> the latest fix. There must be only one writer.
+  */
+void fix_shm_publish( skytraq_fix_shm* shm, const skytraq_fix* fix ) {
+    uint64_t sequence = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&shm->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->fix.time = fix->time;
+    shm->fix.latitude = fix->latitude;
+    shm->fix.longitude = fix->longitude;
+    shm->fix.altitude = fix->altitude;
+    shm->fix.speed = fix->speed;
+    shm->fix.course = fix->course;
+    shm->fix.satellites = fix->satellites;
+    shm->fix.quality = fix->quality;
+    /* the segment has no room for the dilution of precision */
+    shm->fix.fields = fix->fields & ~FIX_HAS_DOP;
+    shm->fix.binary = fix->binary;
+    __atomic_store_n(&shm->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+  * Stop writing. The segment stays with the last fix, so readers can tell a
+  * stopped writer (writer is 0) from a missing one.
+  */
+void fix_shm_close( skytraq_fix_shm* shm ) {
+    __atomic_store_n(&shm->writer, 0, __ATOMIC_RELEASE);
+    munmap(shm, sizeof(skytraq_fix_shm));
+}
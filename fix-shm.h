@@ -0,0 +1,149 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef fix_shm_h
+#define fix_shm_h
+
+/*
+ * The latest fix in POSIX shared memory, written by --shm <NAME>.
+ *
+ * This header is all a reader needs: map the segment with fix_shm_open()
+ * and call fix_shm_read() as often as wanted. A read is a few loads from
+ * memory, no system call and no lock. The writer updates the fix under a
+ * sequence lock: the sequence is odd while it writes, a reader copies the
+ * fix and retries if the sequence changed meanwhile.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define FIX_SHM_MAGIC       0x58464b53      /* "SKFX" */
+#define FIX_SHM_VERSION     1
+#define FIX_SHM_SPINS       (1 << 16)       /* reads of one unfinished update before checking the writer */
+
+/* the same as FIX_HAS_* in live-fix.h */
+#define FIX_SHM_HAS_POSITION    0x01
+#define FIX_SHM_HAS_ALTITUDE    0x02
+#define FIX_SHM_HAS_VELOCITY    0x04
+#define FIX_SHM_HAS_DATE        0x08
+
+typedef struct fix_shm_record {
+    double      time;           /* seconds since 1970, UTC */
+    double      latitude;       /* degrees */
+    double      longitude;      /* degrees */
+    double      altitude;       /* meters above mean sea level */
+    double      speed;          /* km/h */
+    double      course;         /* degrees from north */
+    int32_t     satellites;
+    int32_t     quality;        /* 0 means no fix */
+    int32_t     fields;         /* FIX_SHM_HAS_* */
+    int32_t     binary;         /* from binary navigation data instead of NMEA */
+} fix_shm_record;
+
+/* one cache line of header, one of fix */
+typedef struct skytraq_fix_shm {
+    uint32_t        magic;      /* FIX_SHM_MAGIC once the segment is ready */
+    uint32_t        version;
+    uint32_t        size;       /* sizeof(skytraq_fix_shm) */
+    int32_t         writer;     /* process id of the writer, 0 after it stopped */
+    uint64_t        sequence;   /* twice the number of fixes, odd during an update */
+    uint64_t        reserved[5];
+    fix_shm_record  fix;
+} skytraq_fix_shm;
+
+/**
+  * Map the segment <name> (e.g. "/skytraq") for reading. Returns NULL if it
+  * does not exist or was written by an incompatible version.
+  */
+static inline const skytraq_fix_shm* fix_shm_open( const char* name ) {
+    skytraq_fix_shm* shm;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if ( fd < 0 )
+        return NULL;
+    shm = mmap(NULL, sizeof(skytraq_fix_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( shm == MAP_FAILED )
+        return NULL;
+    if ( __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != FIX_SHM_MAGIC ||
+         shm->version != FIX_SHM_VERSION || shm->size != sizeof(skytraq_fix_shm) ) {
+        munmap(shm, sizeof(skytraq_fix_shm));
+        return NULL;
+    }
+    return shm;
+}
+
+/**
+  * Copy the latest fix to <fix>. Returns the number of fixes written so far
+  * (0: none yet, <fix> is not changed), or -1 if the writer died in the
+  * middle of an update. Only then a system call is made: to see whether the
+  * writer still exists after a long wait.
+  */
+static inline int64_t fix_shm_read( const skytraq_fix_shm* shm, fix_shm_record* fix ) {
+    uint64_t unfinished = 0;
+    long spins = 0;
+
+    for ( ;; ) {
+        uint64_t before = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+
+        if ( before & 1 ) {
+            if ( before != unfinished ) {
+                unfinished = before;
+                spins = 0;
+            } else if ( ++spins > FIX_SHM_SPINS ) {
+                pid_t writer = __atomic_load_n(&shm->writer, __ATOMIC_RELAXED);
+
+                if ( writer == 0 || (kill(writer, 0) < 0 && errno == ESRCH) )
+                    return -1;
+                /* preempted, let it finish */
+                sched_yield();
+                spins = 0;
+            }
+            continue;
+        }
+        if ( before == 0 )
+            return 0;
+        memcpy(fix, (const void*)&shm->fix, sizeof(fix_shm_record));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED) == before )
+            return before / 2;
+    }
+}
+
+static inline void fix_shm_unmap( const skytraq_fix_shm* shm ) {
+    munmap((void*)shm, sizeof(skytraq_fix_shm));
+}
+
+/* the writer's side, in fix-shm.c */
+struct skytraq_fix;
+
+skytraq_fix_shm* fix_shm_create( const char* name );
+void fix_shm_publish( skytraq_fix_shm* shm, const struct skytraq_fix* fix );
+void fix_shm_close( skytraq_fix_shm* shm );
+
+#endif
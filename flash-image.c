@@ -0,0 +1,185 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "flash-image.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void put_uint16( gbuint8* buf, unsigned value ) {
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+}
+
+static void put_uint32( gbuint8* buf, unsigned long value ) {
+    put_uint16(buf, value & 0xffff);
+    put_uint16(buf + 2, (value >> 16) & 0xffff);
+}
+
+static unsigned get_uint16( const gbuint8* buf ) {
+    return buf[0] | (buf[1] << 8);
+}
+
+static unsigned long get_uint32( const gbuint8* buf ) {
+    return get_uint16(buf) | ((unsigned long)get_uint16(buf + 2) << 16);
+}
+
+static long sector_offset( gbuint32 sector_count, int sector ) {
+    return FLASH_IMAGE_HEADER_SIZE + 4l * sector_count + (long)sector * SKYTRAQ_SECTOR_SIZE;
+}
+
+/**
+  * Create an image for <info->sector_count> sectors. All sectors are marked
+  * as unreadable until they are written.
+  */
+flash_image_writer* flash_image_create( const char* path, const flash_image_info* info ) {
+    flash_image_writer* writer;
+    gbuint8 header[FLASH_IMAGE_HEADER_SIZE];
+    gbuint8 length[4];
+    int i;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, FLASH_IMAGE_MAGIC, 8);
+    put_uint32(header + 8, FLASH_IMAGE_VERSION);
+    put_uint32(header + 12, info->sector_count);
+    put_uint32(header + 16, info->log_wr_ptr);
+    put_uint16(header + 20, info->total_sectors);
+    put_uint16(header + 22, info->sectors_left);
+    memcpy(header + 24, info->version.kernel, 3);
+    memcpy(header + 27, info->version.odm, 3);
+    memcpy(header + 30, info->version.revision, 3);
+    put_uint16(header + 34, info->crc);
+
+    writer = malloc(sizeof(flash_image_writer));
+    writer->sector_count = info->sector_count;
+    writer->file = fopen(path, "wb");
+    if ( writer->file == NULL ) {
+        free(writer);
+        return NULL;
+    }
+
+    fwrite(header, 1, sizeof(header), writer->file);
+    put_uint32(length, (unsigned long)-1);
+    for ( i = 0; i < info->sector_count; i++ ) {
+        fwrite(length, 1, 4, writer->file);
+    }
+
+    /* make sure the file covers all sectors */
+    fseek(writer->file, sector_offset(info->sector_count, info->sector_count) + FLASH_IMAGE_PADDING - 1, SEEK_SET);
+    fputc(0, writer->file);
+
+    return writer;
+}
+
+int flash_image_write_sector( flash_image_writer* writer, int sector, const gbuint8* data, int length ) {
+    gbuint8 buf[4];
+
+    if ( sector < 0 || sector >= writer->sector_count || length > SKYTRAQ_SECTOR_SIZE )
+        return ERROR;
+
+    put_uint32(buf, (unsigned long)length);
+    if ( fseek(writer->file, FLASH_IMAGE_HEADER_SIZE + 4l * sector, SEEK_SET) ||
+            fwrite(buf, 1, 4, writer->file) != 4 )
+        return ERROR;
+
+    if ( length > 0 ) {
+        if ( fseek(writer->file, sector_offset(writer->sector_count, sector), SEEK_SET) ||
+                fwrite(data, 1, length, writer->file) != length )
+            return ERROR;
+    }
+    return SUCCESS;
+}
+
+int flash_image_close_writer( flash_image_writer* writer ) {
+    int result = fclose(writer->file) == 0 ? SUCCESS : ERROR;
+    free(writer);
+    return result;
+}
+
+/**
+  * Map an image into memory. Returns ERROR if the file cannot be read or is not an image.
+  */
+int flash_image_open( const char* path, flash_image* image ) {
+    struct stat st;
+    const gbuint8* map;
+    int fd;
+
+    memset(image, 0, sizeof(flash_image));
+
+    fd = open(path, O_RDONLY);
+    if ( fd == -1 )
+        return ERROR;
+    if ( fstat(fd, &st) != 0 || st.st_size < FLASH_IMAGE_HEADER_SIZE ) {
+        close(fd);
+        return ERROR;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED )
+        return ERROR;
+
+    image->map = map;
+    image->size = st.st_size;
+
+    if ( memcmp(map, FLASH_IMAGE_MAGIC, 8) != 0 || get_uint32(map + 8) != FLASH_IMAGE_VERSION ) {
+        flash_image_close(image);
+        return ERROR;
+    }
+
+    image->info.sector_count = get_uint32(map + 12);
+    image->info.log_wr_ptr = get_uint32(map + 16);
+    image->info.total_sectors = get_uint16(map + 20);
+    image->info.sectors_left = get_uint16(map + 22);
+    memcpy(image->info.version.kernel, map + 24, 3);
+    memcpy(image->info.version.odm, map + 27, 3);
+    memcpy(image->info.version.revision, map + 30, 3);
+    image->info.crc = get_uint16(map + 34);
+
+    /* the count is not trusted: checked without overflow against the file size */
+    if ( image->size < (size_t)FLASH_IMAGE_HEADER_SIZE + FLASH_IMAGE_PADDING ||
+            image->info.sector_count > (image->size - FLASH_IMAGE_HEADER_SIZE - FLASH_IMAGE_PADDING) /
+                                       (4 + SKYTRAQ_SECTOR_SIZE) ) {
+        flash_image_close(image);
+        return ERROR;
+    }
+
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+    return SUCCESS;
+}
+
+/**
+  * Returns a pointer to the data of a sector and sets <length>, -1 if the sector
+  * could not be read when the image was made.
+  */
+const gbuint8* flash_image_sector( const flash_image* image, int sector, int* length ) {
+    long len = get_uint32(image->map + FLASH_IMAGE_HEADER_SIZE + 4 * sector);
+
+    *length = ( len > SKYTRAQ_SECTOR_SIZE ) ? -1 : len;
+    return image->map + sector_offset(image->info.sector_count, sector);
+}
+
+void flash_image_close( flash_image* image ) {
+    if ( image->map != NULL ) {
+        munmap((void*)image->map, image->size);
+        image->map = NULL;
+    }
+}
@@ -0,0 +1,76 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef flash_image_h
+#define flash_image_h
+
+/*
+ * File format for a copy of the log memory, all numbers little endian:
+ *
+ *   0  "STQFLASH"
+ *   8  format version (uint32)
+ *  12  number of sectors (uint32)
+ *  16  log_wr_ptr (uint32)
+ *  20  total sectors, sectors left (uint16 each)
+ *  24  kernel, ODM and revision from the software version (3 bytes each), padding
+ *  34  software CRC (uint16)
+ *  36  reserved (uint32)
+ *  40  length of the data in each sector (int32, -1 if it could not be read)
+ *      followed by the sectors, SKYTRAQ_SECTOR_SIZE bytes each, and
+ *      FLASH_IMAGE_PADDING zero bytes; the decoder does not need them
+ *      anymore, they are kept so that images stay version 1
+ */
+#define FLASH_IMAGE_MAGIC           "STQFLASH"
+#define FLASH_IMAGE_VERSION         1
+#define FLASH_IMAGE_HEADER_SIZE     40
+#define FLASH_IMAGE_PADDING         32
+
+typedef struct flash_image_info {
+    gbuint32        sector_count;
+    gbuint32        log_wr_ptr;
+    gbuint16        total_sectors;
+    gbuint16        sectors_left;
+    skytraq_version version;
+    unsigned        crc;
+} flash_image_info;
+
+/* an image opened for writing */
+typedef struct flash_image_writer {
+    FILE*           file;
+    gbuint32        sector_count;
+} flash_image_writer;
+
+/* an image mapped into memory */
+typedef struct flash_image {
+    flash_image_info    info;
+    const gbuint8*      map;
+    size_t              size;
+} flash_image;
+
+flash_image_writer* flash_image_create( const char* path, const flash_image_info* info );
+int flash_image_write_sector( flash_image_writer* writer, int sector, const gbuint8* data, int length );
+int flash_image_close_writer( flash_image_writer* writer );
+int flash_image_open( const char* path, flash_image* image );
+const gbuint8* flash_image_sector( const flash_image* image, int sector, int* length );
+void flash_image_close( flash_image* image );
+
+#endif
@@ -0,0 +1,222 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "live-fix.h"
+#include "message-decode.h"
+
+/* sentences collected by the fix_builder */
+#define FIX_GGA             1
+#define FIX_RMC             2
+
+#define KNOTS               1.852       /* km/h */
+
+void fix_builder_init( fix_builder* b ) {
+    memset(b, 0, sizeof(fix_builder));
+    nmea_parser_init(&b->parser);
+    b->time_of_day = -1;
+}
+
+/**
+  * The day of an RMC sentence in seconds since 1970. Computed instead of
+  * timegm(), which takes a lock and is slower than parsing the sentence.
+  */
+static long rmc_date( const nmea_rmc* rmc ) {
+    /* days since 1970 of the proleptic Gregorian calendar, the year starts in March */
+    long year = rmc->year - (rmc->month <= 2);
+    long era = year / 400;
+    long year_of_era = year - era * 400;
+    long day_of_year = (153 * (rmc->month + (rmc->month > 2 ? -3 : 9)) + 2) / 5 + rmc->day - 1;
+    long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return (era * 146097 + day_of_era - 719468) * 86400;
+}
+
+static void publish( fix_builder* b ) {
+    if ( b->sentences != 0 ) {
+        long day = b->date;
+
+        if ( day != 0 ) {
+            b->fix.fields |= FIX_HAS_DATE;
+        } else {
+            day = time(NULL) / 86400 * 86400;
+        }
+        b->fix.time = day + b->time_of_day / 1000.0;
+        b->callback(&b->fix, b->context);
+    }
+    memset(&b->fix, 0, sizeof(skytraq_fix));
+    b->sentences = 0;
+    b->time_of_day = -1;
+}
+
+/**
+  * A sentence for <time_of_day> arrived: the fix being collected is complete
+  * if it belongs to another second.
+  */
+static void start_epoch( fix_builder* b, int time_of_day ) {
+    if ( b->time_of_day != -1 && b->time_of_day != time_of_day )
+        publish(b);
+    b->time_of_day = time_of_day;
+}
+
+static void handle_sentence( const nmea_sentence* sentence, void* context ) {
+    fix_builder* b = context;
+    skytraq_fix* fix = &b->fix;
+
+    if ( sentence->type == NMEA_GSA ) {
+        /* no time of its own, it belongs to the second being collected */
+        if ( b->time_of_day != -1 && (sentence->fields & NMEA_HAS_DOP) ) {
+            fix->pdop = sentence->data.gsa.pdop;
+            fix->hdop = sentence->data.gsa.hdop;
+            fix->vdop = sentence->data.gsa.vdop;
+            fix->fields |= FIX_HAS_DOP;
+        }
+        return;
+    }
+    if ( (sentence->type != NMEA_GGA && sentence->type != NMEA_RMC) || !(sentence->fields & NMEA_HAS_TIME) )
+        return;
+    start_epoch(b, sentence->time_of_day);
+
+    if ( sentence->type == NMEA_GGA ) {
+        const nmea_gga* gga = &sentence->data.gga;
+
+        fix->quality = gga->quality;
+        fix->satellites = gga->satellites;
+        if ( sentence->fields & NMEA_HAS_POSITION ) {
+            fix->latitude = gga->latitude;
+            fix->longitude = gga->longitude;
+            fix->fields |= FIX_HAS_POSITION;
+        }
+        if ( sentence->fields & NMEA_HAS_ALTITUDE ) {
+            fix->altitude = gga->altitude;
+            fix->fields |= FIX_HAS_ALTITUDE;
+        }
+        b->sentences |= FIX_GGA;
+    } else {
+        const nmea_rmc* rmc = &sentence->data.rmc;
+
+        if ( sentence->fields & NMEA_HAS_POSITION ) {
+            fix->latitude = rmc->latitude;
+            fix->longitude = rmc->longitude;
+            fix->fields |= FIX_HAS_POSITION;
+        }
+        if ( sentence->fields & NMEA_HAS_VELOCITY ) {
+            fix->speed = rmc->speed * KNOTS;
+            fix->course = rmc->course;
+            fix->fields |= FIX_HAS_VELOCITY;
+        }
+        b->date = (sentence->fields & NMEA_HAS_DATE) ? rmc_date(rmc) : 0;
+        b->sentences |= FIX_RMC;
+    }
+
+    if ( b->sentences == (FIX_GGA | FIX_RMC) )
+        publish(b);
+}
+
+/**
+  * Take NMEA sentences out of the stream from the device and hand every
+  * complete fix to <callback>. Anything that is not a sentence with a valid
+  * checksum, e.g. binary packages in between, is skipped.
+  */
+void fix_builder_feed( fix_builder* b, const gbuint8* data, unsigned length, fix_callback callback, void* context ) {
+    b->callback = callback;
+    b->context = context;
+    nmea_parse(&b->parser, data, length, handle_sentence, b);
+}
+
+/**
+  * Hand the fix still being collected to <callback>, at the end of the
+  * input.
+  */
+void fix_builder_flush( fix_builder* b, fix_callback callback, void* context ) {
+    b->callback = callback;
+    b->context = context;
+    publish(b);
+}
+
+/**
+  * Fill <fix> from decoded navigation data (0xA8), the binary output of the
+  * receiver.
+  */
+void fix_from_navigation( const skytraq_navigation* n, skytraq_fix* fix ) {
+    double latitude, longitude, east, north;
+
+    memset(fix, 0, sizeof(skytraq_fix));
+    fix->binary = 1;
+    fix->quality = n->fix_mode;
+    fix->satellites = n->satellites;
+    fix->time = skytraq_gps_to_unix(n->week, n->time_of_week);
+    fix->fields = FIX_HAS_DATE;
+    if ( n->fix_mode == NAVIGATION_NO_FIX )
+        return;
+
+    fix->latitude = n->latitude;
+    fix->longitude = n->longitude;
+    fix->altitude = n->altitude;
+    fix->pdop = n->pdop;
+    fix->hdop = n->hdop;
+    fix->vdop = n->vdop;
+    fix->fields |= FIX_HAS_POSITION | FIX_HAS_ALTITUDE | FIX_HAS_DOP;
+
+    /* ECEF velocity to ground speed and course */
+    latitude = n->latitude * M_PI / 180;
+    longitude = n->longitude * M_PI / 180;
+    east = -sin(longitude) * n->vx + cos(longitude) * n->vy;
+    north = -sin(latitude) * cos(longitude) * n->vx - sin(latitude) * sin(longitude) * n->vy + cos(latitude) * n->vz;
+    fix->speed = sqrt(east * east + north * north) * 3.6;
+    fix->course = atan2(east, north) * 180 / M_PI;
+    if ( fix->course < 0 )
+        fix->course += 360;
+    fix->fields |= FIX_HAS_VELOCITY;
+}
+
+/**
+  * Write <fix> as one line of JSON. Fields the fix does not have are left
+  * out. Returns the length of the line.
+  */
+int fix_to_json( const skytraq_fix* fix, char* buffer, int size ) {
+    time_t seconds = (time_t)fix->time;
+    int ms = (int)((fix->time - seconds) * 1000 + 0.5);
+    struct tm tm;
+    int n;
+
+    if ( ms == 1000 ) {
+        seconds++;
+        ms = 0;
+    }
+    gmtime_r(&seconds, &tm);
+    n = snprintf(buffer, size, "{\"type\": \"fix\", \"source\": \"%s\", \"time\": \"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\", "
+                 "\"quality\": %d, \"satellites\": %d",
+                 fix->binary ? "binary" : "nmea", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                 tm.tm_hour, tm.tm_min, tm.tm_sec, ms, fix->quality, fix->satellites);
+    if ( n < size && (fix->fields & FIX_HAS_POSITION) )
+        n += snprintf(buffer + n, size - n, ", \"lat\": %.7f, \"lon\": %.7f", fix->latitude, fix->longitude);
+    if ( n < size && (fix->fields & FIX_HAS_ALTITUDE) )
+        n += snprintf(buffer + n, size - n, ", \"altitude\": %.2f", fix->altitude);
+    if ( n < size && (fix->fields & FIX_HAS_VELOCITY) )
+        n += snprintf(buffer + n, size - n, ", \"speed\": %.2f, \"course\": %.1f", fix->speed, fix->course);
+    if ( n < size && (fix->fields & FIX_HAS_DOP) )
+        n += snprintf(buffer + n, size - n, ", \"pdop\": %.2f, \"hdop\": %.2f, \"vdop\": %.2f",
+                      fix->pdop, fix->hdop, fix->vdop);
+    if ( n < size )
+        n += snprintf(buffer + n, size - n, "}\n");
+    return n < size ? n : size - 1;
+}
@@ -0,0 +1,75 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef live_fix_h
+#define live_fix_h
+
+#include "nmea.h"
+
+/* a position as the receiver reports it while running */
+typedef struct skytraq_fix {
+    double  time;           /* seconds since 1970, UTC, with fractions */
+    double  latitude;       /* degrees */
+    double  longitude;      /* degrees */
+    double  altitude;       /* meters above mean sea level */
+    double  speed;          /* km/h */
+    double  course;         /* degrees from north */
+    double  pdop, hdop, vdop;
+    int     satellites;     /* used in the fix */
+    int     quality;        /* 0 no fix, 1 GPS, 2 DGPS, ... as in GGA; 0-3 fix mode for binary */
+    int     fields;         /* FIX_HAS_* */
+    int     binary;         /* from a binary navigation message instead of NMEA */
+} skytraq_fix;
+
+#define FIX_HAS_POSITION    0x01
+#define FIX_HAS_ALTITUDE    0x02
+#define FIX_HAS_VELOCITY    0x04
+#define FIX_HAS_DATE        0x08
+#define FIX_HAS_DOP         0x10
+
+/*
+ * Collects the sentences of one second (GGA and RMC, GSA for the dilution of
+ * precision) into one fix. A fix is complete when both GGA and RMC have
+ * arrived, or when a sentence of the next second shows that one of them is
+ * missing.
+ */
+typedef void (*fix_callback)( const skytraq_fix* fix, void* context );
+
+typedef struct fix_builder {
+    nmea_parser parser;
+    skytraq_fix fix;
+    int         time_of_day;    /* ms of the collected sentences, -1 if none */
+    int         sentences;      /* FIX_GGA | FIX_RMC seen for time_of_day */
+    long        date;           /* start of the day from the last RMC, 0 if unknown */
+    fix_callback callback;      /* of the running fix_builder_feed() */
+    void*       context;
+} fix_builder;
+
+void fix_builder_init( fix_builder* b );
+void fix_builder_feed( fix_builder* b, const gbuint8* data, unsigned length, fix_callback callback, void* context );
+void fix_builder_flush( fix_builder* b, fix_callback callback, void* context );
+struct skytraq_navigation;
+
+void fix_from_navigation( const struct skytraq_navigation* navigation, skytraq_fix* fix );
+int fix_to_json( const skytraq_fix* fix, char* buffer, int size );
+
+#endif
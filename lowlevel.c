@@ -19,78 +19,327 @@
     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
 
  */
+#define _GNU_SOURCE /* memmem() */
 #include "datalogger.h"
+#include "lowlevel.h"
+#include "trace.h"
 #include <sys/time.h>
 #include <errno.h>
+#include <poll.h>
 
 #define SKYTRAQ_RESPONSE_ACK                     0x83
 #define SKYTRAQ_RESPONSE_NACK                    0x84
 
 #define TIMEOUT  1000l
 
-typedef struct timeval hp_time;
+typedef struct timespec hp_time;
 
-static double elapsed(hp_time *tv) {
+/**
+  * Compute the point in time <timeout> milliseconds from now. A monotonic
+  * clock is used so that changing the system time does not affect timeouts.
+  */
+static void deadline_set(hp_time *deadline, unsigned timeout) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec  += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000l;
+    if ( deadline->tv_nsec >= 1000000000l ) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000l;
+    }
+}
+
+/**
+  * Milliseconds left until the deadline is reached (rounded up), 0 if the
+  * deadline has passed.
+  */
+static int deadline_left(const hp_time *deadline) {
     hp_time now;
-    double ot = (double) tv->tv_sec  * 1000 +
-                (double) tv->tv_usec / 1000;
-    double nt;
-    gettimeofday(&now, NULL);
-    nt = (double) now.tv_sec  * 1000 +
-         (double) now.tv_usec / 1000;
+    long long ns;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (long long)(deadline->tv_sec - now.tv_sec) * 1000000000ll +
+         (deadline->tv_nsec - now.tv_nsec);
+    if ( ns <= 0 )
+        return 0;
+    return (int)((ns + 999999) / 1000000);
+}
+
+/**
+  * Seconds on the monotonic clock, for measuring durations.
+  */
+double monotonic_time( void ) {
+    hp_time now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+  * Sleep until the file descriptor becomes readable or the timeout (in ms)
+  * expires. Returns 1 if data is available, 0 otherwise.
+  */
+static int wait_for_input(int fd, int timeout) {
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while ( ret < 0 && errno == EINTR );
+
+    return ret > 0;
+}
+
+static skytraq_io_stats io_stats;
+
+/*
+ * Every serial port gets a receive ring buffer. Data is pulled from the
+ * device in bulk and handed out from here, so a caller asking for a single
+ * byte does not cost a system call each time.
+ */
+#define RX_BUFFER_SIZE 8192 /* must be a power of two */
+#define RX_BUFFER_MASK (RX_BUFFER_SIZE-1)
+
+typedef struct rx_buffer {
+    gbuint8  data[RX_BUFFER_SIZE];
+    unsigned head; /* next position to write, free-running */
+    unsigned tail; /* next position to read, free-running */
+} rx_buffer;
+
+static rx_buffer** rx_buffers = NULL;
+static int rx_buffers_count = 0;
+
+static rx_buffer* get_rx_buffer(int fd) {
+    if ( fd >= rx_buffers_count ) {
+        int count = fd + 1;
+        rx_buffers = realloc(rx_buffers, count * sizeof(rx_buffer*));
+        memset(rx_buffers + rx_buffers_count, 0, (count - rx_buffers_count) * sizeof(rx_buffer*));
+        rx_buffers_count = count;
+    }
+    if ( rx_buffers[fd] == NULL ) {
+        rx_buffers[fd] = calloc(1, sizeof(rx_buffer));
+    }
+    return rx_buffers[fd];
+}
+
+static unsigned rx_available(const rx_buffer* rx) {
+    return rx->head - rx->tail;
+}
+
+/**
+  * Returns a pointer to the oldest buffered bytes and the number of bytes
+  * that can be accessed there without wrapping around.
+  */
+static unsigned rx_peek(const rx_buffer* rx, const gbuint8** data) {
+    unsigned offset = rx->tail & RX_BUFFER_MASK;
+    unsigned len = rx_available(rx);
+    *data = rx->data + offset;
+    if ( len > RX_BUFFER_SIZE - offset )
+        len = RX_BUFFER_SIZE - offset;
+    return len;
+}
 
-    return nt - ot;
+static void rx_consume(rx_buffer* rx, unsigned len) {
+    rx->tail += len;
+}
+
+/**
+  * Copy up to <len> buffered bytes to <buffer>. Returns the number of bytes copied.
+  */
+static unsigned rx_take(rx_buffer* rx, gbuint8* buffer, unsigned len) {
+    unsigned copied = 0;
+    while ( copied < len && rx_available(rx) > 0 ) {
+        const gbuint8* data;
+        unsigned n = rx_peek(rx, &data);
+        if ( n > len - copied )
+            n = len - copied;
+        memcpy(buffer + copied, data, n);
+        rx_consume(rx, n);
+        copied += n;
+    }
+    return copied;
+}
+
+/**
+  * Wait up to <timeout> ms for data and read as much as fits into the
+  * receive buffer. Returns the number of bytes read, 0 on timeout and
+  * ERROR on hangup or read errors.
+  */
+static int rx_fill(int fd, rx_buffer* rx, int timeout) {
+    unsigned offset = rx->head & RX_BUFFER_MASK;
+    unsigned space = RX_BUFFER_SIZE - rx_available(rx);
+    int bytesRead;
+
+    if ( space > RX_BUFFER_SIZE - offset )
+        space = RX_BUFFER_SIZE - offset;
+    if ( space == 0 )
+        return 0;
+
+    if ( !wait_for_input(fd, timeout) )
+        return 0;
+
+    bytesRead = read(fd, rx->data + offset, space);
+    io_stats.read_calls++;
+    if ( bytesRead == 0 )
+        return ERROR; /* hangup */
+    if ( bytesRead < 0 )
+        return ( errno == EAGAIN || errno == EINTR ) ? 0 : ERROR;
+
+    io_stats.bytes_read += bytesRead;
+    trace_data(TRACE_RX, fd, rx->data + offset, bytesRead);
+    rx->head += bytesRead;
+    return bytesRead;
 }
 
 int read_with_timeout( int fd, void* buffer, unsigned len, unsigned timeout) {
-    hp_time start;
+    rx_buffer* rx = get_rx_buffer(fd);
+    hp_time deadline;
     int offset = 0;
+    int left;
 
-    gettimeofday(&start,NULL);
+    deadline_set(&deadline, timeout);
 
-    while (len > 0 && elapsed(&start) < timeout ) {
-        int bytesRead = read(fd,buffer+offset,len);
-        if ( bytesRead < 0 )
-            bytesRead = 0;
-        len = len - bytesRead;
-        offset = offset + bytesRead;
-
-        /* printf("bytes left: %d  time elapsed: %f\n", len, elapsed(&start)
-        );*/
+    for (;;) {
+        unsigned n = rx_take(rx, (gbuint8*)buffer + offset, len);
+        offset += n;
+        len -= n;
+        if ( len == 0 )
+            break;
 
+        left = deadline_left(&deadline);
+        if ( left == 0 || rx_fill(fd, rx, left) < 0 )
+            break;
     }
 
-#ifdef DEBUG_ALL
-    if (len >0 )
+    if ( len > 0 ) {
+        io_stats.read_timeouts++;
+        trace_event(TRACE_TIMEOUT, fd, timeout, len);
         DEBUG("timeout hit\n");
-#endif
+    }
 
     return offset;
 }
 
+/**
+  * Read what has arrived without waiting, for callers that poll() several
+  * ports themselves. Returns the number of bytes, 0 if nothing was there and
+  * ERROR on hangup or read errors.
+  */
+int read_available( int fd, void* buffer, unsigned len ) {
+    rx_buffer* rx = get_rx_buffer(fd);
+    unsigned n = rx_take(rx, buffer, len);
 
-gbuint8 readByte( int fd) {
-    gbuint8 c;
-    read_with_timeout( fd, &c, 1,TIMEOUT);
-    return c;
+    if ( n > 0 )
+        return n;
+    if ( rx_fill(fd, rx, 0) < 0 )
+        return ERROR;
+    return rx_take(rx, buffer, len);
 }
 
-unsigned int readInteger( int fd ) {
-    gbuint8 high, low;
+/**
+  * Read from the GPS device until <delimiter> has been received. At most
+  * <max_length> bytes (including the delimiter) are stored in <buffer>;
+  * anything following the delimiter stays in the receive buffer. <timeout>
+  * limits how long to wait for the next chunk of data, not the whole transfer.
+  * Returns the number of bytes in front of the delimiter or -1 if it was not found.
+  */
+int read_until( int fd, gbuint8* buffer, int max_length, const gbuint8* delimiter, int delimiter_length, unsigned timeout ) {
+    rx_buffer* rx = get_rx_buffer(fd);
+    int length = 0;
+
+    while ( length < max_length ) {
+        const gbuint8* data;
+        gbuint8* found;
+        unsigned n;
+        int search_from;
+
+        if ( rx_available(rx) == 0 && rx_fill(fd, rx, timeout) <= 0 ) {
+            DEBUG("read_until: timeout\n");
+            io_stats.read_timeouts++;
+            trace_event(TRACE_TIMEOUT, fd, timeout, 0);
+            break;
+        }
+
+        n = rx_peek(rx, &data);
+        if ( n > max_length - length )
+            n = max_length - length;
+        memcpy(buffer + length, data, n);
+
+        /* the delimiter may start in the previous chunk */
+        search_from = length - (delimiter_length - 1);
+        if ( search_from < 0 )
+            search_from = 0;
+        found = memmem(buffer + search_from, length + n - search_from, delimiter, delimiter_length);
+        if ( found != NULL ) {
+            int end = (found - buffer) + delimiter_length;
+            rx_consume(rx, end - length);
+            return found - buffer;
+        }
 
-    high = readByte(fd);
-    low  = readByte(fd);
+        rx_consume(rx, n);
+        length += n;
+    }
 
-    return (high << 8) + low;
+    return -1;
 }
 
-gbuint8 calculate_skytraq_checksum( SkyTraqPackage* p ) {
-    int i;
-    gbuint8 cs = 0;
-    for ( i = 0; i< p->length; i++ ) {
-        cs = cs ^ p->data[i];
+/**
+  * Discard all received but not yet consumed data.
+  */
+void flush_input( int fd ) {
+    rx_buffer* rx = get_rx_buffer(fd);
+    trace_event(TRACE_FLUSH, fd, rx_available(rx), 0);
+    rx->tail = rx->head;
+    tcflush(fd, TCIFLUSH);
+}
+
+/**
+  * Release the receive buffer and close the serial port.
+  */
+void close_port( int fd ) {
+    if ( fd >= 0 && fd < rx_buffers_count ) {
+        free(rx_buffers[fd]);
+        rx_buffers[fd] = NULL;
     }
-    return cs ;
+    close(fd);
+}
+
+const skytraq_io_stats* skytraq_get_io_stats( void ) {
+    return &io_stats;
+}
+
+/**
+  * XOR of all bytes. The bulk of the data is folded a machine word at a
+  * time with four independent accumulators, which compilers turn into
+  * SIMD instructions.
+  */
+gbuint8 skytraq_xor_checksum( const gbuint8* data, unsigned len ) {
+    unsigned long long acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    unsigned i = 0;
+    gbuint8 cs;
+
+    for ( ; i + 32 <= len; i += 32 ) {
+        unsigned long long w[4];
+        memcpy(w, data + i, sizeof(w));
+        acc0 ^= w[0];
+        acc1 ^= w[1];
+        acc2 ^= w[2];
+        acc3 ^= w[3];
+    }
+    acc0 ^= acc1 ^ acc2 ^ acc3;
+    acc0 ^= acc0 >> 32;
+    acc0 ^= acc0 >> 16;
+    acc0 ^= acc0 >> 8;
+    cs = acc0 & 0xff;
+
+    for ( ; i < len; i++ ) {
+        cs = cs ^ data[i];
+    }
+    return cs;
+}
+
+gbuint8 calculate_skytraq_checksum( SkyTraqPackage* p ) {
+    return skytraq_xor_checksum(p->data, p->length);
 }
 
 int check_skytraq_checksum( SkyTraqPackage* p ) {
@@ -135,6 +384,9 @@ int write_large_buffer( int fd, gbuint8* buf, int len) {
         gbuint8* data = buf + sum_written;
 
         written= write(fd, data, len);
+        io_stats.write_calls++;
+        if ( written > 0 )
+            trace_data(TRACE_TX, fd, data, written);
 
         if ( written < 0 ) {
             if ( errno == EAGAIN ) {
@@ -149,6 +401,7 @@ int write_large_buffer( int fd, gbuint8* buf, int len) {
             }
         }
         len -= written;
+        io_stats.bytes_written += written;
 
         DEBUG(" (%d byte written) ", written);
         sum_written += written;
@@ -161,90 +414,234 @@ int write_large_buffer( int fd, gbuint8* buf, int len) {
 }
 
 int write_buffer(int fd, gbuint8* buf, int len) {
+    int written;
 
     if ( len > 20 ) {
         return write_large_buffer(fd,buf,len);
     }
 
-    return write(fd, buf, len);
+    written = write(fd, buf, len);
+    io_stats.write_calls++;
+    if ( written > 0 ) {
+        io_stats.bytes_written += written;
+        trace_data(TRACE_TX, fd, buf, written);
+    }
+    return written;
 }
 
-void write_skytraq_package( int fd, SkyTraqPackage* p ) {
-
-    gbuint8* data = malloc( 7 + p->length );
+/**
+  * Put <length> bytes of <payload> into <frame> the way they go over the wire:
+  * start sequence, length, payload, XOR checksum and CR LF. <frame> must hold
+  * <length> + SKYTRAQ_FRAME_OVERHEAD bytes. Returns the length of the frame.
+  */
+int skytraq_frame_package( gbuint8* frame, const gbuint8* payload, unsigned length ) {
+    frame[0] = 0xa0;
+    frame[1] = 0xa1;
+    frame[2] = (length >> 8) & 0xff;
+    frame[3] = length & 0xff;
+    memcpy(frame + 4, payload, length);
+    frame[4 + length] = skytraq_xor_checksum(payload, length);
+    frame[5 + length] = 0x0d;
+    frame[6 + length] = 0x0a;
+    return length + SKYTRAQ_FRAME_OVERHEAD;
+}
 
-    int i;
+void write_skytraq_package( int fd, SkyTraqPackage* p ) {
 
-    data[0] = 0xa0;
-    data[1] = 0xa1;
-    data[2] =  (p->length>>8)&0xff;
-    data[3] =  p->length & 0xff;
-    for ( i = 0; i < p->length; i++) {
-        data[4+i] =  p->data[i];
-    }
-    data[4+p->length] =  calculate_skytraq_checksum(p);
-    data[5+p->length] =  0x0d;
-    data[6+p->length] =  0x0a;
+    gbuint8* data = malloc( SKYTRAQ_FRAME_OVERHEAD + p->length );
+    int length = skytraq_frame_package(data, p->data, p->length);
 
     DEBUG(">>> ");
-    write_buffer(fd,data,7 + p->length);
+    write_buffer(fd,data,length);
     DEBUG("\n");
 
     free(data);
 }
 
+enum { FRAMER_SYNC1, FRAMER_SYNC2, FRAMER_LENGTH_HIGH, FRAMER_LENGTH_LOW,
+       FRAMER_PAYLOAD, FRAMER_CHECKSUM, FRAMER_END1, FRAMER_END2
+     };
+
+void skytraq_framer_init( skytraq_framer* f ) {
+    f->state = FRAMER_SYNC1;
+    f->length = 0;
+    f->received = 0;
+}
+
+/**
+  * Feed received bytes into the framer. Stops after the first complete package,
+  * <consumed> is set to the number of bytes used; the rest has to be fed again.
+  * Returns a package with a valid checksum or NULL if more data is needed. You
+  * have to call skytraq_free_package() on the result.
+  */
+SkyTraqPackage* skytraq_framer_feed( skytraq_framer* f, const gbuint8* buf, unsigned len, unsigned* consumed ) {
+    unsigned i = 0;
+
+    while ( i < len ) {
+        gbuint8 c = buf[i];
+
+        switch ( f->state ) {
+        case FRAMER_SYNC1: {
+            /* skip NMEA output and other noise */
+            const gbuint8* sync = memchr(buf + i, 0xa0, len - i);
+            if ( sync == NULL ) {
+                i = len;
+                continue;
+            }
+            i = sync - buf;
+            f->state = FRAMER_SYNC2;
+            break;
+        }
+        case FRAMER_SYNC2:
+            if ( c == 0xa1 ) {
+                f->state = FRAMER_LENGTH_HIGH;
+            } else if ( c != 0xa0 ) {
+                f->state = FRAMER_SYNC1;
+            }
+            break;
+        case FRAMER_LENGTH_HIGH:
+            f->length = c << 8;
+            f->state = FRAMER_LENGTH_LOW;
+            break;
+        case FRAMER_LENGTH_LOW:
+            f->length += c;
+            f->received = 0;
+            if ( f->length == 0 || f->length > SKYTRAQ_MAX_PAYLOAD ) {
+                io_stats.framing_errors++;
+                f->state = FRAMER_SYNC1;
+            } else {
+                f->state = FRAMER_PAYLOAD;
+            }
+            break;
+        case FRAMER_PAYLOAD: {
+            unsigned n = f->length - f->received;
+            if ( n > len - i )
+                n = len - i;
+            memcpy(f->data + f->received, buf + i, n);
+            f->received += n;
+            i += n;
+            if ( f->received == f->length )
+                f->state = FRAMER_CHECKSUM;
+            continue;
+        }
+        case FRAMER_CHECKSUM:
+            f->checksum = c;
+            f->state = FRAMER_END1;
+            break;
+        case FRAMER_END1:
+            if ( c == 0x0d ) {
+                f->state = FRAMER_END2;
+            } else {
+                io_stats.framing_errors++;
+                f->state = FRAMER_SYNC1;
+            }
+            break;
+        case FRAMER_END2:
+            f->state = FRAMER_SYNC1;
+            if ( c == 0x0a ) {
+                SkyTraqPackage* pkg = skytraq_new_package(f->length);
+                memcpy(pkg->data, f->data, f->length);
+                pkg->checksum = f->checksum;
+                if ( check_skytraq_checksum(pkg) ) {
+                    /* a valid package */
+                    io_stats.packages++;
+                    *consumed = i + 1;
+                    return pkg;
+                }
+                skytraq_free_package(pkg);
+            }
+            io_stats.framing_errors++;
+            break;
+        }
+        i++;
+    }
+
+    *consumed = len;
+    return NULL;
+}
+
 /**
   * Read the next SkyTraq binary package from the input stream. This function does
   * not return before a package has been read. You have to call skytraq_free_package() on
   * the result.
   */
 SkyTraqPackage* skytraq_read_next_package( int fd, unsigned timeout ) {
-    int len;
-    gbuint8 c, lastByte;
-    hp_time start;
+    rx_buffer* rx = get_rx_buffer(fd);
+    skytraq_framer framer;
+    SkyTraqPackage* pkg = NULL;
+    hp_time deadline, start, end;
+    unsigned long read_calls = io_stats.read_calls;
+    int left;
 
     DEBUG("skytraq_read_next_package\n");
-    gettimeofday(&start,NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline_set(&deadline, timeout);
+    skytraq_framer_init(&framer);
+
+    while ( pkg == NULL ) {
+        while ( pkg == NULL && rx_available(rx) > 0 ) {
+            const gbuint8* data;
+            unsigned len, consumed;
+
+            len = rx_peek(rx, &data);
+            pkg = skytraq_framer_feed(&framer, data, len, &consumed);
+            rx_consume(rx, consumed);
+        }
 
-    len = read_with_timeout( fd, &c, 1, timeout);
-    while ( len > 0 && elapsed(&start) < timeout ) {
-        if ( (lastByte == 0xa0) && (c == 0xa1)) {
-            SkyTraqPackage* pkg;
-            int dataRead;
-            gbuint8 end1, end2;
-
-            pkg = malloc( sizeof(SkyTraqPackage));
-            pkg->length = readInteger(fd);
-            pkg->data = malloc(pkg->length);
-            dataRead = 0;
-            while ( dataRead < pkg->length) {
-                dataRead += read_with_timeout(fd,pkg->data+dataRead,(pkg->length-dataRead),TIMEOUT);
-            }
+        if ( pkg == NULL ) {
+            left = deadline_left(&deadline);
+            if ( left == 0 || rx_fill(fd, rx, left) < 0 )
+                break;
+        }
+    }
 
-            pkg->checksum = readByte(fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if ( pkg == NULL ) {
+        io_stats.read_timeouts++;
+        trace_event(TRACE_TIMEOUT, fd, timeout, 0);
+    } else {
+        trace_data(TRACE_PACKAGE, fd, pkg->data, pkg->length);
+    }
+    io_stats.framer_read_calls += io_stats.read_calls - read_calls;
+    io_stats.framer_time += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
-            end1 = readByte(fd);
-            end2 = readByte(fd);
+    return pkg;
+}
 
-            if ( end1 == 0x0d && end2 == 0x0a ) {
-                /* a valid package */
-                if ( check_skytraq_checksum(pkg) ) {
-                    return pkg;
-                }
-            }
-        }
 
-        lastByte = c;
-        len = read_with_timeout( fd, &c, 1, timeout);
+/**
+  * Count a command sent at <sent> and its <answer> (ACK, NACK or ERROR if
+  * none arrived) in the I/O statistics and the trace. Callers that wait for
+  * the ACK themselves use this to keep the counters complete.
+  */
+void skytraq_count_command( int fd, gbuint8 message_id, int answer, double sent ) {
+    double ms = (monotonic_time() - sent) * 1000;
+    int bucket = 0;
+
+    io_stats.commands++;
+    io_stats.ack_time += ms / 1000;
+    if ( answer == ERROR ) {
+        io_stats.unanswered++;
+        trace_error(fd, "no answer to message 0x%02x", message_id);
+        return;
     }
 
-    return NULL;
-}
+    if ( answer == ACK )
+        io_stats.acks++;
+    else
+        io_stats.nacks++;
+    trace_event(answer == ACK ? TRACE_ACK : TRACE_NACK, fd, message_id, ms * 1000);
 
+    while ( bucket < SKYTRAQ_ACK_BUCKETS - 1 && ms >= (1 << bucket) )
+        bucket++;
+    io_stats.ack_round_trip[bucket]++;
+}
 
 int skytraq_write_package_with_response( int fd, SkyTraqPackage* p, unsigned timeout ) {
     int retries_left = 3;
     gbuint8 request_message_id;
+    double sent = monotonic_time();
+    int result = ERROR;
 
     request_message_id = p->data[0];
     write_skytraq_package(fd,p);
@@ -262,24 +659,27 @@ int skytraq_write_package_with_response( int fd, SkyTraqPackage* p, unsigned tim
                 DEBUG("got ACK for msg id: 0x%02x\n", response->data[1] );
                 if ( response->data[1] == request_message_id ) {
                     skytraq_free_package(response);
-                    return ACK;
-
+                    result = ACK;
+                    break;
                 }
             } else if ( response->data[0] == SKYTRAQ_RESPONSE_NACK ) {
                 /* NACK - Is it a response to my request? */
                 DEBUG("got NACK\n");
                 if ( response->data[1] == request_message_id ) {
                     skytraq_free_package(response);
-                    return NACK;
+                    result = NACK;
+                    break;
                 }
             }
             skytraq_free_package(response);
+            io_stats.skipped_answers++;
         }
 
         retries_left--;
     }
 
-    return ERROR;
+    skytraq_count_command(fd, request_message_id, result, sent);
+    return result;
 }
 
 int raw(int fd) {
@@ -314,7 +714,7 @@ SkyTraqPackage* skytraq_new_package( int length ) {
 }
 
 
-int open_port( char* device) {
+int open_port( const char* device) {
     int    fd = open(device,O_RDWR | O_NONBLOCK );
     raw(fd);
     return fd;
@@ -348,11 +748,20 @@ int set_port_speed( int fd,  unsigned speed) {
     speed_t s;
 
     s =  mkspeed(speed);
+    if ( s == (speed_t)ERROR )
+        return ERROR;
     if ((tcgetattr(fd, &io)) == ERROR)
         return ERROR;
-    cfsetospeed(&io, s);
-    cfsetispeed(&io, s);
-    return tcsetattr(fd, TCSADRAIN, &io) ? ERROR : SUCCESS;
+    if ( cfsetospeed(&io, s) || cfsetispeed(&io, s) )
+        return ERROR;
+    if ( tcsetattr(fd, TCSADRAIN, &io) )
+        return ERROR;
+
+    /* tcsetattr() succeeds if any of the changes could be made */
+    if ( tcgetattr(fd, &io) == ERROR || cfgetospeed(&io) != s )
+        return ERROR;
+    trace_event(TRACE_SPEED, fd, speed, 0);
+    return SUCCESS;
 }
 
 /**
@@ -361,11 +770,11 @@ int set_port_speed( int fd,  unsigned speed) {
 int read_string( int fd, gbuint8* buffer, int max_length, unsigned timeout ) {
     int len, bytes_read = 0;
     gbuint8 c;
-    hp_time start;
-    gettimeofday(&start,NULL);
+    hp_time deadline;
+    deadline_set(&deadline, timeout);
 
     len = read_with_timeout( fd, &c, 1, timeout);
-    while ( len > 0 && elapsed(&start) < timeout ) {
+    while ( len > 0 && deadline_left(&deadline) > 0 ) {
         buffer[bytes_read] = c;
 
         if ( c == 0 ) {
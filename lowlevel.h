@@ -23,14 +23,65 @@
 #ifndef lowlevel_h
 #define lowlevel_h
 
+/* largest payload that fits into a SkyTraqPackage */
+#define SKYTRAQ_MAX_PAYLOAD 255
+
+/* start sequence, length, checksum and CR LF around a payload */
+#define SKYTRAQ_FRAME_OVERHEAD 7
+
+/**
+  * Incremental parser for SkyTraq binary packages:
+  * 0xA0 0xA1 <length:2> <payload> <checksum> 0x0D 0x0A
+  */
+typedef struct skytraq_framer {
+    int         state;
+    unsigned    length;
+    unsigned    received;
+    gbuint8     checksum;
+    gbuint8     data[SKYTRAQ_MAX_PAYLOAD];
+} skytraq_framer;
+
+/* ACK round trips are counted in buckets of < 1, 2, 4, ... 1024 ms and more */
+#define SKYTRAQ_ACK_BUCKETS 12
+
+typedef struct skytraq_io_stats {
+    unsigned long   read_calls;         /* read() system calls on serial ports */
+    unsigned long   bytes_read;
+    unsigned long   read_timeouts;      /* reads that ended before the data was complete */
+    unsigned long   write_calls;        /* write() system calls on serial ports */
+    unsigned long   bytes_written;
+    unsigned long   packages;           /* valid packages found by the framer */
+    unsigned long   framing_errors;     /* dropped frames: bad length, checksum or trailer */
+    unsigned long   framer_read_calls;  /* read() calls made while waiting for a package */
+    double          framer_time;        /* seconds spent in skytraq_read_next_package() */
+    unsigned long   commands;           /* packages sent expecting an ACK */
+    unsigned long   acks;
+    unsigned long   nacks;
+    unsigned long   unanswered;         /* neither ACK nor NACK arrived */
+    unsigned long   skipped_answers;    /* other packages read while waiting for the ACK */
+    unsigned long   ack_round_trip[SKYTRAQ_ACK_BUCKETS];
+    double          ack_time;           /* seconds spent waiting for ACKs */
+} skytraq_io_stats;
+
 void skytraq_dump_package( SkyTraqPackage* p ) ;
 void skytraq_free_package( SkyTraqPackage* p );
 SkyTraqPackage* skytraq_new_package( int length );
 SkyTraqPackage* skytraq_read_next_package( int fd, unsigned timeout );
 int skytraq_write_package_with_response( int fd, SkyTraqPackage* p, unsigned timeout );
-int open_port( char* device);
+void skytraq_count_command( int fd, gbuint8 message_id, int answer, double sent );
+void skytraq_framer_init( skytraq_framer* f );
+SkyTraqPackage* skytraq_framer_feed( skytraq_framer* f, const gbuint8* buf, unsigned len, unsigned* consumed );
+const skytraq_io_stats* skytraq_get_io_stats( void );
+int open_port( const char* device);
+void close_port( int fd );
 int set_port_speed( int fd, unsigned speed);
 int read_with_timeout( int fd, void* buffer, unsigned len, unsigned timeout);
+int read_available( int fd, void* buffer, unsigned len );
+void flush_input( int fd );
+double monotonic_time( void );
+int read_until( int fd, gbuint8* buffer, int max_length, const gbuint8* delimiter, int delimiter_length, unsigned timeout );
+gbuint8 skytraq_xor_checksum( const gbuint8* data, unsigned len );
+int skytraq_frame_package( gbuint8* frame, const gbuint8* payload, unsigned length );
 
 int write_buffer(int fd, gbuint8* buf, int len);
 
@@ -22,22 +22,86 @@
 
 #include "datalogger.h"
 #include "lowlevel.h"
+#include "dump.h"
+#include "sector-cache.h"
+#include "stats.h"
+#include "trace.h"
+#include "multi-dump.h"
+#include "daemon.h"
+#include <signal.h>
+#include <errno.h>
 
 enum { NO_ACTION, ACTION_INFO, ACTION_DELETE, ACTION_DUMP, ACTION_CONFIG,
        ACTION_SET_SPEED, ACTION_OUTPUT_OFF, ACTION_OUTPUT_NMEA, ACTION_OUTPUT_BINARY,
-       ACTION_AGPS_UPDATE
+       ACTION_AGPS_UPDATE, ACTION_DUMP_RAW, ACTION_DECODE, ACTION_PRINT_TRACE,
+       ACTION_DUMP_DEVICES, ACTION_DAEMON, ACTION_DECODE_NMEA
      };
 
-enum { RETURN_OK, RETURN_ERROR, RETURN_ERROR_OPTIONS, RETURN_ERROR_AGPS_DOWNLOAD_FAILED
+enum { RETURN_OK, RETURN_ERROR, RETURN_ERROR_OPTIONS, RETURN_ERROR_AGPS_DOWNLOAD_FAILED,
+       RETURN_ERROR_IMAGE
      };
 
-#define verbose(fmt, args...) fprintf(stderr, fmt"\n", ##args)
+enum { STATS_NONE, STATS_TEXT, STATS_JSON };
+
+static const char* action_names[] = { "none", "info", "delete", "dump", "config", "set-speed",
+                                      "output-off", "output-nmea", "output-binary", "agps-update",
+                                      "dump-raw", "decode", "print-trace", "dump-devices", "daemon",
+                                      "decode-nmea" };
+
+/* --trace and --trace-on-error */
+static const char* trace_file = NULL;
+static int trace_always = 0;
+
+static void print_stats( int format, const run_stats* stats ) {
+    if ( format == STATS_JSON )
+        stats_print_json(stderr, stats);
+    else if ( format == STATS_TEXT )
+        stats_print_text(stderr, stats);
+}
+
+/* SIGUSR1 can arrive between a failing call and the check of its errno */
+static void save_trace_on_signal( int sig ) {
+    int saved_errno = errno;
+
+    trace_save(trace_file);
+    errno = saved_errno;
+}
+
+/**
+  * Save the trace if it was asked for, or if something went wrong with
+  * --trace-on-error. Returns <code>.
+  */
+static int finish( int code ) {
+    if ( trace_file == NULL || !(trace_always || code != RETURN_OK || trace_error_count() > 0) )
+        return code;
+
+    if ( trace_save(trace_file) != SUCCESS )
+        fprintf(stderr, "Cannot write trace %s\n", trace_file);
+    else if ( !trace_always )
+        fprintf(stderr, "Trace of the serial line written to %s\n", trace_file);
+    return code;
+}
 
 int main(int argc, char *argv[])  {
     int fd, i, baud_rate = 0, action=NO_ACTION, serial_speed=0;
     int min_time=-1, max_time=-1, min_dist=-1, max_dist=-1, min_speed=-1, max_speed=-1, enable=0, disable=0;
     int mode_fifo = 0, mode_stop = 0;
     int permanent = 0;
+    int show_stats = STATS_NONE;
+    run_stats stats;
+    skytraq_dump_report report;
+    double phase_start = monotonic_time();
+    skytraq_dump_options dump_options = { PACING_ADAPTIVE, 1, NULL, NULL, NULL, NULL, OUTPUT_DEFAULT_PRECISION, 0, LONG_MIN, LONG_MAX };
+    char* format = NULL;
+    char* cache_dir = NULL;
+    char* image_file = NULL;
+    int pacing_given = 0;
+    char* trace_input = NULL;
+    char* device_list = NULL;
+    char* output_dir = ".";
+    char* socket_path = NULL;
+    char* shm_name = NULL;
+    int threads = 0;
     int success;
     char* device = "/dev/ttyUSB0";
 
@@ -48,6 +112,17 @@ int main(int argc, char *argv[])  {
             action = ACTION_DELETE;
         } else if ( !strcmp(argv[i], "--dump" ) ) {
             action = ACTION_DUMP;
+        } else if ( !strcmp(argv[i], "--dump-raw" ) ) {
+            action = ACTION_DUMP_RAW;
+            if ( argc>i+1) image_file = argv[++i];
+        } else if ( !strcmp(argv[i], "--decode" ) ) {
+            action = ACTION_DECODE;
+            if ( argc>i+1) image_file = argv[++i];
+        } else if ( !strcmp(argv[i], "--decode-nmea" ) ) {
+            action = ACTION_DECODE_NMEA;
+            if ( argc>i+1) image_file = argv[++i];
+        } else if ( !strcmp(argv[i], "--threads" ) ) {
+            if ( argc>i+1) threads = atoi(argv[++i]);
         } else if ( !strcmp(argv[i], "--set-config" ) ) {
             action = ACTION_CONFIG;
         } else if ( !strcmp(argv[i], "--set-baud-rate" ) ) {
@@ -87,15 +162,94 @@ int main(int argc, char *argv[])  {
             action = ACTION_OUTPUT_BINARY;
         } else if ( !strcmp(argv[i], "--baud-rate" ) ) {
             if ( argc>i+1) baud_rate = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "--pacing" ) ) {
+            pacing_given = 1;
+            if ( argc>i+1) dump_options.pacing = skytraq_parse_pacing(argv[++i]);
+            if ( dump_options.pacing == ERROR ) {
+                fprintf(stderr, "unknown pacing strategy %s\n", argv[i]);
+                return RETURN_ERROR_OPTIONS;
+            }
+        } else if ( !strcmp(argv[i], "--cache" ) ) {
+            if ( cache_dir == NULL ) cache_dir = sector_cache_default_dir();
+            dump_options.cache_dir = cache_dir;
+        } else if ( !strcmp(argv[i], "--cache-dir" ) ) {
+            if ( argc>i+1) dump_options.cache_dir = argv[++i];
+        } else if ( !strcmp(argv[i], "--cache-id" ) ) {
+            if ( argc>i+1) dump_options.cache_id = argv[++i];
+        } else if ( !strcmp(argv[i], "--no-upshift" ) ) {
+            dump_options.upshift = 0;
+        } else if ( !strcmp(argv[i], "--format" ) ) {
+            if ( argc>i+1) format = argv[++i];
+        } else if ( !strcmp(argv[i], "--precision" ) ) {
+            if ( argc>i+1) dump_options.precision = atoi(argv[++i]);
+            if ( dump_options.precision < 0 || dump_options.precision > OUTPUT_MAX_PRECISION ) {
+                fprintf(stderr, "precision must be between 0 and %d\n", OUTPUT_MAX_PRECISION);
+                return RETURN_ERROR_OPTIONS;
+            }
+        } else if ( !strcmp(argv[i], "--fast-geo" ) ) {
+            dump_options.fast_geo = 1;
+        } else if ( !strcmp(argv[i], "--from" ) || !strcmp(argv[i], "--to" ) ) {
+            int to = !strcmp(argv[i], "--to");
+            long t;
+            if ( argc<=i+1 || skytraq_parse_time(argv[++i], to, &t) != SUCCESS ) {
+                fprintf(stderr, "%s needs a time like 2008-10-16, 2008-10-16T12:00:00 or seconds since 1970\n", to ? "--to" : "--from");
+                return RETURN_ERROR_OPTIONS;
+            }
+            if ( to )
+                dump_options.to = t;
+            else
+                dump_options.from = t;
+        } else if ( !strcmp(argv[i], "--stats" ) ) {
+            show_stats = STATS_TEXT;
+        } else if ( !strcmp(argv[i], "--stats-json" ) ) {
+            show_stats = STATS_JSON;
+        } else if ( !strcmp(argv[i], "--trace" ) || !strcmp(argv[i], "--trace-on-error" ) ) {
+            trace_always = !strcmp(argv[i], "--trace");
+            if ( argc>i+1) trace_file = argv[++i];
+        } else if ( !strcmp(argv[i], "--devices" ) ) {
+            action = ACTION_DUMP_DEVICES;
+            if ( argc>i+1) device_list = argv[++i];
+        } else if ( !strcmp(argv[i], "--output-dir" ) ) {
+            if ( argc>i+1) output_dir = argv[++i];
+        } else if ( !strcmp(argv[i], "--daemon" ) ) {
+            action = ACTION_DAEMON;
+            socket_path = DAEMON_DEFAULT_SOCKET;
+            if ( argc>i+1 && argv[i+1][0] != '-' ) socket_path = argv[++i];
+        } else if ( !strcmp(argv[i], "--shm" ) ) {
+            if ( argc>i+1) shm_name = argv[++i];
+        } else if ( !strcmp(argv[i], "--print-trace" ) ) {
+            action = ACTION_PRINT_TRACE;
+            if ( argc>i+1) trace_input = argv[++i];
         }
     }
 
+    /* --shm alone streams without a socket */
+    if ( action == NO_ACTION && shm_name != NULL )
+        action = ACTION_DAEMON;
+
     if ( action == NO_ACTION ) {
         fprintf(stderr, "USAGE: %s <OPTIONS> ACTION \n", argv[0]);
         fprintf(stderr, " ACTION is one of:\n");
         fprintf(stderr, "  --info             get information about software version and configuration\n");
-        fprintf(stderr, "  --delete           delete all track lists from the data logger\n");
+        fprintf(stderr, "  --delete           delete all track lists from the data logger and its\n");
+        fprintf(stderr, "                     sector cache\n");
         fprintf(stderr, "  --dump             dump track lists to STDOUT\n");
+        fprintf(stderr, "  --dump-raw <FILE>  copy the log memory to an image file\n");
+        fprintf(stderr, "  --devices <LIST>   dump several devices at once, <LIST> is separated by\n");
+        fprintf(stderr, "                     commas; each track goes to a file named after the\n");
+        fprintf(stderr, "                     device and the format, e.g. ttyUSB0.gpx; --from and\n");
+        fprintf(stderr, "                     --to only filter the points, all sectors are read\n");
+        fprintf(stderr, "  --daemon [SOCKET]  keep the device open and serve its fixes as JSON lines\n");
+        fprintf(stderr, "                     to clients of a Unix socket, default is\n");
+        fprintf(stderr, "                     " DAEMON_DEFAULT_SOCKET "; clients may send the\n");
+        fprintf(stderr, "                     commands info, version, config <KEY=VALUE...> and\n");
+        fprintf(stderr, "                     output nmea|binary|off\n");
+        fprintf(stderr, "  --shm <NAME>       keep the latest fix in POSIX shared memory <NAME>,\n");
+        fprintf(stderr, "                     e.g. /skytraq, see fix-shm.h; also with --daemon\n");
+        fprintf(stderr, "  --decode <FILE>    print the track lists from an image file to STDOUT\n");
+        fprintf(stderr, "                     (no device needed)\n");
+        fprintf(stderr, "  --decode-nmea <FILE>  print the track from a log of NMEA output (GGA and\n");
+        fprintf(stderr, "                     RMC) to STDOUT, - reads STDIN (no device needed)\n");
         fprintf(stderr, "  --set-config       change configuration of the data logger\n");
         fprintf(stderr, "  --set-baud-rate    configure speed of the device's serial port\n");
         fprintf(stderr, "  --set-output-off   disable output for GPS data\n");
@@ -103,10 +257,42 @@ int main(int argc, char *argv[])  {
         fprintf(stderr, "  --set-output-bin   enable output for GPS data in binary format\n");
         fprintf(stderr, "  --update-agps      upload to AGPS data on the device\n");
         fprintf(stderr, "                     (needs internet connection)\n");
+        fprintf(stderr, "  --print-trace <FILE> print a trace written with --trace (no device needed)\n");
         fprintf(stderr, " OPTIONS:\n");
         fprintf(stderr, "  --device <DEV>        name of the device, default is /dev/ttyUSB0\n");
         fprintf(stderr, "  --permanent           write serial port speed to FLASH\n");
         fprintf(stderr, "  --baud-rate           set baud-rate manually\n");
+        fprintf(stderr, "  --stats               print I/O statistics to STDERR when done\n");
+        fprintf(stderr, "  --stats-json          the same as JSON, with all counters\n");
+        fprintf(stderr, "  --trace <FILE>        write the last serial traffic and protocol events to\n");
+        fprintf(stderr, "                        <FILE> when done or on SIGUSR1\n");
+        fprintf(stderr, "  --trace-on-error <FILE>  the same, but only if errors occurred\n");
+        fprintf(stderr, "  --format <FORMAT>     output of dump and decode: gpx (default), csv, geojson,\n");
+        fprintf(stderr, "                        kml or binary (little-endian records, see\n");
+        fprintf(stderr, "                        output-formats.c)\n");
+        fprintf(stderr, "  --precision <N>       digits after the decimal point in text formats,\n");
+        fprintf(stderr, "                        default is 6\n");
+        fprintf(stderr, "  --fast-geo            approximate the coordinates of short entries from the\n");
+        fprintf(stderr, "                        last long entry (error below 0.2 m)\n");
+        fprintf(stderr, "  --from <TIME>         only points recorded from <TIME> (UTC) on, as\n");
+        fprintf(stderr, "                        YYYY-MM-DD[THH:MM[:SS]] or seconds since 1970;\n");
+        fprintf(stderr, "                        dump only reads the sectors needed\n");
+        fprintf(stderr, "  --to <TIME>           only points recorded up to <TIME>, a date alone\n");
+        fprintf(stderr, "                        includes the whole day\n");
+        fprintf(stderr, " OPTIONS for dump:\n");
+        fprintf(stderr, "  --pacing <STRATEGY>   pause between sector requests: adaptive (default,\n");
+        fprintf(stderr, "                        back off only on errors), none, or fixed (1 second)\n");
+        fprintf(stderr, "  --no-upshift          keep the baud-rate, by default the fastest rate\n");
+        fprintf(stderr, "                        possible is used during the transfer\n");
+        fprintf(stderr, "  --cache               keep sectors in ~/.cache/skytraq-datalogger and only\n");
+        fprintf(stderr, "                        read sectors from the device that may have changed\n");
+        fprintf(stderr, "  --cache-dir <DIR>     keep the sector cache in <DIR>\n");
+        fprintf(stderr, "  --cache-id <NAME>     name of the device in the cache, by default derived\n");
+        fprintf(stderr, "                        from its software version (use with several loggers)\n");
+        fprintf(stderr, "  --output-dir <DIR>    where --devices writes the tracks, default is the\n");
+        fprintf(stderr, "                        current directory\n");
+        fprintf(stderr, " OPTIONS for decode:\n");
+        fprintf(stderr, "  --threads <N>         decode with <N> threads, default is one per CPU\n");
         fprintf(stderr, " OPTIONS for configuration:\n");
         fprintf(stderr, "  --time <SECONDS>      log every <SECONDS> seconds\n");
         fprintf(stderr, "  --max-time <SECONDS>  \n");
@@ -121,19 +307,94 @@ int main(int argc, char *argv[])  {
         return RETURN_ERROR_OPTIONS;
     }
 
+    dump_options.format = output_format_find(format);
+    if ( dump_options.format == NULL ) {
+        fprintf(stderr, "unknown output format %s\n", format);
+        return RETURN_ERROR_OPTIONS;
+    }
+
+    /* multi-dump.c has no sector cache, flash image or pacing strategy */
+    if ( action == ACTION_DUMP_DEVICES && (dump_options.cache_dir != NULL || dump_options.cache_id != NULL ||
+            image_file != NULL || pacing_given) ) {
+        fprintf(stderr, "--devices cannot be used with --cache, --cache-dir, --cache-id, --dump-raw or --pacing\n");
+        return RETURN_ERROR_OPTIONS;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+
+    if ( action == ACTION_PRINT_TRACE ) {
+        if ( trace_input == NULL || trace_print(trace_input, stdout) != SUCCESS ) {
+            fprintf(stderr, "Cannot read trace %s\n", trace_input ? trace_input : "");
+            return RETURN_ERROR_IMAGE;
+        }
+        return RETURN_OK;
+    }
+
+    if ( action == ACTION_DECODE_NMEA ) {
+        if ( image_file == NULL || skytraq_decode_nmea(image_file, &dump_options, &report) != SUCCESS ) {
+            fprintf(stderr, "Cannot read NMEA log %s\n", image_file ? image_file : "");
+            return RETURN_ERROR_IMAGE;
+        }
+        stats_phase(&stats, action_names[action], phase_start);
+        stats.dump = &report;
+        print_stats(show_stats, &stats);
+        return RETURN_OK;
+    }
+
+    if ( action == ACTION_DECODE ) {
+        if ( image_file == NULL || skytraq_decode_image(image_file, threads, &dump_options, &report) != SUCCESS ) {
+            fprintf(stderr, "Cannot read image %s\n", image_file ? image_file : "");
+            return RETURN_ERROR_IMAGE;
+        }
+        stats_phase(&stats, action_names[action], phase_start);
+        stats.dump = &report;
+        print_stats(show_stats, &stats);
+        return RETURN_OK;
+    }
+
+    if ( trace_file != NULL ) {
+        struct sigaction trace_action;
+
+        memset(&trace_action, 0, sizeof(trace_action));
+        trace_action.sa_handler = save_trace_on_signal;
+        trace_action.sa_flags = SA_RESTART;
+        sigemptyset(&trace_action.sa_mask);
+        sigaction(SIGUSR1, &trace_action, NULL);
+    }
+
+    if ( action == ACTION_DUMP_DEVICES ) {
+        char** names = malloc((strlen(device_list) / 2 + 1) * sizeof(char*));
+        char* name;
+        int count = 0, failed;
+
+        for ( name = strtok(device_list, ","); name != NULL; name = strtok(NULL, ",") )
+            names[count++] = name;
+        failed = skytraq_dump_devices(names, count, baud_rate, output_dir, &dump_options, &report);
+        free(names);
+
+        stats_phase(&stats, action_names[action], phase_start);
+        stats.dump = &report;
+        stats.device = 1;
+        print_stats(show_stats, &stats);
+        return finish(failed > 0 || count == 0 ? RETURN_ERROR : RETURN_OK);
+    }
+
+    stats.device = 1;
     fd = open_port(device);
     if ( fd == -1 ) {
         fprintf(stderr,"Failed to open device %s\n", device);
-        return 1;
+        return finish(1);
     }
+    phase_start = stats_phase(&stats, "open", phase_start);
 
     /* detect device and speed */
     if ( baud_rate == 0 ) {
         baud_rate = skytraq_determine_speed(fd);
         if ( baud_rate == 0 ) {
             fprintf(stderr,"Could not find data logger at port %s\n", device);
-            return RETURN_ERROR;
+            return finish(RETURN_ERROR);
         }
+        phase_start = stats_phase(&stats, "detect", phase_start);
     }
 
     /* get status and config from GPS data logger */
@@ -142,7 +403,18 @@ int main(int argc, char *argv[])  {
 
     if ( success != SUCCESS ) {
         fprintf(stderr, "No response from datalogger.\n");
-        return RETURN_ERROR;
+        return finish(RETURN_ERROR);
+    }
+    phase_start = stats_phase(&stats, "config", phase_start);
+
+    if ( action == ACTION_DAEMON ) {
+        if ( skytraq_run_daemon(fd, device, socket_path, shm_name) != SUCCESS )
+            return finish(RETURN_ERROR);
+        free(info);
+        close_port(fd);
+        stats_phase(&stats, action_names[action], phase_start);
+        print_stats(show_stats, &stats);
+        return finish(RETURN_OK);
     }
 
     if ( action == ACTION_INFO ) {
@@ -185,36 +457,18 @@ int main(int argc, char *argv[])  {
         printf("baud-rate:       %d bps\n", baud_rate);
     } else if ( action == ACTION_DELETE ) {
         skytraq_clear_datalog(fd);
-    } else if ( action == ACTION_DUMP ) {
-        int used_sectors;
-        long last_timestamp = 0;
-
-        used_sectors = info->total_sectors - info->sectors_left + 1;
-
-        /* print GPX header */
-        printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-        printf("<gpx xmlns=\"http://www.topografix.com/GPX/1/0\" creator=\"skytraq-datalogger\" version=\"1.0\">\n");
-        printf("<trk>\n<trkseg>\n");
-
-        for ( i = 0; i< used_sectors ; i++ ) {
-            int len, retries_left = 3;
-            gbuint8* buf = malloc(4100);
-            len= skytraq_read_datalog_sector(fd,i,buf);
-            while ( len == -1 && retries_left > 3 ) {
-                /* retry to read the sector */
-                len= skytraq_read_datalog_sector(fd,i,buf);
-                retries_left--;
+        skytraq_clear_cache(fd, &dump_options);
+    } else if ( action == ACTION_DUMP || action == ACTION_DUMP_RAW ) {
+        if ( action == ACTION_DUMP_RAW ) {
+            if ( image_file == NULL ) {
+                fprintf(stderr, "--dump-raw needs a file name\n");
+                return RETURN_ERROR_OPTIONS;
             }
-            last_timestamp = process_buffer(buf,len,last_timestamp);
-            free(buf);
-
-            sleep(1);
-            /* close(fd);
-             fd = open("/dev/ttyUSB0",O_RDWR); */
+            dump_options.raw_image = image_file;
         }
 
-        printf("</trkseg>\n</trk>\n</gpx>\n");
-
+        skytraq_dump(fd, baud_rate, info, &dump_options, &report);
+        stats.dump = &report;
     } else if ( action  == ACTION_CONFIG ) {
         if ( min_time > -1 ) info->min_time = min_time;
         if ( max_time > -1 ) info->max_time = max_time;
@@ -233,7 +487,7 @@ int main(int argc, char *argv[])  {
             skytraq_set_serial_speed(fd,requested_speed,permanent);
         } else {
             fprintf( stderr, "unknown speed %d\n", serial_speed);
-            return RETURN_ERROR;
+            return finish(RETURN_ERROR);
         }
     } else if ( action == ACTION_OUTPUT_OFF ) {
         skytraq_output_disable(fd);
@@ -264,11 +518,15 @@ int main(int argc, char *argv[])  {
             }
         } else {
             fprintf(stderr, "Download failed.\n");
-            return RETURN_ERROR_AGPS_DOWNLOAD_FAILED;
+            return finish(RETURN_ERROR_AGPS_DOWNLOAD_FAILED);
         }
     }
     free(info);
-    close(fd);
+    free(cache_dir);
+    close_port(fd);
+
+    stats_phase(&stats, action_names[action], phase_start);
+    print_stats(show_stats, &stats);
 
-    return RETURN_OK;
+    return finish(RETURN_OK);
 }
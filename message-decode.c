@@ -0,0 +1,135 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "message-decode.h"
+
+/*
+ * Decoders for the messages of the receiver, in a table indexed by the
+ * message id. Multi-byte values are big-endian.
+ */
+
+#define GPS_EPOCH           315964800l  /* 1980-01-06 in seconds since 1970 */
+#define GPS_LEAP_SECONDS    18          /* GPS time is ahead of UTC since 2017 */
+
+typedef int (*message_decoder)( const gbuint8* payload, unsigned length, skytraq_message* message );
+
+typedef struct message_type {
+    const char*     name;
+    unsigned        length;         /* shortest valid payload, with the id */
+    message_decoder decode;
+} message_type;
+
+static long int32_be( const gbuint8* d ) {
+    return (long)(int)(((unsigned)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3]);
+}
+
+static unsigned uint16_be( const gbuint8* d ) {
+    return (d[0] << 8) | d[1];
+}
+
+static int decode_navigation( const gbuint8* d, unsigned length, skytraq_message* message ) {
+    skytraq_navigation* n = &message->data.navigation;
+
+    n->fix_mode = d[1];
+    n->satellites = d[2];
+    n->week = uint16_be(d + 3);
+    n->time_of_week = (unsigned long)int32_be(d + 5) / 100.0;
+    n->latitude = int32_be(d + 9) * 1e-7;
+    n->longitude = int32_be(d + 13) * 1e-7;
+    n->ellipsoid_altitude = int32_be(d + 17) / 100.0;
+    n->altitude = int32_be(d + 21) / 100.0;
+    n->gdop = uint16_be(d + 25) / 100.0;
+    n->pdop = uint16_be(d + 27) / 100.0;
+    n->hdop = uint16_be(d + 29) / 100.0;
+    n->vdop = uint16_be(d + 31) / 100.0;
+    n->tdop = uint16_be(d + 33) / 100.0;
+    n->x = int32_be(d + 35) / 100.0;
+    n->y = int32_be(d + 39) / 100.0;
+    n->z = int32_be(d + 43) / 100.0;
+    n->vx = int32_be(d + 47) / 100.0;
+    n->vy = int32_be(d + 51) / 100.0;
+    n->vz = int32_be(d + 55) / 100.0;
+    return n->fix_mode <= NAVIGATION_3D_DGPS ? SUCCESS : ERROR;
+}
+
+static int decode_version( const gbuint8* d, unsigned length, skytraq_message* message ) {
+    memcpy(message->data.version.kernel, d + 3, 3);
+    memcpy(message->data.version.odm, d + 7, 3);
+    memcpy(message->data.version.revision, d + 11, 3);
+    return SUCCESS;
+}
+
+static int decode_log_status( const gbuint8* d, unsigned length, skytraq_message* message ) {
+    SkyTraqPackage p;
+
+    p.length = length;
+    p.data = (gbuint8*)d;
+    skytraq_parse_config(&p, &message->data.config);
+    return SUCCESS;
+}
+
+static int decode_answer( const gbuint8* d, unsigned length, skytraq_message* message ) {
+    message->data.command = d[1];
+    return SUCCESS;
+}
+
+static const message_type message_types[256] = {
+    [SKYTRAQ_RESPONSE_SOFTWARE_VERSION] = { "software version", 14, decode_version },
+    [SKYTRAQ_RESPONSE_ACK]              = { "ACK", 2, decode_answer },
+    [SKYTRAQ_RESPONSE_NACK]             = { "NACK", 2, decode_answer },
+    [SKYTRAQ_RESPONSE_LOG_STATUS]       = { "log status", 35, decode_log_status },
+    [SKYTRAQ_RESPONSE_NAVIGATION_DATA]  = { "navigation data", 59, decode_navigation },
+};
+
+/**
+  * Decode the <payload> of a package from the receiver into <message>.
+  * Returns ERROR for unknown or too short messages.
+  */
+int skytraq_decode_message( const gbuint8* payload, unsigned length, skytraq_message* message ) {
+    const message_type* type;
+
+    if ( length == 0 )
+        return ERROR;
+    type = &message_types[payload[0]];
+    if ( type->decode == NULL || length < type->length )
+        return ERROR;
+    message->id = payload[0];
+    message->name = type->name;
+    return type->decode(payload, length, message);
+}
+
+/**
+  * GPS week and time of week to seconds since 1970, UTC.
+  */
+double skytraq_gps_to_unix( unsigned week, double time_of_week ) {
+    return GPS_EPOCH + week * 604800.0 + time_of_week - GPS_LEAP_SECONDS;
+}
+
+/**
+  * The inverse of skytraq_gps_to_unix().
+  */
+void skytraq_unix_to_gps( double time, unsigned* week, double* time_of_week ) {
+    double gps = time - GPS_EPOCH + GPS_LEAP_SECONDS;
+
+    *week = gps / 604800;
+    *time_of_week = gps - *week * 604800.0;
+}
@@ -0,0 +1,60 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef message_decode_h
+#define message_decode_h
+
+/* fix modes of the navigation data */
+enum { NAVIGATION_NO_FIX, NAVIGATION_2D, NAVIGATION_3D, NAVIGATION_3D_DGPS };
+
+/* SKYTRAQ_RESPONSE_NAVIGATION_DATA, sent every second in binary output mode */
+typedef struct skytraq_navigation {
+    int         fix_mode;           /* NAVIGATION_* */
+    int         satellites;         /* used in the fix */
+    unsigned    week;               /* GPS week */
+    double      time_of_week;       /* seconds of GPS time */
+    double      latitude;           /* degrees */
+    double      longitude;
+    double      ellipsoid_altitude; /* meters */
+    double      altitude;           /* meters above mean sea level */
+    double      gdop, pdop, hdop, vdop, tdop;
+    double      x, y, z;            /* ECEF position in meters */
+    double      vx, vy, vz;         /* ECEF velocity in m/s */
+} skytraq_navigation;
+
+/* a message from the receiver, decoded by the table in message-decode.c */
+typedef struct skytraq_message {
+    gbuint8     id;
+    const char* name;
+    union {
+        skytraq_navigation  navigation;
+        skytraq_version     version;
+        skytraq_config      config;         /* SKYTRAQ_RESPONSE_LOG_STATUS */
+        gbuint8             command;        /* answered by an ACK or NACK */
+    } data;
+} skytraq_message;
+
+int skytraq_decode_message( const gbuint8* payload, unsigned length, skytraq_message* message );
+double skytraq_gps_to_unix( unsigned week, double time_of_week );
+void skytraq_unix_to_gps( double time, unsigned* week, double* time_of_week );
+
+#endif
@@ -0,0 +1,608 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#define _GNU_SOURCE /* memmem() */
+#include "datalogger.h"
+#include "lowlevel.h"
+#include "multi-dump.h"
+#include "trace.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+/*
+ * Dump several data loggers at once from a single thread. Each device runs
+ * through the same steps as a single dump (speed detection, configuration,
+ * upshift, sectors, restoring the speed), but as a state machine driven by
+ * poll(): every step sends one command and the answer is taken apart by the
+ * incremental framer as it arrives, so one slow device does not hold up the
+ * others and the CPU sleeps while all of them are busy sending.
+ */
+
+#define COMMAND_TIMEOUT     2000  /* ms, also the longest pause within a sector */
+#define DETECT_TIMEOUT      250   /* ms to wait for an answer at each rate */
+#define RETRY_PAUSE         100   /* ms, input is thrown away before a retry */
+#define SECTOR_RETRIES      3
+#define SECTOR_TRAILER_SIZE 16    /* "\0CHECKSUM=" <checksum> "\0\0\0\r\n" after END */
+#define INPUT_CHUNK         4096
+
+/* what a device is doing, every step sends one command */
+enum { DEVICE_DETECT, DEVICE_CONFIG, DEVICE_UPSHIFT, DEVICE_CHECK_SPEED, DEVICE_SECTOR,
+       DEVICE_RESTORE, DEVICE_DONE, DEVICE_FAILED
+     };
+
+/* what the current step waits for */
+enum { WAIT_ACK, WAIT_RESPONSE, WAIT_SECTOR, WAIT_PAUSE };
+
+/* the answer expected after the ACK, if it is not a package */
+#define RESPONSE_NONE       -1
+#define RESPONSE_SECTOR     -2
+
+static const unsigned detect_rates[] = { 9600, 115200, 57600, 38400, 19200, 4800, 2400, 1200 };
+static const unsigned upshift_rates[] = { 115200, 57600, 38400, 19200 };
+
+#define DETECT_RATES  (sizeof(detect_rates)/sizeof(unsigned))
+#define UPSHIFT_RATES (sizeof(upshift_rates)/sizeof(unsigned))
+
+typedef struct device {
+    const char*                 name;
+    int                         fd;
+    int                         state;
+    int                         wait;
+    double                      deadline;   /* end of the current wait, monotonic seconds */
+    double                      sent;       /* when the command went out */
+    gbuint8                     command;    /* message ID of the command waiting for its ACK */
+    int                         response;   /* message ID expected after the ACK or RESPONSE_* */
+    int                         retries;
+    int                         upshift;    /* still to try a faster rate */
+    int                         rate_index; /* in detect_rates or upshift_rates */
+    unsigned                    baud_rate;  /* rate the device was found at */
+    unsigned                    rate;       /* rate in use */
+    skytraq_framer              framer;
+    skytraq_config              info;
+    int                         used_sectors;
+    int                         sector;
+    gbuint8                     data[SKYTRAQ_SECTOR_SIZE + 3 + SECTOR_TRAILER_SIZE];
+    int                         length;     /* bytes of the sector received */
+    int                         end;        /* offset of "END", -1 until found */
+    double                      transfer_start;
+    const skytraq_dump_options* options;
+    const char*                 output_dir;
+    char*                       path;
+    FILE*                       file;
+    output_writer               output;
+    decode_state                decode;
+    int                         closed;
+    skytraq_dump_report         report;
+} device;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_interrupt( int sig ) {
+    interrupted = sig;
+}
+
+static void start_step( device* d );
+
+static void send_command( device* d, const gbuint8* payload, int length, int response, unsigned timeout ) {
+    gbuint8 frame[SKYTRAQ_FRAME_OVERHEAD + 4];
+    int frame_length = skytraq_frame_package(frame, payload, length);
+
+    skytraq_framer_init(&d->framer);
+    d->command = payload[0];
+    d->response = response;
+    d->wait = WAIT_ACK;
+    d->sent = monotonic_time();
+    d->deadline = d->sent + timeout / 1000.0;
+    if ( write_buffer(d->fd, frame, frame_length) != frame_length )
+        d->deadline = d->sent; /* counts as a timeout */
+}
+
+/**
+  * Wait a little and throw away the input before the step is repeated.
+  */
+static void pause_step( device* d ) {
+    d->wait = WAIT_PAUSE;
+    d->deadline = monotonic_time() + RETRY_PAUSE / 1000.0;
+    d->report.wait_time += RETRY_PAUSE / 1000.0;
+}
+
+static int open_output( device* d ) {
+    const skytraq_dump_options* options = d->options;
+    const char* base = strrchr(d->name, '/');
+
+    base = base != NULL ? base + 1 : d->name;
+    d->path = malloc(strlen(d->output_dir) + strlen(base) + strlen(options->format->name) + 3);
+    sprintf(d->path, "%s/%s.%s", d->output_dir, base, options->format->name);
+    d->file = fopen(d->path, "w");
+    if ( d->file == NULL )
+        return ERROR;
+
+    output_writer_init(&d->output, d->file, options->format, options->precision);
+    output_writer_window(&d->output, options->from, options->to);
+    output_header(&d->output);
+    decode_init(&d->decode, 0);
+    d->decode.fast_geo = options->fast_geo;
+    return SUCCESS;
+}
+
+/**
+  * Finish the output file and the report of a device that is done or failed.
+  */
+static void close_device( device* d ) {
+    if ( d->closed )
+        return;
+    d->closed = 1;
+    if ( d->file != NULL ) {
+        output_footer(&d->output);
+        output_writer_close(&d->output);
+        fclose(d->file);
+    }
+    d->report.decode = d->decode.stats;
+}
+
+static void fail( device* d, const char* message ) {
+    fprintf(stderr, "%s: %s\n", d->name, message);
+    trace_error(d->fd, "%s", message);
+    d->state = DEVICE_FAILED;
+    close_device(d);
+}
+
+/**
+  * Decode a sector into the output file, <length> is -1 if it could not be read.
+  */
+static void sector_finished( device* d, int length ) {
+    double start = monotonic_time();
+
+    d->report.sectors++;
+    if ( length == -1 )
+        d->report.failed_sectors++;
+    process_buffer_to(&d->output, d->data, length, &d->decode);
+    d->report.decode_time += monotonic_time() - start;
+    d->sector++;
+    d->retries = 0;
+}
+
+/**
+  * The answer to the current step has arrived; <response> is the package
+  * after the ACK if one was expected.
+  */
+static void step_done( device* d, const SkyTraqPackage* response ) {
+    d->retries = 0;
+
+    switch ( d->state ) {
+    case DEVICE_DETECT:
+        d->baud_rate = d->rate;
+        d->state = DEVICE_CONFIG;
+        break;
+    case DEVICE_CONFIG:
+        skytraq_parse_config(response, &d->info);
+        d->used_sectors = d->info.total_sectors - d->info.sectors_left + 1;
+        if ( d->file == NULL && open_output(d) != SUCCESS ) {
+            fail(d, "cannot create the output file");
+            return;
+        }
+        d->rate_index = 0;
+        d->state = d->upshift ? DEVICE_UPSHIFT : DEVICE_SECTOR;
+        break;
+    case DEVICE_UPSHIFT:
+        /* the device uses the new rate after the ACK */
+        d->rate = upshift_rates[d->rate_index];
+        set_port_speed(d->fd, d->rate);
+        flush_input(d->fd);
+        d->state = DEVICE_CHECK_SPEED;
+        break;
+    case DEVICE_CHECK_SPEED:
+        d->state = DEVICE_SECTOR;
+        break;
+    case DEVICE_SECTOR:
+        sector_finished(d, d->end);
+        break;
+    case DEVICE_RESTORE:
+        set_port_speed(d->fd, d->baud_rate);
+        d->rate = d->baud_rate;
+        d->state = DEVICE_DONE;
+        close_device(d);
+        return;
+    }
+    start_step(d);
+}
+
+/**
+  * The current step got a NACK, a bad answer or none at all.
+  */
+static void step_failed( device* d ) {
+    switch ( d->state ) {
+    case DEVICE_DETECT:
+        if ( ++d->rate_index == DETECT_RATES ) {
+            fail(d, "could not find the data logger");
+            return;
+        }
+        break;
+    case DEVICE_CONFIG:
+        if ( d->retries++ == SECTOR_RETRIES ) {
+            fail(d, "no response from the data logger");
+            return;
+        }
+        pause_step(d);
+        return;
+    case DEVICE_UPSHIFT:
+        d->rate_index++;
+        break;
+    case DEVICE_CHECK_SPEED:
+        /* the device switched but does not answer, find it again */
+        d->upshift = 0;
+        d->rate_index = 0;
+        d->state = DEVICE_DETECT;
+        break;
+    case DEVICE_SECTOR:
+        if ( d->retries < SECTOR_RETRIES ) {
+            d->retries++;
+            d->report.retries++;
+        } else {
+            sector_finished(d, -1);
+        }
+        pause_step(d);
+        return;
+    case DEVICE_RESTORE:
+        fprintf(stderr, "%s: could not restore baud-rate %d\n", d->name, d->baud_rate);
+        d->state = DEVICE_DONE;
+        close_device(d);
+        return;
+    }
+    start_step(d);
+}
+
+/**
+  * Send the command of the current step.
+  */
+static void start_step( device* d ) {
+    gbuint8 command[4];
+
+    switch ( d->state ) {
+    case DEVICE_DETECT:
+        d->rate = detect_rates[d->rate_index];
+        set_port_speed(d->fd, d->rate);
+        flush_input(d->fd);
+        command[0] = SKYTRAQ_COMMAND_QUERY_SOFTWARE_VERSION;
+        command[1] = 1;
+        send_command(d, command, 2, RESPONSE_NONE, DETECT_TIMEOUT);
+        break;
+    case DEVICE_CONFIG:
+        command[0] = SKYTRAQ_COMMAND_GET_CONFIG;
+        send_command(d, command, 1, SKYTRAQ_RESPONSE_LOG_STATUS, COMMAND_TIMEOUT);
+        break;
+    case DEVICE_UPSHIFT:
+        /* the fastest rate left that the host supports */
+        while ( d->rate_index < UPSHIFT_RATES && upshift_rates[d->rate_index] > d->rate &&
+                set_port_speed(d->fd, upshift_rates[d->rate_index]) != SUCCESS )
+            d->rate_index++;
+        if ( d->rate_index == UPSHIFT_RATES || upshift_rates[d->rate_index] <= d->rate ) {
+            set_port_speed(d->fd, d->rate);
+            d->state = DEVICE_SECTOR;
+            start_step(d);
+            return;
+        }
+        set_port_speed(d->fd, d->rate);
+        command[0] = SKYTRAQ_COMMAND_CONFIGURE_SERIAL_PORT;
+        command[1] = 0;
+        command[2] = skytraq_mkspeed(upshift_rates[d->rate_index]);
+        command[3] = 0;
+        send_command(d, command, 4, RESPONSE_NONE, COMMAND_TIMEOUT);
+        break;
+    case DEVICE_CHECK_SPEED:
+        command[0] = SKYTRAQ_COMMAND_QUERY_SOFTWARE_VERSION;
+        command[1] = 1;
+        send_command(d, command, 2, RESPONSE_NONE, COMMAND_TIMEOUT);
+        break;
+    case DEVICE_SECTOR:
+        if ( d->transfer_start == 0 ) {
+            d->transfer_start = monotonic_time();
+            d->report.baud_rate = d->rate;
+        }
+        if ( d->sector >= d->used_sectors ) {
+            d->report.transfer_time = monotonic_time() - d->transfer_start;
+            if ( d->rate != d->baud_rate ) {
+                d->state = DEVICE_RESTORE;
+                start_step(d);
+            } else {
+                d->state = DEVICE_DONE;
+                close_device(d);
+            }
+            return;
+        }
+        d->length = 0;
+        d->end = -1;
+        command[0] = SKYTRAQ_COMMAND_READ_SECTOR;
+        command[1] = d->sector;
+        send_command(d, command, 2, RESPONSE_SECTOR, COMMAND_TIMEOUT);
+        break;
+    case DEVICE_RESTORE:
+        command[0] = SKYTRAQ_COMMAND_CONFIGURE_SERIAL_PORT;
+        command[1] = 0;
+        command[2] = skytraq_mkspeed(d->baud_rate);
+        command[3] = 0;
+        send_command(d, command, 4, RESPONSE_NONE, COMMAND_TIMEOUT);
+        break;
+    }
+}
+
+static void handle_package( device* d, const SkyTraqPackage* pkg ) {
+    /* any valid package means the rate is right */
+    if ( d->state == DEVICE_DETECT ) {
+        step_done(d, NULL);
+        return;
+    }
+
+    if ( d->wait == WAIT_ACK && pkg->length >= 2 && pkg->data[1] == d->command ) {
+        if ( pkg->data[0] == SKYTRAQ_RESPONSE_ACK ) {
+            skytraq_count_command(d->fd, d->command, ACK, d->sent);
+            if ( d->response == RESPONSE_NONE ) {
+                step_done(d, NULL);
+            } else {
+                d->wait = d->response == RESPONSE_SECTOR ? WAIT_SECTOR : WAIT_RESPONSE;
+                d->deadline = monotonic_time() + COMMAND_TIMEOUT / 1000.0;
+            }
+        } else if ( pkg->data[0] == SKYTRAQ_RESPONSE_NACK ) {
+            skytraq_count_command(d->fd, d->command, NACK, d->sent);
+            step_failed(d);
+        }
+    } else if ( d->wait == WAIT_RESPONSE && pkg->data[0] == d->response ) {
+        if ( d->response == SKYTRAQ_RESPONSE_LOG_STATUS && pkg->length < 35 )
+            step_failed(d);
+        else
+            step_done(d, pkg);
+    }
+}
+
+/**
+  * Collect the raw data of a sector up to the end of its trailer. Returns
+  * the number of bytes used, the rest belongs to the next answer.
+  */
+static int collect_sector( device* d, const gbuint8* buf, int len ) {
+    int room = SKYTRAQ_SECTOR_SIZE + 3 + SECTOR_TRAILER_SIZE - d->length;
+    int n = len < room ? len : room;
+    int complete;
+
+    memcpy(d->data + d->length, buf, n);
+    if ( d->end < 0 ) {
+        /* "END" may start in the previous chunk */
+        int from = d->length > 2 ? d->length - 2 : 0;
+        gbuint8* found = memmem(d->data + from, d->length + n - from, "END", 3);
+        if ( found != NULL )
+            d->end = found - d->data;
+    }
+    d->length += n;
+    d->deadline = monotonic_time() + COMMAND_TIMEOUT / 1000.0;
+
+    if ( d->end < 0 ) {
+        if ( d->length >= SKYTRAQ_SECTOR_SIZE + 3 ) {
+            fprintf(stderr, "%s: no end of data for sector %d\n", d->name, d->sector);
+            trace_error(d->fd, "no end of data for sector %d", d->sector);
+            step_failed(d);
+        }
+        return n;
+    }
+
+    complete = d->end + 3 + SECTOR_TRAILER_SIZE;
+    if ( d->length < complete )
+        return n;
+    n -= d->length - complete;
+    d->length = complete;
+
+    /* the checksum is the 11th byte of the trailer */
+    if ( skytraq_xor_checksum(d->data, d->end) == d->data[d->end + 3 + 10] ) {
+        step_done(d, NULL);
+    } else {
+        fprintf(stderr, "%s: wrong checksum for sector %d\n", d->name, d->sector);
+        trace_error(d->fd, "wrong checksum for sector %d", d->sector);
+        step_failed(d);
+    }
+    return n;
+}
+
+static void handle_input( device* d, const gbuint8* buf, int len ) {
+    int i = 0;
+
+    if ( d->state == DEVICE_DETECT && memmem(buf, len, "$GP", 3) != NULL ) {
+        /* NMEA sentences at this rate */
+        step_done(d, NULL);
+        return;
+    }
+
+    while ( i < len && d->state < DEVICE_DONE && d->wait != WAIT_PAUSE ) {
+        if ( d->wait == WAIT_SECTOR ) {
+            i += collect_sector(d, buf + i, len - i);
+        } else {
+            unsigned consumed;
+            SkyTraqPackage* pkg = skytraq_framer_feed(&d->framer, buf + i, len - i, &consumed);
+
+            i += consumed;
+            if ( pkg != NULL ) {
+                trace_data(TRACE_PACKAGE, d->fd, pkg->data, pkg->length);
+                handle_package(d, pkg);
+                skytraq_free_package(pkg);
+            }
+        }
+    }
+}
+
+static void handle_timeout( device* d ) {
+    if ( d->wait == WAIT_PAUSE ) {
+        flush_input(d->fd);
+        start_step(d);
+        return;
+    }
+
+    trace_event(TRACE_TIMEOUT, d->fd, (unsigned long)((monotonic_time() - d->sent) * 1000), 0);
+    if ( d->wait == WAIT_ACK && d->state != DEVICE_DETECT )
+        skytraq_count_command(d->fd, d->command, ERROR, d->sent);
+    if ( d->wait == WAIT_SECTOR ) {
+        fprintf(stderr, "%s: no end of data for sector %d\n", d->name, d->sector);
+        trace_error(d->fd, "no end of data for sector %d", d->sector);
+    }
+    step_failed(d);
+}
+
+static void add_report( skytraq_dump_report* total, const skytraq_dump_report* r ) {
+    total->sectors += r->sectors;
+    total->failed_sectors += r->failed_sectors;
+    total->retries += r->retries;
+    total->wait_time += r->wait_time;
+    total->decode_time += r->decode_time;
+    if ( r->transfer_time > total->transfer_time )
+        total->transfer_time = r->transfer_time;
+    if ( r->baud_rate > total->baud_rate )
+        total->baud_rate = r->baud_rate;
+    total->decode.long_entries += r->decode.long_entries;
+    total->decode.short_entries += r->decode.short_entries;
+    total->decode.skipped_bytes += r->decode.skipped_bytes;
+    total->decode.erased_bytes += r->decode.erased_bytes;
+    total->decode.linearized += r->decode.linearized;
+}
+
+/**
+  * Dump the track lists of all <devices> at the same time into one file per
+  * device in <output_dir>, named after the device and the output format
+  * (e.g. ttyUSB0.gpx). The speed of each device is detected unless
+  * <baud_rate> is given. A summary line per device goes to STDERR, <report>
+  * adds up the sectors of all of them, with the longest transfer time.
+  * Returns the number of devices that could not be dumped.
+  */
+int skytraq_dump_devices( char* const* names, int count, unsigned baud_rate, const char* output_dir,
+                          const skytraq_dump_options* options, skytraq_dump_report* report ) {
+    device* devices = calloc(count, sizeof(device));
+    struct pollfd* fds = malloc(count * sizeof(struct pollfd));
+    int* polled = malloc(count * sizeof(int));
+    double start = monotonic_time();
+    struct sigaction action, old_int, old_term;
+    int i, failed = 0;
+
+    memset(report, 0, sizeof(skytraq_dump_report));
+    interrupted = 0;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    for ( i = 0; i < count; i++ ) {
+        device* d = &devices[i];
+
+        d->name = names[i];
+        d->options = options;
+        d->output_dir = output_dir;
+        d->upshift = options->upshift;
+        d->fd = open_port(d->name);
+        if ( d->fd == -1 ) {
+            fprintf(stderr, "%s: cannot open the device\n", d->name);
+            d->state = DEVICE_FAILED;
+            d->closed = 1;
+            continue;
+        }
+        if ( baud_rate != 0 ) {
+            d->baud_rate = d->rate = baud_rate;
+            set_port_speed(d->fd, baud_rate);
+            d->state = DEVICE_CONFIG;
+        }
+        start_step(d);
+    }
+
+    while ( !interrupted ) {
+        double next = 0, now;
+        int n = 0, timeout, k;
+
+        for ( i = 0; i < count; i++ ) {
+            device* d = &devices[i];
+            if ( d->state >= DEVICE_DONE )
+                continue;
+            fds[n].fd = d->fd;
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            polled[n++] = i;
+            if ( next == 0 || d->deadline < next )
+                next = d->deadline;
+        }
+        if ( n == 0 )
+            break;
+
+        timeout = (int)((next - monotonic_time()) * 1000) + 1;
+        if ( poll(fds, n, timeout > 0 ? timeout : 0) < 0 && errno != EINTR )
+            break;
+
+        for ( k = 0; k < n; k++ ) {
+            device* d = &devices[polled[k]];
+            gbuint8 buf[INPUT_CHUNK];
+            int len;
+
+            if ( !(fds[k].revents & (POLLIN | POLLHUP | POLLERR)) )
+                continue;
+            len = read_available(d->fd, buf, sizeof(buf));
+            if ( len < 0 )
+                fail(d, "lost the connection");
+            else if ( len > 0 )
+                handle_input(d, buf, len);
+        }
+
+        now = monotonic_time();
+        for ( k = 0; k < n; k++ ) {
+            device* d = &devices[polled[k]];
+            if ( d->state < DEVICE_DONE && now >= d->deadline )
+                handle_timeout(d);
+        }
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        device* d = &devices[i];
+
+        if ( d->state < DEVICE_DONE ) {
+            /* interrupted, leave the device at its usual rate */
+            if ( d->rate != 0 && d->baud_rate != 0 && d->rate != d->baud_rate ) {
+                flush_input(d->fd);
+                skytraq_restore_speed(d->fd, d->rate, d->baud_rate);
+            }
+            close_device(d);
+        }
+        if ( d->state == DEVICE_DONE ) {
+            fprintf(stderr, "%s: %d sectors (%d failed, %d retries) at %u bps in %.1f s, written to %s\n",
+                    d->name, d->report.sectors, d->report.failed_sectors, d->report.retries,
+                    d->report.baud_rate, d->report.transfer_time, d->path);
+        } else {
+            failed++;
+        }
+        add_report(report, &d->report);
+        if ( d->fd != -1 )
+            close_port(d->fd);
+        free(d->path);
+    }
+
+    free(polled);
+    free(fds);
+    free(devices);
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    if ( interrupted )
+        raise(interrupted);
+
+    report->total_time = monotonic_time() - start;
+    return failed;
+}
@@ -0,0 +1,435 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "nmea.h"
+
+/*
+ * Parser for the NMEA sentences of the receiver: GGA, RMC, GSA, GSV and VTG
+ * from any talker. Numbers are converted digit by digit, without strtod()
+ * and without copying the fields; decimals are scaled with one exact power
+ * of ten, so the result is the same as strtod() for the digits the receiver
+ * sends.
+ */
+
+#define MAX_FIELDS          24
+#define MAX_DIGITS          18      /* still fit into 64 bits */
+
+typedef struct field {
+    const char* s;
+    int         length;
+} field;
+
+static const double powers_of_ten[MAX_DIGITS + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+void nmea_parser_init( nmea_parser* p ) {
+    memset(p, 0, sizeof(nmea_parser));
+    p->length = -1;
+}
+
+/**
+  * Read the digits of <f> with an optional sign and decimal point into
+  * <mantissa> and the number of digits after the point. Digits after the
+  * first MAX_DIGITS are dropped. Returns 0 for an empty field, ERROR if it
+  * is not a number.
+  */
+static int scan_number( const field* f, unsigned long long* mantissa, int* decimals, int* negative ) {
+    const char* s = f->s;
+    const char* end = s + f->length;
+    int digits = 0, point = 0;
+
+    *mantissa = 0;
+    *decimals = 0;
+    *negative = 0;
+    if ( s == end )
+        return 0;
+    if ( *s == '-' ) {
+        *negative = 1;
+        s++;
+    }
+    for ( ; s < end; s++ ) {
+        unsigned d = (unsigned)(*s - '0');
+
+        if ( d > 9 ) {
+            if ( *s != '.' || point )
+                return ERROR;
+            point = 1;
+        } else if ( digits < MAX_DIGITS ) {
+            *mantissa = *mantissa * 10 + d;
+            *decimals += point;
+            digits++;
+        } else if ( !point ) {
+            return ERROR; /* too large */
+        }
+    }
+    return digits > 0 ? 1 : ERROR;
+}
+
+static int parse_double( const field* f, double* value ) {
+    unsigned long long mantissa;
+    int decimals, negative;
+    int result = scan_number(f, &mantissa, &decimals, &negative);
+
+    if ( result > 0 ) {
+        *value = (double)mantissa / powers_of_ten[decimals];
+        if ( negative )
+            *value = -*value;
+    }
+    return result;
+}
+
+static int parse_int( const field* f, int* value ) {
+    unsigned long long mantissa;
+    int decimals, negative;
+    int result = scan_number(f, &mantissa, &decimals, &negative);
+
+    if ( result > 0 ) {
+        if ( decimals > 0 || mantissa > 0x7fffffff )
+            return ERROR;
+        *value = negative ? -(int)mantissa : (int)mantissa;
+    }
+    return result;
+}
+
+/**
+  * "dddmm.mmmm" and the hemisphere field to degrees.
+  */
+static int parse_coordinate( const field* f, const field* hemisphere, double* degrees ) {
+    unsigned long long mantissa, scale, whole;
+    int decimals, negative;
+    int result = scan_number(f, &mantissa, &decimals, &negative);
+
+    if ( result <= 0 )
+        return result;
+    if ( negative || hemisphere->length != 1 )
+        return ERROR;
+    scale = (unsigned long long)powers_of_ten[decimals];
+    whole = mantissa / scale;
+    if ( whole % 100 >= 60 )
+        return ERROR;
+    *degrees = whole / 100 + (whole % 100 + (double)(mantissa % scale) / scale) / 60;
+
+    if ( *hemisphere->s == 'S' || *hemisphere->s == 'W' )
+        *degrees = -*degrees;
+    else if ( *hemisphere->s != 'N' && *hemisphere->s != 'E' )
+        return ERROR;
+    return 1;
+}
+
+/**
+  * "hhmmss.sss" to ms since midnight.
+  */
+static int parse_time( const field* f, int* time_of_day ) {
+    unsigned long long mantissa, scale, hms;
+    int decimals, negative;
+    int result = scan_number(f, &mantissa, &decimals, &negative);
+
+    if ( result <= 0 )
+        return result;
+    scale = (unsigned long long)powers_of_ten[decimals];
+    hms = mantissa / scale;
+    if ( negative || hms / 10000 > 23 || hms / 100 % 100 > 59 || hms % 100 > 60 )
+        return ERROR;
+    *time_of_day = ((hms / 10000) * 3600 + (hms / 100 % 100) * 60 + hms % 100) * 1000 +
+                   (mantissa % scale) * 1000 / scale;
+    return 1;
+}
+
+static int two_digits( const char* s ) {
+    unsigned high = (unsigned)(s[0] - '0'), low = (unsigned)(s[1] - '0');
+
+    return high > 9 || low > 9 ? -1 : (int)(high * 10 + low);
+}
+
+/**
+  * "ddmmyy" to <rmc>.
+  */
+static int parse_date( const field* f, nmea_rmc* rmc ) {
+    if ( f->length == 0 )
+        return 0;
+    if ( f->length != 6 )
+        return ERROR;
+    rmc->day = two_digits(f->s);
+    rmc->month = two_digits(f->s + 2);
+    rmc->year = two_digits(f->s + 4);
+    if ( rmc->day < 1 || rmc->day > 31 || rmc->month < 1 || rmc->month > 12 || rmc->year < 0 )
+        return ERROR;
+    /* like the two digit years of the log entries */
+    rmc->year += rmc->year < 80 ? 2000 : 1900;
+    return 1;
+}
+
+static int hex_digit( char c ) {
+    if ( c >= '0' && c <= '9' )
+        return c - '0';
+    if ( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    if ( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    return -1;
+}
+
+static int parse_gga( const field* f, int n, nmea_sentence* out ) {
+    nmea_gga* gga = &out->data.gga;
+    int time, latitude, longitude, quality, satellites, hdop, altitude, separation = 0;
+
+    if ( n < 10 )
+        return NMEA_MALFORMED;
+    time = parse_time(&f[1], &out->time_of_day);
+    latitude = parse_coordinate(&f[2], &f[3], &gga->latitude);
+    longitude = parse_coordinate(&f[4], &f[5], &gga->longitude);
+    quality = parse_int(&f[6], &gga->quality);
+    satellites = parse_int(&f[7], &gga->satellites);
+    hdop = parse_double(&f[8], &gga->hdop);
+    altitude = parse_double(&f[9], &gga->altitude);
+    if ( n > 11 )
+        separation = parse_double(&f[11], &gga->geoid_separation);
+    if ( time < 0 || latitude < 0 || longitude < 0 || quality < 0 || satellites < 0 || hdop < 0 ||
+         altitude < 0 || separation < 0 )
+        return NMEA_MALFORMED;
+
+    out->fields = (time ? NMEA_HAS_TIME : 0) | (hdop ? NMEA_HAS_DOP : 0);
+    if ( latitude && longitude && gga->quality > 0 ) {
+        out->fields |= NMEA_HAS_POSITION;
+        if ( altitude )
+            out->fields |= NMEA_HAS_ALTITUDE;
+    }
+    return NMEA_GGA;
+}
+
+static int parse_rmc( const field* f, int n, nmea_sentence* out ) {
+    nmea_rmc* rmc = &out->data.rmc;
+    int time, latitude, longitude, speed, course, date;
+
+    if ( n < 10 )
+        return NMEA_MALFORMED;
+    time = parse_time(&f[1], &out->time_of_day);
+    rmc->valid = f[2].length == 1 && *f[2].s == 'A';
+    latitude = parse_coordinate(&f[3], &f[4], &rmc->latitude);
+    longitude = parse_coordinate(&f[5], &f[6], &rmc->longitude);
+    speed = parse_double(&f[7], &rmc->speed);
+    course = parse_double(&f[8], &rmc->course);
+    date = parse_date(&f[9], rmc);
+    if ( time < 0 || latitude < 0 || longitude < 0 || speed < 0 || course < 0 || date < 0 )
+        return NMEA_MALFORMED;
+
+    out->fields = (time ? NMEA_HAS_TIME : 0) | (date ? NMEA_HAS_DATE : 0);
+    if ( rmc->valid && latitude && longitude )
+        out->fields |= NMEA_HAS_POSITION;
+    /* the course is often left empty when standing still, it is 0 then */
+    if ( rmc->valid && speed )
+        out->fields |= NMEA_HAS_VELOCITY;
+    return NMEA_RMC;
+}
+
+static int parse_gsa( const field* f, int n, nmea_sentence* out ) {
+    nmea_gsa* gsa = &out->data.gsa;
+    int i, pdop, hdop, vdop;
+
+    if ( n < 18 || f[1].length != 1 || parse_int(&f[2], &gsa->fix_type) < 0 )
+        return NMEA_MALFORMED;
+    gsa->automatic = *f[1].s == 'A';
+    for ( i = 0; i < NMEA_GSA_SATELLITES; i++ ) {
+        int prn = parse_int(&f[3 + i], &gsa->satellites[gsa->count]);
+
+        if ( prn < 0 )
+            return NMEA_MALFORMED;
+        gsa->count += prn;
+    }
+    pdop = parse_double(&f[15], &gsa->pdop);
+    hdop = parse_double(&f[16], &gsa->hdop);
+    vdop = parse_double(&f[17], &gsa->vdop);
+    if ( pdop < 0 || hdop < 0 || vdop < 0 )
+        return NMEA_MALFORMED;
+    out->fields = pdop && hdop && vdop ? NMEA_HAS_DOP : 0;
+    return NMEA_GSA;
+}
+
+static int parse_gsv( const field* f, int n, nmea_sentence* out ) {
+    nmea_gsv* gsv = &out->data.gsv;
+    int i;
+
+    if ( n < 4 || parse_int(&f[1], &gsv->messages) <= 0 || parse_int(&f[2], &gsv->message) <= 0 ||
+         parse_int(&f[3], &gsv->in_view) < 0 )
+        return NMEA_MALFORMED;
+    for ( i = 4; i + 3 < n && gsv->count < NMEA_GSV_SATELLITES; i += 4 ) {
+        nmea_satellite* satellite = &gsv->satellites[gsv->count];
+
+        satellite->snr = -1;
+        if ( parse_int(&f[i], &satellite->prn) <= 0 || parse_int(&f[i + 1], &satellite->elevation) < 0 ||
+             parse_int(&f[i + 2], &satellite->azimuth) < 0 || parse_int(&f[i + 3], &satellite->snr) < 0 )
+            return NMEA_MALFORMED;
+        gsv->count++;
+    }
+    return NMEA_GSV;
+}
+
+static int parse_vtg( const field* f, int n, nmea_sentence* out ) {
+    nmea_vtg* vtg = &out->data.vtg;
+    int course, magnetic, knots, kmh;
+
+    if ( n < 9 )
+        return NMEA_MALFORMED;
+    course = parse_double(&f[1], &vtg->course);
+    magnetic = parse_double(&f[3], &vtg->magnetic_course);
+    knots = parse_double(&f[5], &vtg->speed_knots);
+    kmh = parse_double(&f[7], &vtg->speed_kmh);
+    if ( course < 0 || magnetic < 0 || knots < 0 || kmh < 0 )
+        return NMEA_MALFORMED;
+    out->fields = kmh ? NMEA_HAS_VELOCITY : 0;
+    return NMEA_VTG;
+}
+
+/**
+  * Parse one sentence from the '$' up to the checksum, without the line end.
+  * Returns the type or NMEA_IGNORED, NMEA_BAD_CHECKSUM or NMEA_MALFORMED;
+  * <sentence> is only valid for a type.
+  */
+int nmea_parse_sentence( const char* line, int length, nmea_sentence* sentence ) {
+    field f[MAX_FIELDS];
+    gbuint8 checksum = 0;
+    int i, n = 0, start = 1, high, low;
+
+    if ( length < 10 || line[0] != '$' || line[length - 3] != '*' )
+        return NMEA_MALFORMED;
+    high = hex_digit(line[length - 2]);
+    low = hex_digit(line[length - 1]);
+    if ( high < 0 || low < 0 )
+        return NMEA_MALFORMED;
+
+    /* checksum and fields in one pass */
+    for ( i = 1; i < length - 3; i++ ) {
+        checksum ^= line[i];
+        if ( line[i] == ',' && n < MAX_FIELDS - 1 ) {
+            f[n].s = line + start;
+            f[n++].length = i - start;
+            start = i + 1;
+        }
+    }
+    f[n].s = line + start;
+    f[n++].length = length - 3 - start;
+    if ( checksum != (high << 4 | low) )
+        return NMEA_BAD_CHECKSUM;
+
+    /* "GPGGA": talker and type */
+    if ( f[0].length != 5 || f[0].s[0] == 'P' )
+        return NMEA_IGNORED;
+    sentence->talker[0] = f[0].s[0];
+    sentence->talker[1] = f[0].s[1];
+    sentence->talker[2] = 0;
+    sentence->fields = 0;
+    sentence->time_of_day = -1;
+    memset(&sentence->data, 0, sizeof(sentence->data));
+
+    if ( !memcmp(f[0].s + 2, "GGA", 3) )
+        return sentence->type = parse_gga(f, n, sentence);
+    if ( !memcmp(f[0].s + 2, "RMC", 3) )
+        return sentence->type = parse_rmc(f, n, sentence);
+    if ( !memcmp(f[0].s + 2, "GSA", 3) )
+        return sentence->type = parse_gsa(f, n, sentence);
+    if ( !memcmp(f[0].s + 2, "GSV", 3) )
+        return sentence->type = parse_gsv(f, n, sentence);
+    if ( !memcmp(f[0].s + 2, "VTG", 3) )
+        return sentence->type = parse_vtg(f, n, sentence);
+    return NMEA_IGNORED;
+}
+
+static void handle_line( nmea_parser* p, const char* line, int length, nmea_callback callback, void* context ) {
+    nmea_sentence sentence;
+
+    switch ( nmea_parse_sentence(line, length, &sentence) ) {
+    case NMEA_MALFORMED:
+        p->malformed++;
+        break;
+    case NMEA_BAD_CHECKSUM:
+        p->checksum_errors++;
+        break;
+    case NMEA_IGNORED:
+        p->ignored++;
+        break;
+    default:
+        p->sentences++;
+        callback(&sentence, context);
+    }
+}
+
+/* the end of the sentence starting before <s>: a line end or the next '$' */
+static const char* line_end( const char* s, const char* end ) {
+    while ( s < end && *s != '\r' && *s != '\n' && *s != '$' )
+        s++;
+    return s;
+}
+
+/**
+  * Hand every sentence in <data> to <callback>. Anything between sentences,
+  * e.g. binary packages, is skipped.
+  */
+void nmea_parse( nmea_parser* p, const gbuint8* data, unsigned length, nmea_callback callback, void* context ) {
+    const char* s = (const char*)data;
+    const char* end = s + length;
+
+    while ( s < end ) {
+        const char* e;
+
+        if ( p->length < 0 ) {
+            s = memchr(s, '$', end - s);
+            if ( s == NULL )
+                return;
+            e = line_end(s + 1, end);
+            if ( e - s > NMEA_MAX_LENGTH ) {
+                p->malformed++;
+                s = e;
+            } else if ( e == end ) {
+                /* the rest arrives with the next piece */
+                p->length = e - s;
+                memcpy(p->line, s, p->length);
+                return;
+            } else if ( *e == '$' ) {
+                p->malformed++;
+                s = e;
+            } else {
+                handle_line(p, s, e - s, callback, context);
+                s = e + 1;
+            }
+        } else {
+            e = line_end(s, end);
+            if ( p->length + (e - s) > NMEA_MAX_LENGTH ) {
+                p->malformed++;
+                p->length = -1;
+                s = e;
+            } else {
+                memcpy(p->line + p->length, s, e - s);
+                p->length += e - s;
+                if ( e == end )
+                    return;
+                if ( *e == '$' )
+                    p->malformed++;
+                else
+                    handle_line(p, p->line, p->length, callback, context);
+                p->length = -1;
+                s = *e == '$' ? e : e + 1;
+            }
+        }
+    }
+}
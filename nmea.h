@@ -0,0 +1,132 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef nmea_h
+#define nmea_h
+
+/* the longest NMEA sentence accepted, the standard allows 82 characters */
+#define NMEA_MAX_LENGTH     120
+/* satellites in a GSA sentence, in a GSV sentence */
+#define NMEA_GSA_SATELLITES 12
+#define NMEA_GSV_SATELLITES 4
+
+/* sentence types; nmea_parse_sentence() returns one of them or a result below 1 */
+enum { NMEA_MALFORMED = -2, NMEA_BAD_CHECKSUM, NMEA_IGNORED,
+       NMEA_GGA, NMEA_RMC, NMEA_GSA, NMEA_GSV, NMEA_VTG };
+
+/* which values of a sentence were not empty */
+#define NMEA_HAS_TIME       0x01
+#define NMEA_HAS_POSITION   0x02
+#define NMEA_HAS_ALTITUDE   0x04
+#define NMEA_HAS_VELOCITY   0x08    /* speed, the course may be empty (0) */
+#define NMEA_HAS_DATE       0x10
+#define NMEA_HAS_DOP        0x20
+
+/* GGA: position and quality of the fix */
+typedef struct nmea_gga {
+    double  latitude;           /* degrees */
+    double  longitude;
+    double  hdop;
+    double  altitude;           /* meters above mean sea level */
+    double  geoid_separation;   /* meters */
+    int     quality;            /* 0 no fix, 1 GPS, 2 DGPS, ... */
+    int     satellites;         /* used in the fix */
+} nmea_gga;
+
+/* RMC: recommended minimum, position, velocity and date */
+typedef struct nmea_rmc {
+    double  latitude;
+    double  longitude;
+    double  speed;              /* knots */
+    double  course;             /* degrees from north */
+    int     valid;              /* status 'A' */
+    int     day, month, year;   /* year with century */
+} nmea_rmc;
+
+/* GSA: satellites used and dilution of precision */
+typedef struct nmea_gsa {
+    double  pdop, hdop, vdop;
+    int     automatic;          /* 'A' or 'M' */
+    int     fix_type;           /* 1 none, 2 2D, 3 3D */
+    int     count;
+    int     satellites[NMEA_GSA_SATELLITES];
+} nmea_gsa;
+
+typedef struct nmea_satellite {
+    int     prn;
+    int     elevation;          /* degrees */
+    int     azimuth;            /* degrees */
+    int     snr;                /* dB-Hz, -1 if not tracked */
+} nmea_satellite;
+
+/* GSV: one part of the list of satellites in view */
+typedef struct nmea_gsv {
+    int             messages;   /* parts of the list */
+    int             message;    /* this part, 1 ... messages */
+    int             in_view;
+    int             count;      /* satellites in this part */
+    nmea_satellite  satellites[NMEA_GSV_SATELLITES];
+} nmea_gsv;
+
+/* VTG: course and speed over ground */
+typedef struct nmea_vtg {
+    double  course;             /* degrees from true north */
+    double  magnetic_course;
+    double  speed_knots;
+    double  speed_kmh;
+} nmea_vtg;
+
+typedef struct nmea_sentence {
+    int     type;               /* NMEA_GGA, ... */
+    char    talker[3];          /* "GP", "GN", ... */
+    int     fields;             /* NMEA_HAS_* */
+    int     time_of_day;        /* ms since midnight UTC, GGA and RMC */
+    union {
+        nmea_gga    gga;
+        nmea_rmc    rmc;
+        nmea_gsa    gsa;
+        nmea_gsv    gsv;
+        nmea_vtg    vtg;
+    } data;
+} nmea_sentence;
+
+/*
+ * Finds the sentences in a stream of bytes. Sentences that arrive in one
+ * piece are parsed where they are, only a sentence split between two calls
+ * is collected in <line>.
+ */
+typedef struct nmea_parser {
+    char            line[NMEA_MAX_LENGTH + 1];
+    int             length;             /* -1 while not inside a sentence */
+    unsigned long   sentences;          /* parsed and handed to the callback */
+    unsigned long   checksum_errors;
+    unsigned long   malformed;          /* too long, missing fields or bad numbers */
+    unsigned long   ignored;            /* other sentence types */
+} nmea_parser;
+
+typedef void (*nmea_callback)( const nmea_sentence* sentence, void* context );
+
+void nmea_parser_init( nmea_parser* p );
+void nmea_parse( nmea_parser* p, const gbuint8* data, unsigned length, nmea_callback callback, void* context );
+int nmea_parse_sentence( const char* line, int length, nmea_sentence* sentence );
+
+#endif
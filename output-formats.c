@@ -0,0 +1,212 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "output-writer.h"
+#include <stdint.h>
+
+/* GPX 1.0, one track with a segment for each part of the recording */
+
+static void gpx_header( output_writer* w ) {
+    output_write_string(w, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    output_write_string(w, "<gpx xmlns=\"http://www.topografix.com/GPX/1/0\" creator=\"skytraq-datalogger\" version=\"1.0\">\n");
+    output_write_string(w, "<trk>\n<trkseg>\n");
+}
+
+static void gpx_sector( output_writer* w ) {
+    output_write_string(w, "<!-- next sector -->\n");
+}
+
+static void gpx_point( output_writer* w, const output_point* p ) {
+    if ( p->new_segment )
+        output_write_string(w, "</trkseg>\n<trkseg>\n");
+    output_write_string(w, " <trkpt lat=\"");
+    output_write_double(w, p->latitude);
+    output_write_string(w, "\" lon=\"");
+    output_write_double(w, p->longitude);
+    output_write_string(w, "\"><ele>");
+    output_write_double(w, p->height);
+    output_write_string(w, "</ele><time>");
+    output_write_timestamp(w, p->time);
+    output_write_string(w, "</time><speed>");
+    output_write_int(w, p->speed);
+    output_write_string(w, "</speed></trkpt>\n");
+}
+
+static void gpx_footer( output_writer* w ) {
+    output_write_string(w, "</trkseg>\n</trk>\n</gpx>\n");
+}
+
+/* CSV, one line per point */
+
+static void csv_header( output_writer* w ) {
+    output_write_string(w, "time,latitude,longitude,height,speed,new_segment\n");
+}
+
+static void csv_point( output_writer* w, const output_point* p ) {
+    output_write_timestamp(w, p->time);
+    output_write_string(w, ",");
+    output_write_double(w, p->latitude);
+    output_write_string(w, ",");
+    output_write_double(w, p->longitude);
+    output_write_string(w, ",");
+    output_write_double(w, p->height);
+    output_write_string(w, ",");
+    output_write_int(w, p->speed);
+    output_write_string(w, p->new_segment ? ",1\n" : ",0\n");
+}
+
+/* GeoJSON feature collection with a point feature for each point */
+
+/* JSON has no NaN or infinity */
+static void json_double( output_writer* w, double value ) {
+    if ( isfinite(value) )
+        output_write_double(w, value);
+    else
+        output_write_string(w, "null");
+}
+
+static void geojson_header( output_writer* w ) {
+    output_write_string(w, "{\"type\":\"FeatureCollection\",\"features\":[\n");
+}
+
+static void geojson_point( output_writer* w, const output_point* p ) {
+    if ( w->points > 0 )
+        output_write_string(w, ",\n");
+    output_write_string(w, "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[");
+    json_double(w, p->longitude);
+    output_write_string(w, ",");
+    json_double(w, p->latitude);
+    output_write_string(w, ",");
+    json_double(w, p->height);
+    output_write_string(w, "]},\"properties\":{\"time\":\"");
+    output_write_timestamp(w, p->time);
+    output_write_string(w, "\",\"speed\":");
+    output_write_int(w, p->speed);
+    output_write_string(w, p->new_segment ? ",\"new_segment\":true}}" : ",\"new_segment\":false}}");
+}
+
+static void geojson_footer( output_writer* w ) {
+    output_write_string(w, "\n]}\n");
+}
+
+/* KML, a line string for each part of the recording */
+
+#define KML_LINE_START "<Placemark>\n<LineString>\n<altitudeMode>absolute</altitudeMode>\n<coordinates>\n"
+#define KML_LINE_END "</coordinates>\n</LineString>\n</Placemark>\n"
+
+static void kml_header( output_writer* w ) {
+    output_write_string(w, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    output_write_string(w, "<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n<Document>\n");
+    output_write_string(w, "<name>skytraq-datalogger</name>\n");
+    output_write_string(w, KML_LINE_START);
+}
+
+static void kml_point( output_writer* w, const output_point* p ) {
+    if ( p->new_segment )
+        output_write_string(w, KML_LINE_END KML_LINE_START);
+    output_write_double(w, p->longitude);
+    output_write_string(w, ",");
+    output_write_double(w, p->latitude);
+    output_write_string(w, ",");
+    output_write_double(w, p->height);
+    output_write_string(w, "\n");
+}
+
+static void kml_footer( output_writer* w ) {
+    output_write_string(w, KML_LINE_END "</Document>\n</kml>\n");
+}
+
+/*
+ * Binary: a 16 byte header ("STQTRACK", version and record size as 32 bit
+ * integers) followed by one 40 byte record per point, all little-endian:
+ *   int64  time (seconds since 1970, UTC)
+ *   double latitude, longitude (degrees), height (meters)
+ *   uint16 speed (km/h)
+ *   uint16 flags (bit 0: new track segment)
+ *   uint32 reserved
+ */
+#define BINARY_VERSION 1
+#define BINARY_RECORD_SIZE 40
+
+static gbuint8* put_le( gbuint8* p, uint64_t value, int bytes ) {
+    int i;
+
+    for ( i = 0; i < bytes; i++ )
+        p[i] = value >> (8 * i);
+    return p + bytes;
+}
+
+static gbuint8* put_double( gbuint8* p, double value ) {
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return put_le(p, bits, 8);
+}
+
+static void binary_header( output_writer* w ) {
+    gbuint8 header[16];
+
+    memcpy(header, "STQTRACK", 8);
+    put_le(header + 8, BINARY_VERSION, 4);
+    put_le(header + 12, BINARY_RECORD_SIZE, 4);
+    output_write_bytes(w, header, sizeof(header));
+}
+
+static void binary_point( output_writer* w, const output_point* p ) {
+    gbuint8 record[BINARY_RECORD_SIZE];
+    gbuint8* r = record;
+
+    r = put_le(r, (int64_t)p->time, 8);
+    r = put_double(r, p->latitude);
+    r = put_double(r, p->longitude);
+    r = put_double(r, p->height);
+    r = put_le(r, p->speed, 2);
+    r = put_le(r, p->new_segment ? 1 : 0, 2);
+    put_le(r, 0, 4);
+    output_write_bytes(w, record, sizeof(record));
+}
+
+static const output_format formats[] = {
+    { "gpx", gpx_header, gpx_sector, gpx_point, gpx_footer },
+    { "csv", csv_header, NULL, csv_point, NULL },
+    { "geojson", geojson_header, NULL, geojson_point, geojson_footer },
+    { "kml", kml_header, NULL, kml_point, kml_footer },
+    { "binary", binary_header, NULL, binary_point, NULL },
+};
+
+#define FORMAT_COUNT (int)(sizeof(formats) / sizeof(output_format))
+
+/**
+  * Look up an output format by name, NULL if there is none. NULL as name
+  * selects GPX.
+  */
+const output_format* output_format_find( const char* name ) {
+    int i;
+
+    if ( name == NULL )
+        return &formats[0];
+    for ( i = 0; i < FORMAT_COUNT; i++ ) {
+        if ( !strcmp(formats[i].name, name) )
+            return &formats[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,229 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "output-writer.h"
+
+/* space needed for the longest item written in one piece */
+#define ITEM_SPACE 512
+
+static const double powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+static const unsigned long long integer_powers_of_ten[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+    100000000ull, 1000000000ull
+};
+
+/**
+  * Set up <w> to write to <out> in <format> with <precision> digits after the
+  * decimal point.
+  */
+void output_writer_init( output_writer* w, FILE* out, const output_format* format, int precision ) {
+    if ( precision < 0 )
+        precision = 0;
+    if ( precision > OUTPUT_MAX_PRECISION )
+        precision = OUTPUT_MAX_PRECISION;
+
+    w->out = out;
+    w->format = format;
+    w->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    w->length = 0;
+    w->precision = precision;
+    w->points = 0;
+    w->from = LONG_MIN;
+    w->to = LONG_MAX;
+    w->day = -1;
+    w->date[0] = 0;
+}
+
+/**
+  * Hand the buffered text to the stream. Call this before writing anything else
+  * to the stream.
+  */
+void output_writer_flush( output_writer* w ) {
+    if ( w->length > 0 )
+        fwrite(w->buffer, 1, w->length, w->out);
+    w->length = 0;
+}
+
+void output_writer_close( output_writer* w ) {
+    output_writer_flush(w);
+    free(w->buffer);
+    w->buffer = NULL;
+}
+
+static char* reserve( output_writer* w, size_t length ) {
+    if ( w->length + length > OUTPUT_BUFFER_SIZE )
+        output_writer_flush(w);
+    return w->buffer + w->length;
+}
+
+void output_header( output_writer* w ) {
+    if ( w->format->header != NULL )
+        w->format->header(w);
+}
+
+void output_sector( output_writer* w ) {
+    if ( w->format->sector != NULL )
+        w->format->sector(w);
+}
+
+/**
+  * Only write the points recorded between <from> and <to>, both included.
+  * LONG_MIN and LONG_MAX leave that side of the window open.
+  */
+void output_writer_window( output_writer* w, long from, long to ) {
+    w->from = from;
+    w->to = to;
+}
+
+int output_in_window( const output_writer* w, long time ) {
+    return time >= w->from && time <= w->to;
+}
+
+void output_track_point( output_writer* w, const output_point* p ) {
+    if ( !output_in_window(w, p->time) )
+        return;
+    w->format->point(w, p);
+    w->points++;
+}
+
+void output_footer( output_writer* w ) {
+    if ( w->format->footer != NULL )
+        w->format->footer(w);
+}
+
+void output_write_bytes( output_writer* w, const void* data, size_t length ) {
+    if ( length > OUTPUT_BUFFER_SIZE ) {
+        output_writer_flush(w);
+        fwrite(data, 1, length, w->out);
+        return;
+    }
+    memcpy(reserve(w, length), data, length);
+    w->length += length;
+}
+
+void output_write_string( output_writer* w, const char* s ) {
+    output_write_bytes(w, s, strlen(s));
+}
+
+/* writes the decimal digits of <value>, returns the end */
+static char* put_digits( char* p, unsigned long long value, int min_digits ) {
+    char digits[24];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while ( value > 0 );
+    while ( n < min_digits )
+        digits[n++] = '0';
+    while ( n > 0 )
+        *p++ = digits[--n];
+    return p;
+}
+
+/**
+  * Write <value> like printf("%.*f") does. The scaled value is rounded directly
+  * unless it is too large or so close to a tie that the rounding error of the
+  * multiplication could change the result; then printf does the job.
+  */
+void output_write_double( output_writer* w, double value ) {
+    char* start = reserve(w, ITEM_SPACE);
+    char* p = start;
+    int precision = w->precision;
+    double scaled, rounded;
+    unsigned long long m;
+
+    if ( precision < (int)(sizeof(powers_of_ten)/sizeof(double)) ) {
+        scaled = fabs(value) * powers_of_ten[precision];
+        /* below 2^40 the multiplication is off by less than 2^-12 */
+        if ( scaled < 1099511627776.0 ) {
+            rounded = floor(scaled);
+            if ( fabs(scaled - rounded - 0.5) > 0.001 ) {
+                m = (unsigned long long)rounded;
+                if ( scaled - rounded > 0.5 )
+                    m++;
+
+                if ( signbit(value) )
+                    *p++ = '-';
+                p = put_digits(p, m / integer_powers_of_ten[precision], 1);
+                if ( precision > 0 ) {
+                    *p++ = '.';
+                    p = put_digits(p, m % integer_powers_of_ten[precision], precision);
+                }
+                w->length += p - start;
+                return;
+            }
+        }
+    }
+
+    w->length += snprintf(start, ITEM_SPACE, "%.*f", precision, value);
+}
+
+void output_write_int( output_writer* w, long value ) {
+    char* start = reserve(w, ITEM_SPACE);
+    char* p = start;
+
+    if ( value < 0 ) {
+        *p++ = '-';
+        p = put_digits(p, -(unsigned long long)value, 1);
+    } else {
+        p = put_digits(p, value, 1);
+    }
+    w->length += p - start;
+}
+
+/**
+  * Write <timestamp> in ISO 8601 format (UTC), e.g. 2008-10-16T14:55:29Z. The
+  * date is only formatted again when the day changes.
+  */
+void output_write_timestamp( output_writer* w, long timestamp ) {
+    long day = timestamp / 86400, seconds = timestamp % 86400;
+    char* p;
+
+    if ( seconds < 0 ) {
+        seconds += 86400;
+        day--;
+    }
+
+    if ( day != w->day ) {
+        struct tm tm_buf;
+        time_t t = timestamp;
+        struct tm *tm = gmtime_r(&t, &tm_buf);
+
+        snprintf(w->date, sizeof(w->date), "%02d-%02d-%02dT",
+                 tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday);
+        w->day = day;
+    }
+
+    output_write_string(w, w->date);
+    p = reserve(w, 9);
+    p[0] = '0' + seconds / 36000;
+    p[1] = '0' + seconds / 3600 % 10;
+    p[2] = ':';
+    p[3] = '0' + seconds % 3600 / 600;
+    p[4] = '0' + seconds % 3600 / 60 % 10;
+    p[5] = ':';
+    p[6] = '0' + seconds % 60 / 10;
+    p[7] = '0' + seconds % 10;
+    p[8] = 'Z';
+    w->length += 9;
+}
@@ -0,0 +1,88 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef output_writer_h
+#define output_writer_h
+
+#define OUTPUT_BUFFER_SIZE 65536
+#define OUTPUT_DEFAULT_PRECISION 6
+#define OUTPUT_MAX_PRECISION 17
+
+/* a track point as handed to the output formats */
+typedef struct output_point {
+    long    time;
+    double  latitude;       /* degrees */
+    double  longitude;      /* degrees */
+    double  height;         /* meters */
+    int     speed;          /* km/h */
+    int     new_segment;    /* more than an hour after the previous point */
+} output_point;
+
+typedef struct output_writer output_writer;
+
+/* an output format; header, sector and footer may be NULL */
+typedef struct output_format {
+    const char* name;
+    void        (*header)( output_writer* w );
+    void        (*sector)( output_writer* w );   /* a new flash sector begins */
+    void        (*point)( output_writer* w, const output_point* p );
+    void        (*footer)( output_writer* w );
+} output_format;
+
+/*
+ * Output buffer for the track. The text is collected in a large buffer and
+ * handed to the stream in big pieces; numbers and timestamps are formatted
+ * without printf.
+ */
+struct output_writer {
+    FILE*                   out;
+    const output_format*    format;
+    char*                   buffer;
+    size_t                  length;
+    int                     precision;  /* digits after the decimal point */
+    long                    points;     /* points written so far */
+    long                    from;       /* points before are dropped, LONG_MIN for no limit */
+    long                    to;         /* points after are dropped, LONG_MAX for no limit */
+    long                    day;        /* day of the cached date, -1 if none */
+    char                    date[40];   /* "2008-10-16T" */
+};
+
+const output_format* output_format_find( const char* name );
+
+void output_writer_init( output_writer* w, FILE* out, const output_format* format, int precision );
+void output_writer_flush( output_writer* w );
+void output_writer_close( output_writer* w );
+void output_writer_window( output_writer* w, long from, long to );
+int output_in_window( const output_writer* w, long time );
+
+void output_header( output_writer* w );
+void output_sector( output_writer* w );
+void output_track_point( output_writer* w, const output_point* p );
+void output_footer( output_writer* w );
+
+void output_write_bytes( output_writer* w, const void* data, size_t length );
+void output_write_string( output_writer* w, const char* s );
+void output_write_double( output_writer* w, double value );
+void output_write_int( output_writer* w, long value );
+void output_write_timestamp( output_writer* w, long timestamp );
+
+#endif
@@ -0,0 +1,253 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "datalog-decode.h"
+#include <pthread.h>
+
+/* amount of log data decoded as one piece of work */
+#define CHUNK_SIZE (16 * SKYTRAQ_SECTOR_SIZE)
+
+/*
+ * A run of log entries that can be decoded independently: it starts at the
+ * beginning of a sector or at a long entry, both of which set the position
+ * and time from scratch. The state in front of it is only needed for the
+ * timestamp that decides about splitting the track segment.
+ */
+typedef struct decode_chunk {
+    int             sector;     /* where the chunk starts */
+    int             offset;
+    decode_state    state;      /* decoder state in front of the chunk */
+    long            points;     /* track points in front of the chunk */
+    int             end_sector; /* where the next chunk starts */
+    int             end_offset;
+    decode_stats    stats;      /* found while decoding the chunk */
+    char*           output;
+    size_t          output_size;
+    int             done;
+    int             failed;     /* no memory for the output */
+} decode_chunk;
+
+typedef struct decode_job {
+    const gbuint8* const*   sectors;
+    const int*              lengths;
+    int                     count;
+    const output_writer*    output;     /* format, precision and time window */
+    decode_chunk*           chunks;
+    int                     chunk_count;
+    int                     next_chunk;
+    pthread_mutex_t         lock;
+    pthread_cond_t          chunk_done;
+} decode_job;
+
+/**
+  * Find the chunk boundaries. This walks over all entries like the decoder does
+  * but without the expensive coordinate conversion and output, starting with
+  * <*st>. Returns the state after the last sector.
+  */
+static decode_state split_chunks( decode_job* job, const decode_state* start ) {
+    decode_state st = *start;
+    long points = 0;
+    int s, bytes = 0, capacity = 16;
+
+    job->chunks = malloc(capacity * sizeof(decode_chunk));
+    job->chunk_count = 0;
+
+    for ( s = 0; s < job->count; s++ ) {
+        int offset = 0;
+
+        decode_start_sector(&st, st.last_timestamp);
+
+        for (;;) {
+            if ( job->chunk_count == 0 || (bytes >= CHUNK_SIZE && (offset == 0 || (job->sectors[s][offset] & 0x40))) ) {
+                decode_chunk* c;
+                if ( job->chunk_count == capacity ) {
+                    capacity *= 2;
+                    job->chunks = realloc(job->chunks, capacity * sizeof(decode_chunk));
+                }
+                c = &job->chunks[job->chunk_count++];
+                memset(c, 0, sizeof(decode_chunk));
+                c->sector = s;
+                c->offset = offset;
+                c->state = st;
+                c->points = points;
+                bytes = 0;
+            }
+
+            if ( offset >= job->lengths[s] )
+                break;
+
+            {
+                int start = offset;
+                if ( decode_entry(job->sectors[s], &offset, job->lengths[s], &st, NULL) &&
+                        output_in_window(job->output, st.time) )
+                    points++;
+                bytes += offset - start;
+            }
+        }
+    }
+
+    for ( s = 0; s < job->chunk_count; s++ ) {
+        if ( s + 1 < job->chunk_count ) {
+            job->chunks[s].end_sector = job->chunks[s+1].sector;
+            job->chunks[s].end_offset = job->chunks[s+1].offset;
+        } else {
+            job->chunks[s].end_sector = job->count;
+            job->chunks[s].end_offset = 0;
+        }
+    }
+
+    return st;
+}
+
+static void decode_chunk_to( output_writer* w, const decode_job* job, decode_chunk* c ) {
+    decode_state st = c->state;
+    int s;
+
+    memset(&st.stats, 0, sizeof(decode_stats));
+
+    for ( s = c->sector; s < job->count && (s < c->end_sector || (s == c->end_sector && c->end_offset > 0)); s++ ) {
+        int offset = ( s == c->sector ) ? c->offset : 0;
+        int end = ( s == c->end_sector ) ? c->end_offset : job->lengths[s];
+
+        if ( offset == 0 ) {
+            output_sector(w);
+            decode_start_sector(&st, st.last_timestamp);
+        }
+        decode_entries(w, job->sectors[s], offset, end, &st);
+    }
+    c->stats = st.stats;
+}
+
+static void* decode_worker( void* arg ) {
+    decode_job* job = arg;
+
+    for (;;) {
+        decode_chunk* c;
+        output_writer w;
+        FILE* out;
+
+        pthread_mutex_lock(&job->lock);
+        if ( job->next_chunk == job->chunk_count ) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        c = &job->chunks[job->next_chunk++];
+        pthread_mutex_unlock(&job->lock);
+
+        c->output = NULL;
+        out = open_memstream(&c->output, &c->output_size);
+        if ( out != NULL ) {
+            output_writer_init(&w, out, job->output->format, job->output->precision);
+            output_writer_window(&w, job->output->from, job->output->to);
+            w.points = c->points;
+            decode_chunk_to(&w, job, c);
+            output_writer_close(&w);
+            c->failed = fclose(out) != 0;
+        } else {
+            c->failed = 1;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        c->done = 1;
+        pthread_cond_broadcast(&job->chunk_done);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+/**
+  * Decode <count> sectors like consecutive calls of process_buffer_to() would,
+  * using <threads> threads. The output is written to <w> in order while
+  * later chunks are still being decoded. <st> is updated as if the sectors
+  * had been decoded one after the other. Returns ERROR if the output of a
+  * chunk could not be buffered; it is missing then.
+  */
+int process_buffer_parallel( output_writer* w, const gbuint8* const* sectors, const int* lengths, int count,
+                             decode_state* st, int threads ) {
+    decode_job job;
+    pthread_t* workers;
+    decode_state end;
+    int i, started = 0, result = SUCCESS;
+
+    if ( threads <= 1 ) {
+        for ( i = 0; i < count; i++ )
+            process_buffer_to(w, sectors[i], lengths[i], st);
+        return SUCCESS;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.sectors = sectors;
+    job.lengths = lengths;
+    job.count = count;
+    job.output = w;
+    end = split_chunks(&job, st);
+    end.stats = st->stats;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.chunk_done, NULL);
+
+    if ( threads > job.chunk_count )
+        threads = job.chunk_count;
+    workers = malloc(threads * sizeof(pthread_t));
+    for ( i = 0; i < threads; i++ ) {
+        if ( pthread_create(&workers[started], NULL, decode_worker, &job) == 0 )
+            started++;
+    }
+    if ( started == 0 ) {
+        /* no threads available, do it here */
+        decode_worker(&job);
+    }
+
+    for ( i = 0; i < job.chunk_count; i++ ) {
+        decode_chunk* c = &job.chunks[i];
+
+        pthread_mutex_lock(&job.lock);
+        while ( !c->done )
+            pthread_cond_wait(&job.chunk_done, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+
+        if ( c->failed ) {
+            result = ERROR;
+        } else {
+            output_writer_flush(w);
+            fwrite(c->output, 1, c->output_size, w->out);
+        }
+        free(c->output);
+
+        end.stats.long_entries += c->stats.long_entries;
+        end.stats.short_entries += c->stats.short_entries;
+        end.stats.skipped_bytes += c->stats.skipped_bytes;
+        end.stats.erased_bytes += c->stats.erased_bytes;
+        end.stats.linearized += c->stats.linearized;
+    }
+
+    for ( i = 0; i < started; i++ )
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    free(job.chunks);
+    pthread_cond_destroy(&job.chunk_done);
+    pthread_mutex_destroy(&job.lock);
+
+    *st = end;
+    return result;
+}
@@ -0,0 +1,362 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "sector-cache.h"
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define WR_PTR_FILE "log_wr_ptr"
+#define TIMES_FILE  "time-index"
+#define FINGERPRINT_FILE "fingerprint"
+
+/**
+  * $XDG_CACHE_HOME/skytraq-datalogger or ~/.cache/skytraq-datalogger.
+  * You have to free() the result.
+  */
+char* sector_cache_default_dir( void ) {
+    const char* base = getenv("XDG_CACHE_HOME");
+    const char* sub = "skytraq-datalogger";
+    char* dir;
+
+    if ( base != NULL && *base ) {
+        dir = malloc(strlen(base) + strlen(sub) + 2);
+        sprintf(dir, "%s/%s", base, sub);
+    } else {
+        base = getenv("HOME");
+        if ( base == NULL )
+            base = ".";
+        dir = malloc(strlen(base) + strlen(sub) + 9);
+        sprintf(dir, "%s/.cache/%s", base, sub);
+    }
+    return dir;
+}
+
+/* mkdir -p */
+static int make_dirs( char* path ) {
+    char* p;
+    for ( p = path + 1; *p; p++ ) {
+        if ( *p == '/' ) {
+            *p = 0;
+            if ( mkdir(path, 0755) != 0 && errno != EEXIST ) {
+                *p = '/';
+                return ERROR;
+            }
+            *p = '/';
+        }
+    }
+    if ( mkdir(path, 0755) != 0 && errno != EEXIST )
+        return ERROR;
+    return SUCCESS;
+}
+
+static char* cache_file( const sector_cache* cache, const char* name ) {
+    char* path = malloc(strlen(cache->dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", cache->dir, name);
+    return path;
+}
+
+static char* sector_file( const sector_cache* cache, int sector ) {
+    char name[20];
+    snprintf(name, sizeof(name), "%04d.sector", sector);
+    return cache_file(cache, name);
+}
+
+/**
+  * Write a file atomically: to a temporary file first that is renamed.
+  */
+static int write_file( const char* path, const void* data, int length ) {
+    char* tmp = malloc(strlen(path) + 5);
+    FILE* f;
+    int ok;
+
+    sprintf(tmp, "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if ( f == NULL ) {
+        free(tmp);
+        return ERROR;
+    }
+    ok = fwrite(data, 1, length, f) == length;
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if ( !ok )
+        unlink(tmp);
+    free(tmp);
+    return ok ? SUCCESS : ERROR;
+}
+
+/**
+  * Remove all sectors and the time index, used when the log has been erased
+  * or has wrapped around.
+  */
+static void invalidate( sector_cache* cache ) {
+    DIR* dir = opendir(cache->dir);
+    struct dirent* entry;
+    char* path;
+
+    path = cache_file(cache, TIMES_FILE);
+    unlink(path);
+    free(path);
+
+    if ( cache->times != NULL ) {
+        memset(cache->times, 0, (cache->final_sectors + 1) * sizeof(sector_times));
+        cache->times_changed = 0;
+    }
+
+    if ( dir == NULL )
+        return;
+
+    while ( (entry = readdir(dir)) != NULL ) {
+        if ( strstr(entry->d_name, ".sector") != NULL ) {
+            path = cache_file(cache, entry->d_name);
+            unlink(path);
+            free(path);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+  * Read the time index, one "sector first last" line per sector. Lines for
+  * sectors that are not final (anymore) are ignored.
+  */
+static void load_times( sector_cache* cache ) {
+    char* path = cache_file(cache, TIMES_FILE);
+    FILE* f;
+    int sector;
+    long first, last;
+
+    cache->times = calloc(cache->final_sectors + 1, sizeof(sector_times));
+    cache->times_changed = 0;
+
+    f = fopen(path, "r");
+    if ( f != NULL ) {
+        while ( fscanf(f, "%d %ld %ld", &sector, &first, &last) == 3 ) {
+            if ( sector >= 0 && sector < cache->final_sectors && last > 0 ) {
+                cache->times[sector].first = first;
+                cache->times[sector].last = last;
+            }
+        }
+        fclose(f);
+    }
+    free(path);
+}
+
+static void save_times( sector_cache* cache ) {
+    char* path = cache_file(cache, TIMES_FILE);
+    char* text = malloc(cache->final_sectors * 64 + 1);
+    int sector, length = 0;
+
+    for ( sector = 0; sector < cache->final_sectors; sector++ ) {
+        if ( cache->times[sector].last > 0 )
+            length += sprintf(text + length, "%d %ld %ld\n", sector,
+                              cache->times[sector].first, cache->times[sector].last);
+    }
+    if ( write_file(path, text, length) != SUCCESS )
+        fprintf(stderr, "cannot write %s\n", path);
+    free(text);
+    free(path);
+}
+
+/**
+  * Open the cache of the device <device_id>. <log_wr_ptr> is the current write
+  * pointer of the device. If it is lower than at the time of the last dump the
+  * log has been erased or overwritten in FIFO mode and the cache is cleared.
+  * An erased log that has grown beyond the old one is only found by
+  * sector_cache_verify(). Returns NULL if the cache directory cannot be created.
+  */
+sector_cache* sector_cache_open( const char* base_dir, const char* device_id, gbuint32 log_wr_ptr ) {
+    sector_cache* cache;
+    char* path;
+    FILE* f;
+    char wr_ptr[20];
+
+    cache = malloc(sizeof(sector_cache));
+    cache->dir = malloc(strlen(base_dir) + strlen(device_id) + 2);
+    sprintf(cache->dir, "%s/%s", base_dir, device_id);
+    cache->final_sectors = log_wr_ptr / SKYTRAQ_SECTOR_SIZE;
+    cache->times = NULL;
+
+    if ( make_dirs(cache->dir) != SUCCESS ) {
+        fprintf(stderr, "cannot create cache directory %s\n", cache->dir);
+        sector_cache_close(cache);
+        return NULL;
+    }
+
+    path = cache_file(cache, WR_PTR_FILE);
+    f = fopen(path, "r");
+    if ( f != NULL ) {
+        unsigned long cached_wr_ptr;
+        if ( fscanf(f, "%lu", &cached_wr_ptr) != 1 || cached_wr_ptr > log_wr_ptr ) {
+            DEBUG("log write pointer went back, clearing cache\n");
+            invalidate(cache);
+        }
+        fclose(f);
+    }
+
+    snprintf(wr_ptr, sizeof(wr_ptr), "%lu\n", log_wr_ptr);
+    write_file(path, wr_ptr, strlen(wr_ptr));
+    free(path);
+
+    load_times(cache);
+    return cache;
+}
+
+/* FNV-1a */
+static unsigned long long fingerprint( const gbuint8* buffer, int length ) {
+    unsigned long long hash = 14695981039346656037ULL;
+    int i;
+
+    for ( i = 0; i < length; i++ ) {
+        hash ^= buffer[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+  * Check that the cache belongs to the log on the device. <sector0> is the
+  * first sector as just read from the device; it does not change until the
+  * log is erased. The write pointer alone cannot tell if the log has been
+  * erased and a longer one recorded since the last dump. If the fingerprint
+  * of the sector differs from the one stored the cache is cleared.
+  */
+void sector_cache_verify( sector_cache* cache, const gbuint8* sector0, int length ) {
+    char* path = cache_file(cache, FINGERPRINT_FILE);
+    unsigned long long hash = fingerprint(sector0, length);
+    unsigned long long cached_hash;
+    char text[24];
+    FILE* f;
+    int same = 0;
+
+    f = fopen(path, "r");
+    if ( f != NULL ) {
+        same = fscanf(f, "%llx", &cached_hash) == 1 && cached_hash == hash;
+        fclose(f);
+    }
+    if ( !same ) {
+        DEBUG("first sector has changed, clearing cache\n");
+        invalidate(cache);
+        snprintf(text, sizeof(text), "%016llx\n", hash);
+        if ( write_file(path, text, strlen(text)) != SUCCESS )
+            fprintf(stderr, "cannot write %s\n", path);
+    }
+    free(path);
+}
+
+/**
+  * Remove the cache of the device <device_id>, used when its log is erased.
+  */
+void sector_cache_clear( const char* base_dir, const char* device_id ) {
+    sector_cache cache;
+    char* path;
+
+    memset(&cache, 0, sizeof(cache));
+    cache.dir = malloc(strlen(base_dir) + strlen(device_id) + 2);
+    sprintf(cache.dir, "%s/%s", base_dir, device_id);
+
+    invalidate(&cache);
+    path = cache_file(&cache, WR_PTR_FILE);
+    unlink(path);
+    free(path);
+    path = cache_file(&cache, FINGERPRINT_FILE);
+    unlink(path);
+    free(path);
+    free(cache.dir);
+}
+
+/**
+  * Load a sector that is known to be final. Returns the number of bytes or -1
+  * if the sector has to be read from the device.
+  */
+int sector_cache_load( sector_cache* cache, int sector, gbuint8* buffer ) {
+    char* path;
+    FILE* f;
+    int length = -1;
+
+    if ( sector >= cache->final_sectors )
+        return -1;
+
+    path = sector_file(cache, sector);
+    f = fopen(path, "rb");
+    if ( f != NULL ) {
+        length = fread(buffer, 1, SKYTRAQ_SECTOR_SIZE, f);
+        if ( ferror(f) )
+            length = -1;
+        fclose(f);
+    }
+    free(path);
+    return length;
+}
+
+/**
+  * Store a sector read from the device. The sector containing the write pointer
+  * is still growing and is not stored.
+  */
+void sector_cache_store( sector_cache* cache, int sector, const gbuint8* buffer, int length ) {
+    char* path;
+
+    if ( sector >= cache->final_sectors || length < 0 )
+        return;
+
+    path = sector_file(cache, sector);
+    if ( write_file(path, buffer, length) != SUCCESS ) {
+        fprintf(stderr, "cannot write %s\n", path);
+    }
+    free(path);
+}
+
+/**
+  * Look up the time range of a final sector in the index. Returns ERROR if the
+  * sector has not been seen yet.
+  */
+int sector_cache_times( const sector_cache* cache, int sector, long* first, long* last ) {
+    if ( sector < 0 || sector >= cache->final_sectors || cache->times[sector].last == 0 )
+        return ERROR;
+    *first = cache->times[sector].first;
+    *last = cache->times[sector].last;
+    return SUCCESS;
+}
+
+/**
+  * Remember the time range of a sector. Like the sectors only final ones are
+  * kept. The index is written when the cache is closed.
+  */
+void sector_cache_store_times( sector_cache* cache, int sector, long first, long last ) {
+    if ( sector < 0 || sector >= cache->final_sectors || last <= 0 )
+        return;
+    if ( cache->times[sector].first != first || cache->times[sector].last != last ) {
+        cache->times[sector].first = first;
+        cache->times[sector].last = last;
+        cache->times_changed = 1;
+    }
+}
+
+void sector_cache_close( sector_cache* cache ) {
+    if ( cache != NULL ) {
+        if ( cache->times != NULL && cache->times_changed )
+            save_times(cache);
+        free(cache->times);
+        free(cache->dir);
+        free(cache);
+    }
+}
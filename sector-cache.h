@@ -0,0 +1,56 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef sector_cache_h
+#define sector_cache_h
+
+/* time range of a sector, from its first long entry to its last point */
+typedef struct sector_times {
+    long        first;
+    long        last;           /* 0 if the sector is not in the index */
+} sector_times;
+
+/*
+ * Local copy of the log sectors of a device. Sectors in front of the one
+ * containing the log write pointer will not change anymore and can be taken
+ * from the cache instead of being read from the device again. A fingerprint
+ * of the first sector tells whether the log has been erased in between.
+ */
+typedef struct sector_cache {
+    char*       dir;
+    gbuint32    final_sectors;  /* sectors before the write pointer */
+    sector_times* times;        /* index of the final sectors, kept even
+                                   if the sectors themselves are not */
+    int         times_changed;
+} sector_cache;
+
+char* sector_cache_default_dir( void );
+sector_cache* sector_cache_open( const char* base_dir, const char* device_id, gbuint32 log_wr_ptr );
+void sector_cache_verify( sector_cache* cache, const gbuint8* sector0, int length );
+void sector_cache_clear( const char* base_dir, const char* device_id );
+int sector_cache_load( sector_cache* cache, int sector, gbuint8* buffer );
+void sector_cache_store( sector_cache* cache, int sector, const gbuint8* buffer, int length );
+int sector_cache_times( const sector_cache* cache, int sector, long* first, long* last );
+void sector_cache_store_times( sector_cache* cache, int sector, long first, long last );
+void sector_cache_close( sector_cache* cache );
+
+#endif
@@ -0,0 +1,732 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#define _GNU_SOURCE /* posix_openpt(), ptsname() */
+#include "datalogger.h"
+#include "lowlevel.h"
+#include "flash-image.h"
+#include "message-decode.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+/*
+ * A data logger on a pseudo-terminal, for measuring and testing without a
+ * device. Not part of the default build: "make skytraq-sim". The flash
+ * memory is taken from an image written by --dump-raw or from a plain file
+ * of sectors, the serial line is throttled to the configured baud-rate.
+ *
+ *   skytraq-sim --link /tmp/logger flash.stq &
+ *   skytraq-datalogger --device /tmp/logger --dump
+ */
+
+#define DEFAULT_SECTORS     256     /* READ_SECTOR addresses sectors with one byte */
+#define NMEA_INTERVAL       1000    /* ms, also for binary output */
+#define INPUT_SIZE          1024
+
+
+/* a message ID only the device sends; the client does not check it */
+#define RESPONSE_AGPS_STATUS    0xb4
+
+enum { OUTPUT_OFF, OUTPUT_NMEA, OUTPUT_BINARY };
+enum { AGPS_IDLE, AGPS_INFO, AGPS_DATA };
+
+typedef struct simulator {
+    int             master;
+    int             slave;          /* kept open so the pty survives the client */
+    unsigned        baud_rate;
+    double          line_free;      /* when the line has sent everything written */
+
+    gbuint8*        flash;
+    skytraq_config  config;
+    skytraq_version version;
+    unsigned        crc;
+    int             output;         /* OUTPUT_OFF, OUTPUT_NMEA or OUTPUT_BINARY */
+    double          next_nmea;
+
+    /* faults */
+    unsigned        latency;        /* ms before every answer */
+    double          drop_rate;      /* probability that a byte sent gets lost */
+    double          corrupt_rate;   /* probability that an answer has a wrong checksum */
+    unsigned long long random;
+
+    skytraq_framer  framer;
+    int             agps;           /* state of an AGPS upload */
+    char            agps_info[100];
+    unsigned        agps_info_length;
+    unsigned        agps_size;
+    unsigned        agps_received;
+    unsigned        agps_sum_a;
+    unsigned        agps_sum_b;
+    unsigned        agps_checksum_a;
+    unsigned        agps_checksum_b;
+
+    /* statistics */
+    unsigned long   commands;
+    unsigned long   sectors;
+    unsigned long   bytes_sent;
+    unsigned long   bytes_dropped;
+    unsigned long   corrupted;
+    unsigned long   ignored_bytes;  /* received at the wrong baud-rate */
+} simulator;
+
+static volatile sig_atomic_t stopped = 0;
+
+static void handle_stop( int sig ) {
+    stopped = sig;
+}
+
+/* xorshift64*, reproducible with --seed */
+static double next_random( simulator* sim ) {
+    sim->random ^= sim->random >> 12;
+    sim->random ^= sim->random << 25;
+    sim->random ^= sim->random >> 27;
+    return ((sim->random * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static speed_t termios_speed( unsigned baud_rate ) {
+    switch ( baud_rate ) {
+    case 4800:
+        return B4800;
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    default:
+        return B0;
+    }
+}
+
+/**
+  * Whether the client has set the pty to the rate of the simulated device.
+  * Otherwise nothing it sends is understood and it only receives garbage.
+  */
+static int line_matches( const simulator* sim ) {
+    struct termios io;
+
+    if ( tcgetattr(sim->slave, &io) != 0 )
+        return 1;
+    return cfgetospeed(&io) == termios_speed(sim->baud_rate);
+}
+
+static void sleep_until( double t ) {
+    double left = t - monotonic_time();
+
+    if ( left > 0 ) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)left;
+        ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+  * Send bytes to the client at the speed of the serial line: 10 bits per byte,
+  * handed to the pty in slices of about 5 ms.
+  */
+static void line_write( simulator* sim, const gbuint8* data, int length ) {
+    gbuint8 slice[INPUT_SIZE];
+    int matches = line_matches(sim);
+    int slice_size = sim->baud_rate / 10 / 200;
+
+    if ( slice_size < 1 )
+        slice_size = 1;
+    if ( slice_size > sizeof(slice) )
+        slice_size = sizeof(slice);
+    if ( sim->line_free < monotonic_time() )
+        sim->line_free = monotonic_time();
+
+    while ( length > 0 ) {
+        int n = length < slice_size ? length : slice_size;
+        int i, kept = 0;
+
+        for ( i = 0; i < n; i++ ) {
+            if ( sim->drop_rate > 0 && next_random(sim) < sim->drop_rate ) {
+                sim->bytes_dropped++;
+                continue;
+            }
+            /* at the wrong rate the client sees noise */
+            slice[kept++] = matches ? data[i] : data[i] ^ 0x5a;
+        }
+        if ( kept > 0 && write(sim->master, slice, kept) != kept )
+            perror("write");
+
+        sim->bytes_sent += n;
+        sim->line_free += n * 10.0 / sim->baud_rate;
+        sleep_until(sim->line_free);
+        data += n;
+        length -= n;
+    }
+}
+
+/* decide whether the next answer gets a wrong checksum */
+static int corrupt_next( simulator* sim ) {
+    if ( sim->corrupt_rate > 0 && next_random(sim) < sim->corrupt_rate ) {
+        sim->corrupted++;
+        return 1;
+    }
+    return 0;
+}
+
+static void send_package( simulator* sim, const gbuint8* payload, int length ) {
+    gbuint8 buf[SKYTRAQ_MAX_PAYLOAD + SKYTRAQ_FRAME_OVERHEAD];
+    int frame_length = skytraq_frame_package(buf, payload, length);
+
+    buf[4 + length] ^= corrupt_next(sim);
+    line_write(sim, buf, frame_length);
+}
+
+static void send_ack( simulator* sim, gbuint8 id, int ack ) {
+    gbuint8 payload[2];
+
+    payload[0] = ack ? SKYTRAQ_RESPONSE_ACK : SKYTRAQ_RESPONSE_NACK;
+    payload[1] = id;
+    send_package(sim, payload, 2);
+}
+
+static void send_string( simulator* sim, const char* s ) {
+    line_write(sim, (const gbuint8*)s, strlen(s) + 1);
+}
+
+static void put_uint32( gbuint8* d, unsigned long value ) {
+    d[0] = value & 0xff;
+    d[1] = (value >> 8) & 0xff;
+    d[2] = (value >> 16) & 0xff;
+    d[3] = (value >> 24) & 0xff;
+}
+
+static void put_int32_be( gbuint8* d, long value ) {
+    d[0] = (value >> 24) & 0xff;
+    d[1] = (value >> 16) & 0xff;
+    d[2] = (value >> 8) & 0xff;
+    d[3] = value & 0xff;
+}
+
+static unsigned long get_uint32_be( const gbuint8* d ) {
+    return ((unsigned long)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+}
+
+/**
+  * The sector as stored, "END", and a trailer with the checksum in its 11th
+  * byte.
+  */
+static void send_sector( simulator* sim, int sector ) {
+    gbuint8 trailer[19] = "END\0CHECKSUM=";
+    const gbuint8* data = sim->flash + sector * SKYTRAQ_SECTOR_SIZE;
+
+    trailer[13] = skytraq_xor_checksum(data, SKYTRAQ_SECTOR_SIZE) ^ corrupt_next(sim);
+    memcpy(trailer + 14, "\0\0\0\r\n", 5);
+    line_write(sim, data, SKYTRAQ_SECTOR_SIZE);
+    line_write(sim, trailer, sizeof(trailer));
+    sim->sectors++;
+}
+
+static void send_log_status( simulator* sim ) {
+    gbuint8 d[35];
+    const skytraq_config* c = &sim->config;
+
+    memset(d, 0, sizeof(d));
+    d[0] = SKYTRAQ_RESPONSE_LOG_STATUS;
+    put_uint32(d + 1, c->log_wr_ptr);
+    d[5] = c->sectors_left & 0xff;
+    d[6] = c->sectors_left >> 8;
+    d[7] = c->total_sectors & 0xff;
+    d[8] = c->total_sectors >> 8;
+    put_uint32(d + 9, c->max_time);
+    put_uint32(d + 13, c->min_time);
+    put_uint32(d + 17, c->max_distance);
+    put_uint32(d + 21, c->min_distance);
+    put_uint32(d + 25, c->max_speed);
+    put_uint32(d + 29, c->min_speed);
+    d[33] = c->datalog_enable;
+    d[34] = c->log_fifo_mode;
+    send_package(sim, d, sizeof(d));
+}
+
+static void write_config( simulator* sim, const gbuint8* d ) {
+    skytraq_config* c = &sim->config;
+
+    c->max_time = get_uint32_be(d + 1);
+    c->min_time = get_uint32_be(d + 5);
+    c->max_distance = get_uint32_be(d + 9);
+    c->min_distance = get_uint32_be(d + 13);
+    c->max_speed = get_uint32_be(d + 17);
+    c->min_speed = get_uint32_be(d + 21);
+    c->datalog_enable = d[25];
+    c->log_fifo_mode = d[26];
+}
+
+static void erase_log( simulator* sim ) {
+    memset(sim->flash, 0xff, sim->config.total_sectors * SKYTRAQ_SECTOR_SIZE);
+    sim->config.log_wr_ptr = 0;
+    sim->config.sectors_left = sim->config.total_sectors;
+}
+
+/**
+  * Answer a command from the client. Every command known is acknowledged
+  * before the answer is sent, others get a NACK.
+  */
+static void handle_command( simulator* sim, const gbuint8* d, int length ) {
+    static const unsigned rates[] = { 4800, 9600, 19200, 38400, 57600, 115200 };
+    gbuint8 answer[16];
+
+    sim->commands++;
+    if ( sim->latency > 0 )
+        usleep(sim->latency * 1000);
+
+    switch ( d[0] ) {
+    case SKYTRAQ_COMMAND_QUERY_SOFTWARE_VERSION:
+        send_ack(sim, d[0], 1);
+        memset(answer, 0, sizeof(answer));
+        answer[0] = SKYTRAQ_RESPONSE_SOFTWARE_VERSION;
+        answer[1] = 1;
+        memcpy(answer + 3, sim->version.kernel, 3);
+        memcpy(answer + 7, sim->version.odm, 3);
+        memcpy(answer + 11, sim->version.revision, 3);
+        send_package(sim, answer, 14);
+        break;
+    case SKYTRAQ_COMMAND_QUERY_SOFTWARE_CRC:
+        send_ack(sim, d[0], 1);
+        answer[0] = SKYTRAQ_RESPONSE_SOFTWARE_CRC;
+        answer[1] = 1;
+        answer[2] = (sim->crc >> 8) & 0xff;
+        answer[3] = sim->crc & 0xff;
+        send_package(sim, answer, 4);
+        break;
+    case SKYTRAQ_COMMAND_CONFIGURE_SERIAL_PORT:
+        if ( length < 3 || d[2] >= sizeof(rates)/sizeof(rates[0]) ) {
+            send_ack(sim, d[0], 0);
+            break;
+        }
+        /* the ACK still goes out at the old rate */
+        send_ack(sim, d[0], 1);
+        sleep_until(sim->line_free);
+        sim->baud_rate = rates[d[2]];
+        break;
+    case SKYTRAQ_COMMAND_CONFIGURE_MESSAGE_TYPE:
+        send_ack(sim, d[0], length >= 2 && d[1] <= OUTPUT_BINARY);
+        if ( length >= 2 && d[1] <= OUTPUT_BINARY )
+            sim->output = d[1];
+        break;
+    case SKYTRAQ_COMMAND_GET_CONFIG:
+        send_ack(sim, d[0], 1);
+        send_log_status(sim);
+        break;
+    case SKYTRAQ_COMMAND_WRITE_CONFIG:
+        send_ack(sim, d[0], length >= 27);
+        if ( length >= 27 )
+            write_config(sim, d);
+        break;
+    case SKYTRAQ_COMMAND_ERASE:
+        send_ack(sim, d[0], 1);
+        erase_log(sim);
+        break;
+    case SKYTRAQ_COMMAND_READ_SECTOR:
+        if ( length < 2 || d[1] >= sim->config.total_sectors ) {
+            send_ack(sim, d[0], 0);
+            break;
+        }
+        send_ack(sim, d[0], 1);
+        send_sector(sim, d[1]);
+        break;
+    case SKYTRAQ_COMMAND_READ_AGPS_STATUS:
+        send_ack(sim, d[0], 1);
+        answer[0] = RESPONSE_AGPS_STATUS;
+        answer[1] = sim->config.agps_hours_left & 0xff;
+        answer[2] = sim->config.agps_hours_left >> 8;
+        answer[3] = sim->config.agps_enabled;
+        send_package(sim, answer, 4);
+        break;
+    case SKYTRAQ_COMMAND_SEND_AGPS_DATA:
+        send_ack(sim, d[0], 1);
+        sim->agps = AGPS_INFO;
+        sim->agps_info_length = 0;
+        break;
+    default:
+        send_ack(sim, d[0], 0);
+        break;
+    }
+}
+
+/**
+  * AGPS upload: "BINSIZE = <n> Checksum = <a> Checksumb = <b> " is answered
+  * with "OK", then every block of AGPS_UPLOAD_BLOCKSIZE bytes and the last
+  * one. "END" follows if the checksums match. Returns the bytes consumed.
+  */
+static int agps_receive( simulator* sim, const gbuint8* data, int length ) {
+    int i;
+
+    if ( sim->agps == AGPS_INFO ) {
+        for ( i = 0; i < length; i++ ) {
+            if ( data[i] != 0 ) {
+                if ( sim->agps_info_length < sizeof(sim->agps_info) - 1 )
+                    sim->agps_info[sim->agps_info_length++] = data[i];
+                continue;
+            }
+            sim->agps_info[sim->agps_info_length] = 0;
+            if ( sscanf(sim->agps_info, "BINSIZE = %u Checksum = %u Checksumb = %u",
+                        &sim->agps_size, &sim->agps_checksum_a, &sim->agps_checksum_b) == 3 ) {
+                sim->agps = AGPS_DATA;
+                sim->agps_received = sim->agps_sum_a = sim->agps_sum_b = 0;
+                send_string(sim, "OK");
+            } else {
+                sim->agps = AGPS_IDLE;
+                send_string(sim, "Error");
+            }
+            return i + 1;
+        }
+        return length;
+    }
+
+    for ( i = 0; i < length && sim->agps_received < sim->agps_size; i++ ) {
+        sim->agps_sum_a += data[i];
+        if ( sim->agps_received < 0x10000 )
+            sim->agps_sum_b += data[i];
+        sim->agps_received++;
+        if ( sim->agps_received % AGPS_UPLOAD_BLOCKSIZE == 0 || sim->agps_received == sim->agps_size )
+            send_string(sim, "OK");
+    }
+    if ( sim->agps_received == sim->agps_size ) {
+        sim->agps = AGPS_IDLE;
+        if ( sim->agps_sum_a % 256 == sim->agps_checksum_a && sim->agps_sum_b % 256 == sim->agps_checksum_b ) {
+            sim->config.agps_enabled = 1;
+            sim->config.agps_hours_left = 72;
+            send_string(sim, "END");
+        } else {
+            send_string(sim, "Error");
+        }
+    }
+    return i;
+}
+
+static void receive( simulator* sim, const gbuint8* data, int length ) {
+    if ( !line_matches(sim) ) {
+        sim->ignored_bytes += length;
+        return;
+    }
+
+    while ( length > 0 ) {
+        SkyTraqPackage* p;
+        unsigned consumed;
+
+        if ( sim->agps != AGPS_IDLE ) {
+            int n = agps_receive(sim, data, length);
+            data += n;
+            length -= n;
+            continue;
+        }
+
+        p = skytraq_framer_feed(&sim->framer, data, length, &consumed);
+        data += consumed;
+        length -= consumed;
+        if ( p != NULL ) {
+            handle_command(sim, p->data, p->length);
+            skytraq_free_package(p);
+        }
+    }
+}
+
+static void nmea_sentence( simulator* sim, const char* body ) {
+    char line[128];
+    const char* c;
+    gbuint8 checksum = 0;
+
+    for ( c = body; *c; c++ )
+        checksum ^= *c;
+    snprintf(line, sizeof(line), "$%s*%02X\r\n", body, checksum);
+    line_write(sim, (const gbuint8*)line, strlen(line));
+}
+
+/* the position of a receiver sitting still */
+static void send_nmea( simulator* sim ) {
+    char body[100];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    gmtime_r(&now, &tm);
+    snprintf(body, sizeof(body), "GPGGA,%02d%02d%02d.000,5320.0000,N,01000.0000,E,1,08,1.0,25.0,M,45.0,M,,0000",
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+    nmea_sentence(sim, body);
+    snprintf(body, sizeof(body), "GPRMC,%02d%02d%02d.000,A,5320.0000,N,01000.0000,E,0.00,0.00,%02d%02d%02d,,,A",
+             tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+    nmea_sentence(sim, body);
+}
+
+/* the same position in binary output mode */
+static void send_navigation( simulator* sim ) {
+    const double a = 6378137.0, e2 = 6.69437999014e-3;  /* WGS 84 */
+    double latitude = (53 + 20 / 60.0) * M_PI / 180, longitude = 10 * M_PI / 180, height = 25.0 + 45.0;
+    double n = a / sqrt(1 - e2 * sin(latitude) * sin(latitude));
+    unsigned week;
+    double time_of_week;
+    gbuint8 d[59];
+
+    skytraq_unix_to_gps(time(NULL), &week, &time_of_week);
+    memset(d, 0, sizeof(d));
+    d[0] = SKYTRAQ_RESPONSE_NAVIGATION_DATA;
+    d[1] = 2;   /* 3D fix */
+    d[2] = 8;
+    d[3] = week >> 8;
+    d[4] = week & 0xff;
+    put_int32_be(d + 5, time_of_week * 100);
+    put_int32_be(d + 9, 533333333);
+    put_int32_be(d + 13, 100000000);
+    put_int32_be(d + 17, height * 100);
+    put_int32_be(d + 21, 2500);
+    d[26] = 180; /* GDOP 1.8, PDOP 1.6, HDOP 1.0, VDOP 1.3, TDOP 0.9 */
+    d[28] = 160;
+    d[30] = 100;
+    d[32] = 130;
+    d[34] = 90;
+    put_int32_be(d + 35, (n + height) * cos(latitude) * cos(longitude) * 100);
+    put_int32_be(d + 39, (n + height) * cos(latitude) * sin(longitude) * 100);
+    put_int32_be(d + 43, (n * (1 - e2) + height) * sin(latitude) * 100);
+    send_package(sim, d, sizeof(d));
+}
+
+/**
+  * Load the flash memory from an image written by --dump-raw, or from a file
+  * of plain sectors. Returns ERROR if the file cannot be read.
+  */
+static int load_flash( simulator* sim, const char* path, int total_sectors ) {
+    flash_image image;
+    int i, sectors;
+    long last;
+
+    if ( flash_image_open(path, &image) == SUCCESS ) {
+        sectors = image.info.sector_count;
+        if ( total_sectors == 0 )
+            total_sectors = image.info.total_sectors;
+        if ( total_sectors < sectors )
+            total_sectors = sectors;
+        sim->flash = malloc(total_sectors * SKYTRAQ_SECTOR_SIZE);
+        memset(sim->flash, 0xff, total_sectors * SKYTRAQ_SECTOR_SIZE);
+        for ( i = 0; i < sectors; i++ ) {
+            int length;
+            const gbuint8* data = flash_image_sector(&image, i, &length);
+            if ( length > 0 )
+                memcpy(sim->flash + i * SKYTRAQ_SECTOR_SIZE, data, length);
+        }
+        sim->config.log_wr_ptr = image.info.log_wr_ptr;
+        sim->version = image.info.version;
+        sim->crc = image.info.crc;
+        flash_image_close(&image);
+    } else {
+        FILE* f = fopen(path, "rb");
+        long size;
+
+        if ( f == NULL )
+            return ERROR;
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+        sectors = (size + SKYTRAQ_SECTOR_SIZE - 1) / SKYTRAQ_SECTOR_SIZE;
+        if ( total_sectors == 0 )
+            total_sectors = DEFAULT_SECTORS;
+        if ( total_sectors < sectors )
+            total_sectors = sectors;
+        sim->flash = malloc(total_sectors * SKYTRAQ_SECTOR_SIZE);
+        memset(sim->flash, 0xff, total_sectors * SKYTRAQ_SECTOR_SIZE);
+        if ( fread(sim->flash, 1, size, f) != size ) {
+            fclose(f);
+            return ERROR;
+        }
+        fclose(f);
+
+        /* the log ends where the erased flash begins */
+        for ( last = size - 1; last >= 0 && sim->flash[last] == 0xff; last-- )
+            ;
+        sim->config.log_wr_ptr = last + 1;
+    }
+
+    if ( total_sectors > DEFAULT_SECTORS ) {
+        fprintf(stderr, "only the first %d sectors can be read\n", DEFAULT_SECTORS);
+        total_sectors = DEFAULT_SECTORS;
+    }
+    sim->config.total_sectors = total_sectors;
+    sim->config.sectors_left = total_sectors - sim->config.log_wr_ptr / SKYTRAQ_SECTOR_SIZE;
+    return SUCCESS;
+}
+
+/**
+  * Create the pty. The line starts in raw mode at the device's rate, like a
+  * serial port the client has not touched yet.
+  */
+static int open_pty( simulator* sim, const char* link ) {
+    struct termios io;
+    char* name;
+
+    sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ( sim->master == -1 || grantpt(sim->master) != 0 || unlockpt(sim->master) != 0 )
+        return ERROR;
+    name = ptsname(sim->master);
+    sim->slave = open(name, O_RDWR | O_NOCTTY);
+    if ( sim->slave == -1 || tcgetattr(sim->slave, &io) != 0 )
+        return ERROR;
+    cfmakeraw(&io);
+    cfsetospeed(&io, termios_speed(sim->baud_rate));
+    cfsetispeed(&io, termios_speed(sim->baud_rate));
+    tcsetattr(sim->slave, TCSANOW, &io);
+
+    if ( link != NULL ) {
+        unlink(link);
+        if ( symlink(name, link) != 0 ) {
+            perror(link);
+            return ERROR;
+        }
+    }
+    printf("%s\n", link != NULL ? link : name);
+    fflush(stdout);
+    return SUCCESS;
+}
+
+static void usage( const char* name ) {
+    fprintf(stderr, "USAGE: %s <OPTIONS> IMAGE\n", name);
+    fprintf(stderr, " Simulates a data logger on a pseudo-terminal. IMAGE is a flash image\n");
+    fprintf(stderr, " written by --dump-raw or a file of %d byte sectors.\n", SKYTRAQ_SECTOR_SIZE);
+    fprintf(stderr, " OPTIONS:\n");
+    fprintf(stderr, "  --link <PATH>         symbolic link to the pty, its name is printed\n");
+    fprintf(stderr, "  --baud-rate <RATE>    rate of the device at start, default is 115200\n");
+    fprintf(stderr, "  --sectors <N>         size of the flash memory, default from the image\n");
+    fprintf(stderr, "  --latency <MS>        pause before every answer\n");
+    fprintf(stderr, "  --drop <P>            probability that a byte sent is lost\n");
+    fprintf(stderr, "  --corrupt <P>         probability that an answer has a wrong checksum\n");
+    fprintf(stderr, "  --seed <N>            seed for --drop and --corrupt\n");
+    fprintf(stderr, "  --no-nmea             do not send NMEA sentences every second\n");
+}
+
+int main( int argc, char* argv[] ) {
+    simulator sim;
+    struct sigaction action;
+    const char* link = NULL;
+    const char* image = NULL;
+    int i, total_sectors = 0;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.baud_rate = 115200;
+    sim.output = OUTPUT_NMEA;
+    sim.random = 4711;
+    sim.config.max_time = 3600;
+    sim.config.min_time = 5;
+    sim.config.max_distance = 1000;
+    sim.config.max_speed = 1000;
+    sim.config.datalog_enable = 1;
+    sim.version.kernel[0] = 1;
+    sim.version.odm[0] = 1;
+    sim.version.revision[0] = 8;
+    sim.version.revision[1] = 10;
+    sim.version.revision[2] = 16;
+    sim.crc = 0x1234;
+
+    for ( i = 1; i < argc; i++ ) {
+        if ( !strcmp(argv[i], "--link") && i + 1 < argc ) {
+            link = argv[++i];
+        } else if ( !strcmp(argv[i], "--baud-rate") && i + 1 < argc ) {
+            sim.baud_rate = atoi(argv[++i]);
+            if ( termios_speed(sim.baud_rate) == B0 ) {
+                fprintf(stderr, "unknown baud-rate %s\n", argv[i]);
+                return 1;
+            }
+        } else if ( !strcmp(argv[i], "--sectors") && i + 1 < argc ) {
+            total_sectors = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "--latency") && i + 1 < argc ) {
+            sim.latency = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "--drop") && i + 1 < argc ) {
+            sim.drop_rate = atof(argv[++i]);
+        } else if ( !strcmp(argv[i], "--corrupt") && i + 1 < argc ) {
+            sim.corrupt_rate = atof(argv[++i]);
+        } else if ( !strcmp(argv[i], "--seed") && i + 1 < argc ) {
+            sim.random = strtoull(argv[++i], NULL, 10) | 1;
+        } else if ( !strcmp(argv[i], "--no-nmea") ) {
+            sim.output = OUTPUT_OFF;
+        } else if ( argv[i][0] != '-' && image == NULL ) {
+            image = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ( image == NULL ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if ( load_flash(&sim, image, total_sectors) != SUCCESS ) {
+        fprintf(stderr, "cannot read %s\n", image);
+        return 1;
+    }
+    if ( open_pty(&sim, link) != SUCCESS ) {
+        fprintf(stderr, "cannot create pseudo-terminal\n");
+        return 1;
+    }
+    skytraq_framer_init(&sim.framer);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    sim.next_nmea = monotonic_time();
+    while ( !stopped ) {
+        struct pollfd pfd;
+        gbuint8 buf[INPUT_SIZE];
+        int timeout = NMEA_INTERVAL;
+
+        if ( sim.output != OUTPUT_OFF ) {
+            double now = monotonic_time();
+            if ( now >= sim.next_nmea ) {
+                if ( sim.output == OUTPUT_NMEA )
+                    send_nmea(&sim);
+                else
+                    send_navigation(&sim);
+                sim.next_nmea = now + NMEA_INTERVAL / 1000.0;
+            }
+            timeout = (sim.next_nmea - monotonic_time()) * 1000 + 1;
+        }
+
+        pfd.fd = sim.master;
+        pfd.events = POLLIN;
+        if ( poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN) ) {
+            int len = read(sim.master, buf, sizeof(buf));
+            if ( len > 0 )
+                receive(&sim, buf, len);
+            else if ( len == -1 && errno != EINTR && errno != EAGAIN )
+                break;
+        }
+    }
+
+    fprintf(stderr, "%lu commands, %lu sectors, %lu bytes sent, %lu dropped, %lu answers corrupted, "
+            "%lu bytes received at the wrong rate\n",
+            sim.commands, sim.sectors, sim.bytes_sent, sim.bytes_dropped, sim.corrupted, sim.ignored_bytes);
+    if ( link != NULL )
+        unlink(link);
+    close(sim.slave);
+    close(sim.master);
+    free(sim.flash);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "lowlevel.h"
+#include "stats.h"
+
+/**
+  * Record that the phase <name> took from <start> until now. Returns the
+  * current time, the start of the next phase.
+  */
+double stats_phase( run_stats* stats, const char* name, double start ) {
+    double now = monotonic_time();
+
+    if ( stats->phase_count < STATS_MAX_PHASES ) {
+        stats->phase_names[stats->phase_count] = name;
+        stats->phase_times[stats->phase_count] = now - start;
+        stats->phase_count++;
+    }
+    return now;
+}
+
+static void print_dump_text( FILE* out, const run_stats* stats ) {
+    const skytraq_dump_report* r = stats->dump;
+
+    if ( !stats->device ) {
+        fprintf(out, "decode:          %d sectors (%d missing) in %.3f s\n",
+                r->sectors, r->failed_sectors, r->decode_time);
+    } else {
+        fprintf(out, "dump:            %d sectors (%d from cache, %d failed, %d retries) in %.2f s at %d bps\n",
+                r->sectors, r->cached_sectors, r->failed_sectors, r->retries, r->total_time, r->baud_rate);
+        fprintf(out, "dump time:       %.2f s transferring, %.2f s waiting, %.2f s decoding\n",
+                r->transfer_time, r->wait_time, r->decode_time);
+        if ( r->skipped_sectors > 0 || r->probed_sectors > 0 )
+            fprintf(out, "dump window:     %d sectors skipped, %d read to locate the window\n",
+                    r->skipped_sectors, r->probed_sectors);
+        fprintf(out, "dump queue:      depth %.1f average, %d max, reader stalled %d times, decoder %d times\n",
+                r->avg_queue_depth, r->max_queue_depth, r->reader_stalls, r->decoder_stalls);
+    }
+    fprintf(out, "log entries:     %ld long, %ld short, %ld bytes skipped, %ld bytes erased\n",
+            r->decode.long_entries, r->decode.short_entries, r->decode.skipped_bytes, r->decode.erased_bytes);
+}
+
+void stats_print_text( FILE* out, const run_stats* stats ) {
+    const skytraq_io_stats* io = skytraq_get_io_stats();
+    const skytraq_protocol_stats* protocol = skytraq_get_protocol_stats();
+    int i;
+
+    if ( stats->phase_count > 0 ) {
+        fprintf(out, "phases:          ");
+        for ( i = 0; i < stats->phase_count; i++ )
+            fprintf(out, "%s%s %.3f s", i ? ", " : "", stats->phase_names[i], stats->phase_times[i]);
+        fprintf(out, "\n");
+    }
+
+    if ( stats->dump != NULL )
+        print_dump_text(out, stats);
+
+    if ( !stats->device )
+        return;
+
+    fprintf(out, "serial input:    %lu bytes in %lu read() calls, %lu timeouts\n",
+            io->bytes_read, io->read_calls, io->read_timeouts);
+    fprintf(out, "serial output:   %lu bytes in %lu write() calls\n", io->bytes_written, io->write_calls);
+    fprintf(out, "packages:        %lu (%lu framing errors)\n", io->packages, io->framing_errors);
+    if ( io->packages > 0 ) {
+        fprintf(out, "framer:          %.2f read() calls/package, %.1f packages/s\n",
+                (double)io->framer_read_calls / io->packages,
+                io->framer_time > 0 ? io->packages / io->framer_time : 0.0);
+    }
+    fprintf(out, "commands:        %lu sent, %lu ACK, %lu NACK, %lu unanswered, %lu other packages skipped\n",
+            io->commands, io->acks, io->nacks, io->unanswered, io->skipped_answers);
+    if ( io->acks + io->nacks > 0 ) {
+        fprintf(out, "ACK round trip: ");
+        for ( i = 0; i < SKYTRAQ_ACK_BUCKETS; i++ ) {
+            if ( io->ack_round_trip[i] == 0 )
+                continue;
+            if ( i < SKYTRAQ_ACK_BUCKETS - 1 )
+                fprintf(out, " <%d ms: %lu", 1 << i, io->ack_round_trip[i]);
+            else
+                fprintf(out, " >=%d ms: %lu", 1 << (i - 1), io->ack_round_trip[i]);
+        }
+        fprintf(out, " (%.1f ms average wait per command)\n", io->ack_time * 1000 / io->commands);
+    }
+    if ( protocol->sectors_read + protocol->sector_checksum_errors + protocol->sectors_incomplete > 0 )
+        fprintf(out, "sectors:         %lu read, %lu checksum errors, %lu incomplete\n",
+                protocol->sectors_read, protocol->sector_checksum_errors, protocol->sectors_incomplete);
+    if ( protocol->speed_detections > 0 )
+        fprintf(out, "speed detection: %lu rates tried in %.2f s\n",
+                protocol->rates_tried, protocol->detection_time);
+}
+
+static void print_dump_json( FILE* out, const skytraq_dump_report* r ) {
+    fprintf(out, "  \"dump\": {\"sectors\": %d, \"failed_sectors\": %d, \"retries\": %d, \"cached_sectors\": %d, "
+            "\"skipped_sectors\": %d, \"probed_sectors\": %d, \"baud_rate\": %u, \"transfer_time\": %.6f, "
+            "\"wait_time\": %.6f, \"decode_time\": %.6f, \"max_queue_depth\": %d, \"avg_queue_depth\": %.3f, "
+            "\"reader_stalls\": %d, \"decoder_stalls\": %d, \"total_time\": %.6f},\n",
+            r->sectors, r->failed_sectors, r->retries, r->cached_sectors, r->skipped_sectors, r->probed_sectors,
+            r->baud_rate, r->transfer_time, r->wait_time, r->decode_time, r->max_queue_depth,
+            r->avg_queue_depth, r->reader_stalls, r->decoder_stalls, r->total_time);
+    fprintf(out, "  \"decode\": {\"long_entries\": %ld, \"short_entries\": %ld, \"skipped_bytes\": %ld, "
+            "\"erased_bytes\": %ld, \"linearized\": %ld},\n",
+            r->decode.long_entries, r->decode.short_entries, r->decode.skipped_bytes,
+            r->decode.erased_bytes, r->decode.linearized);
+}
+
+/**
+  * The same as stats_print_text() as a JSON object, with all counters.
+  */
+void stats_print_json( FILE* out, const run_stats* stats ) {
+    const skytraq_io_stats* io = skytraq_get_io_stats();
+    const skytraq_protocol_stats* protocol = skytraq_get_protocol_stats();
+    int i;
+
+    fprintf(out, "{\n  \"phases\": {");
+    for ( i = 0; i < stats->phase_count; i++ )
+        fprintf(out, "%s\"%s\": %.6f", i ? ", " : "", stats->phase_names[i], stats->phase_times[i]);
+    fprintf(out, "},\n");
+
+    if ( stats->dump != NULL )
+        print_dump_json(out, stats->dump);
+
+    fprintf(out, "  \"io\": {\"bytes_read\": %lu, \"read_calls\": %lu, \"read_timeouts\": %lu, "
+            "\"bytes_written\": %lu, \"write_calls\": %lu, \"packages\": %lu, \"framing_errors\": %lu, "
+            "\"framer_read_calls\": %lu, \"framer_time\": %.6f},\n",
+            io->bytes_read, io->read_calls, io->read_timeouts, io->bytes_written, io->write_calls,
+            io->packages, io->framing_errors, io->framer_read_calls, io->framer_time);
+    fprintf(out, "  \"protocol\": {\"commands\": %lu, \"acks\": %lu, \"nacks\": %lu, \"unanswered\": %lu, "
+            "\"skipped_answers\": %lu, \"ack_time\": %.6f, \"ack_round_trip_ms\": [",
+            io->commands, io->acks, io->nacks, io->unanswered, io->skipped_answers, io->ack_time);
+    for ( i = 0; i < SKYTRAQ_ACK_BUCKETS; i++ ) {
+        if ( i < SKYTRAQ_ACK_BUCKETS - 1 )
+            fprintf(out, "%s{\"below\": %d, \"count\": %lu}", i ? ", " : "", 1 << i, io->ack_round_trip[i]);
+        else
+            fprintf(out, ", {\"below\": null, \"count\": %lu}", io->ack_round_trip[i]);
+    }
+    fprintf(out, "], \"sectors_read\": %lu, \"sector_checksum_errors\": %lu, \"sectors_incomplete\": %lu, "
+            "\"speed_detections\": %lu, \"rates_tried\": %lu, \"detection_time\": %.6f}\n}\n",
+            protocol->sectors_read, protocol->sector_checksum_errors, protocol->sectors_incomplete,
+            protocol->speed_detections, protocol->rates_tried, protocol->detection_time);
+}
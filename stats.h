@@ -0,0 +1,46 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef stats_h
+#define stats_h
+
+#include "dump.h"
+
+#define STATS_MAX_PHASES 8
+
+/*
+ * Everything --stats reports at the end of an action. The I/O and protocol
+ * counters are taken from lowlevel.c and datalogger.c when printing.
+ */
+typedef struct run_stats {
+    int                         phase_count;
+    const char*                 phase_names[STATS_MAX_PHASES];
+    double                      phase_times[STATS_MAX_PHASES];
+    const skytraq_dump_report*  dump;       /* NULL unless the action dumped or decoded */
+    int                         device;     /* a device was used */
+} run_stats;
+
+double stats_phase( run_stats* stats, const char* name, double start );
+void stats_print_text( FILE* out, const run_stats* stats );
+void stats_print_json( FILE* out, const run_stats* stats );
+
+#endif
@@ -0,0 +1,296 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "datalog-decode.h"
+#include "test-support.h"
+#include <math.h>
+#include <sys/mman.h>
+
+/*
+ * Tests for the decode API in datalog-decode.c. Not part of the default
+ * build: "make test" builds and runs them. Every sector is placed right in
+ * front of an inaccessible page, so reading past <length> crashes the test.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+static void check( int condition, const char* text, int line ) {
+    if ( !condition ) {
+        fprintf(stderr, "test-decode.c:%d: failed: %s\n", line, text);
+        failures++;
+    }
+}
+
+static gbuint8* guard_page;
+static long page_size;
+
+/**
+  * A buffer of <length> bytes that ends where the guard page begins.
+  */
+static gbuint8* guarded_buffer( int length ) {
+    if ( guard_page == NULL ) {
+        page_size = sysconf(_SC_PAGESIZE);
+        guard_page = mmap(NULL, 3 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( guard_page == MAP_FAILED ) {
+            perror("mmap");
+            exit(1);
+        }
+        guard_page += 2 * page_size;
+        mprotect(guard_page, page_size, PROT_NONE);
+    }
+    memset(guard_page - 2 * page_size, 0xff, 2 * page_size);
+    return guard_page - length;
+}
+
+#define START_TIME  1224168929l
+#define X           3800000
+#define Y           880000
+#define Z           5000000
+
+/**
+  * <longs> long entries, each followed by <shorts> short ones 5 s apart,
+  * from the start of <d>. Returns the number of bytes written.
+  */
+static int put_track( gbuint8* d, int longs, int shorts ) {
+    long time = START_TIME;
+    int i, j, offset = 0;
+
+    for ( i = 0; i < longs; i++ ) {
+        put_long_entry(d + offset, time, X, Y, Z, 10);
+        offset += 18;
+        for ( j = 0; j < shorts; j++ ) {
+            put_short_entry(d + offset, 5, 1, 2, 3, 11);
+            time += 5;
+            offset += 8;
+        }
+        time += 5;
+    }
+    return offset;
+}
+
+static int count_points( const skytraq_point* points, int count, void* context ) {
+    int* total = context;
+    *total += count;
+    return 0;
+}
+
+static int stop_after_first_batch( const skytraq_point* points, int count, void* context ) {
+    int* calls = context;
+    (*calls)++;
+    return 1;
+}
+
+static void test_whole_sector( void ) {
+    gbuint8* d = guarded_buffer(SKYTRAQ_SECTOR_SIZE);
+    skytraq_point* points = malloc(SKYTRAQ_SECTOR_POINTS * sizeof(skytraq_point));
+    int used = put_track(d, 20, 9);
+    decode_state st;
+    long first, last;
+    int n;
+
+    decode_init(&st, 0);
+    n = skytraq_decode_points(d, SKYTRAQ_SECTOR_SIZE, &st, points, SKYTRAQ_SECTOR_POINTS);
+    CHECK(n == 200);
+    CHECK(st.stats.long_entries == 20);
+    CHECK(st.stats.short_entries == 180);
+    CHECK(st.stats.erased_bytes == SKYTRAQ_SECTOR_SIZE - used);
+    CHECK(st.stats.skipped_bytes == 0);
+    CHECK(points[0].kind == SKYTRAQ_ENTRY_LONG && points[0].time == START_TIME);
+    CHECK(points[1].kind == SKYTRAQ_ENTRY_SHORT && points[1].time == START_TIME + 5);
+    CHECK(points[1].ecef_x == X + 1 && points[1].ecef_y == Y + 2 && points[1].ecef_z == Z + 3);
+    CHECK(points[0].latitude > 51 && points[0].latitude < 53);
+    CHECK(points[0].longitude > 13 && points[0].longitude < 14);
+
+    CHECK(skytraq_sector_times(d, SKYTRAQ_SECTOR_SIZE, &first, &last) == SUCCESS);
+    CHECK(first == START_TIME);
+    CHECK(last == points[n - 1].time);
+    free(points);
+}
+
+static void test_callback( void ) {
+    gbuint8* d = guarded_buffer(SKYTRAQ_SECTOR_SIZE);
+    decode_state st;
+    int total = 0, calls = 0;
+
+    put_track(d, 20, 9);
+    decode_init(&st, 0);
+    CHECK(skytraq_decode_sector(d, SKYTRAQ_SECTOR_SIZE, &st, count_points, &total) == 200);
+    CHECK(total == 200);
+
+    decode_init(&st, 0);
+    skytraq_decode_sector(d, SKYTRAQ_SECTOR_SIZE, &st, stop_after_first_batch, &calls);
+    CHECK(calls == 1);
+}
+
+static void test_max_points( void ) {
+    gbuint8* d = guarded_buffer(SKYTRAQ_SECTOR_SIZE);
+    skytraq_point points[7];
+    decode_state st;
+
+    put_track(d, 20, 9);
+    decode_init(&st, 0);
+    CHECK(skytraq_decode_points(d, SKYTRAQ_SECTOR_SIZE, &st, points, 7) == 7);
+    CHECK(points[6].time == START_TIME + 30);
+}
+
+/* a long entry cut off at the end of the buffer is skipped, not read past it */
+static void test_truncated_long_entry( void ) {
+    int length = 2 * 18 + 10;
+    gbuint8* d = guarded_buffer(length);
+    gbuint8 entry[18];
+    skytraq_point points[4];
+    decode_state st;
+    long first, last;
+
+    put_long_entry(d, START_TIME, X, Y, Z, 10);
+    put_long_entry(d + 18, START_TIME + 5, X, Y, Z, 10);
+    put_long_entry(entry, START_TIME + 10, X, Y, Z, 10);
+    memcpy(d + 36, entry, 10);
+
+    decode_init(&st, 0);
+    CHECK(skytraq_decode_points(d, length, &st, points, 4) == 2);
+    CHECK(st.stats.skipped_bytes == 10);
+    CHECK(skytraq_sector_times(d, length, &first, &last) == SUCCESS);
+    CHECK(first == START_TIME && last == START_TIME + 5);
+}
+
+/* the same for a short entry and for erased flash shorter than a long entry */
+static void test_truncated_tail( void ) {
+    int length = 18 + 5;
+    gbuint8* d = guarded_buffer(length);
+    gbuint8 entry[8];
+    skytraq_point points[4];
+    decode_state st;
+    int total = 0;
+
+    put_long_entry(d, START_TIME, X, Y, Z, 10);
+    put_short_entry(entry, 5, 1, 2, 3, 11);
+    memcpy(d + 18, entry, 5);
+    decode_init(&st, 0);
+    CHECK(skytraq_decode_sector(d, length, &st, count_points, &total) == 1);
+    CHECK(st.stats.skipped_bytes == 5);
+
+    length = 18 + 10;
+    d = guarded_buffer(length);
+    put_long_entry(d, START_TIME, X, Y, Z, 10);
+    decode_init(&st, 0);
+    CHECK(skytraq_decode_points(d, length, &st, points, 4) == 1);
+    CHECK(st.stats.erased_bytes == 10);
+    CHECK(st.stats.skipped_bytes == 0);
+}
+
+/* linearized longitudes stay in (-180, 180] across the antimeridian */
+static void test_anchor_antimeridian( void ) {
+    const double a = 6378137.0, deg = 180/M_PI;
+    double x, y, z, longitude, latitude, height, exact_longitude;
+    geo_anchor anchor;
+    int sign;
+
+    for ( sign = -1; sign <= 1; sign += 2 ) {
+        ecef_to_geo(-a, sign * 100.0, 0, &longitude, &latitude, &height);
+        geo_anchor_set(&anchor, -a, sign * 100.0, 0, longitude, latitude, height);
+        CHECK(anchor.valid);
+
+        x = a * cos(179.998 / deg);
+        y = -sign * a * sin(179.998 / deg);
+        z = 0;
+        CHECK(geo_anchor_convert(&anchor, x, y, z, &longitude, &latitude, &height));
+        ecef_to_geo(x, y, z, &exact_longitude, &latitude, &height);
+        CHECK(longitude > -180 && longitude <= 180);
+        CHECK(fabs(longitude - exact_longitude) < 1e-6);
+    }
+}
+
+/* negative deltas of short entries are stored as 511-d */
+static void test_negative_deltas( void ) {
+    gbuint8* d = guarded_buffer(18 + 3 * 8);
+    skytraq_point points[4];
+    decode_state st;
+
+    put_long_entry(d, START_TIME, X, Y, Z, 10);
+    put_short_entry(d + 18, 5, -1, -2, -3, 11);
+    put_short_entry(d + 26, 5, -300, 200, -511, 12);
+    put_short_entry(d + 34, 5, 511, -100, 0, 13);
+    decode_init(&st, 0);
+    CHECK(skytraq_decode_points(d, 18 + 3 * 8, &st, points, 4) == 4);
+    CHECK(points[1].ecef_x == X - 1 && points[1].ecef_y == Y - 2 && points[1].ecef_z == Z - 3);
+    CHECK(points[2].ecef_x == X - 301 && points[2].ecef_y == Y + 198 && points[2].ecef_z == Z - 514);
+    CHECK(points[3].ecef_x == X + 210 && points[3].ecef_y == Y + 98 && points[3].ecef_z == Z - 514);
+    CHECK(points[3].time == START_TIME + 15 && points[3].speed == 13);
+}
+
+/* with --fast-geo the first point after skipped bytes is converted exactly */
+static void test_fast_geo_gap( void ) {
+    int length = 18 + 3 * 8 + 10 + 3 * 8;
+    gbuint8* d = guarded_buffer(length);
+    skytraq_point points[8];
+    double longitude, latitude, height;
+    decode_state st;
+    int i, offset = 18;
+
+    put_long_entry(d, START_TIME, X, Y, Z, 10);
+    for ( i = 0; i < 3; i++, offset += 8 )
+        put_short_entry(d + offset, 5, 10, 10, 10, 11);
+    memset(d + offset, 0, 10);
+    offset += 10;
+    for ( i = 0; i < 3; i++, offset += 8 )
+        put_short_entry(d + offset, 5, 10, 10, 10, 11);
+
+    decode_init(&st, 0);
+    st.fast_geo = 1;
+    CHECK(skytraq_decode_points(d, length, &st, points, 8) == 7);
+    CHECK(st.stats.skipped_bytes == 10);
+    CHECK(!points[3].after_gap && points[4].after_gap && !points[5].after_gap);
+    CHECK(st.stats.linearized == 5);
+    ecef_to_geo(points[4].ecef_x, points[4].ecef_y, points[4].ecef_z, &longitude, &latitude, &height);
+    CHECK(points[4].longitude == longitude && points[4].latitude == latitude && points[4].height == height);
+}
+
+static void test_no_long_entry( void ) {
+    gbuint8* d = guarded_buffer(SKYTRAQ_SECTOR_SIZE);
+    long first, last;
+
+    CHECK(skytraq_sector_times(d, SKYTRAQ_SECTOR_SIZE, &first, &last) == ERROR);
+    memset(d, 0, 100);
+    CHECK(skytraq_sector_times(d, SKYTRAQ_SECTOR_SIZE, &first, &last) == ERROR);
+}
+
+int main( int argc, char** argv ) {
+    test_whole_sector();
+    test_callback();
+    test_max_points();
+    test_truncated_long_entry();
+    test_truncated_tail();
+    test_negative_deltas();
+    test_fast_geo_gap();
+    test_no_long_entry();
+    test_anchor_antimeridian();
+
+    if ( failures > 0 ) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all decode tests passed\n");
+    return 0;
+}
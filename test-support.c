@@ -0,0 +1,65 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "test-support.h"
+
+/**
+  * A long entry at <d>, 18 bytes: <time> in seconds since 1970 and the ECEF
+  * position <x>, <y>, <z> in meters.
+  */
+void put_long_entry( gbuint8* d, long time, int x, int y, int z, int speed ) {
+    long seconds = time - 315964800;
+    int wno = seconds / 604800 - 1024, tow = seconds % 604800;
+
+    d[0] = 0x40;
+    d[1] = speed;
+    d[2] = ((tow & 0xf) << 4) | ((wno >> 8) & 0xf);
+    d[3] = wno;
+    d[4] = tow >> 12;
+    d[5] = tow >> 4;
+    d[6] = x >> 8; d[7] = x; d[8] = x >> 24; d[9] = x >> 16;
+    d[10] = y >> 8; d[11] = y; d[12] = y >> 24; d[13] = y >> 16;
+    d[14] = z >> 8; d[15] = z; d[16] = z >> 24; d[17] = z >> 16;
+}
+
+/* deltas are 10 bit values, negative ones stored as 511-d */
+static int short_delta( int d ) {
+    return d < 0 ? 511 - d : d;
+}
+
+/**
+  * A short entry at <d>, 8 bytes: <dt> seconds and <dx>, <dy>, <dz> meters
+  * after the previous point, each delta within -511 ... 511.
+  */
+void put_short_entry( gbuint8* d, int dt, int dx, int dy, int dz, int speed ) {
+    dx = short_delta(dx);
+    dy = short_delta(dy);
+    dz = short_delta(dz);
+    d[0] = 0x80;
+    d[1] = speed;
+    d[2] = dt >> 8;
+    d[3] = dt;
+    d[4] = dx >> 2;
+    d[5] = ((dx & 3) << 6) | (dy & 0x3f);
+    d[6] = ((dy >> 6) << 4) | (dz >> 8);
+    d[7] = dz;
+}
@@ -0,0 +1,34 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef test_support_h
+#define test_support_h
+
+/*
+ * Builders for log entries, shared by skytraq-bench and test-decode. They
+ * write the format that decode_long_entry() and decode_short_entry() read.
+ */
+
+void put_long_entry( gbuint8* d, long time, int x, int y, int z, int speed );
+void put_short_entry( gbuint8* d, int dt, int dx, int dy, int dz, int speed );
+
+#endif
@@ -0,0 +1,317 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+#include "datalogger.h"
+#include "trace.h"
+#include <stdarg.h>
+
+#define TRACE_RING_SIZE 4096 /* records, must be a power of two */
+#define TRACE_RING_MASK (TRACE_RING_SIZE-1)
+
+/* records written while saving go into the same stack buffer, in batches */
+#define TRACE_SAVE_BATCH 64
+
+static trace_record ring[TRACE_RING_SIZE];
+static unsigned long long trace_next = 0;
+static unsigned long trace_errors = 0;
+
+static const char* type_names[] = { "?", "TX", "RX", "PACKAGE", "ACK", "NACK", "TIMEOUT",
+                                    "SPEED", "FLUSH", "ERROR" };
+
+static void put_uint16( unsigned char* buf, unsigned value ) {
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+}
+
+static void put_uint32( unsigned char* buf, unsigned long value ) {
+    put_uint16(buf, value & 0xffff);
+    put_uint16(buf + 2, (value >> 16) & 0xffff);
+}
+
+static void put_uint64( unsigned char* buf, unsigned long long value ) {
+    put_uint32(buf, value & 0xffffffff);
+    put_uint32(buf + 4, (value >> 32) & 0xffffffff);
+}
+
+static unsigned get_uint16( const unsigned char* buf ) {
+    return buf[0] | (buf[1] << 8);
+}
+
+static unsigned long get_uint32( const unsigned char* buf ) {
+    return get_uint16(buf) | ((unsigned long)get_uint16(buf + 2) << 16);
+}
+
+static unsigned long long get_uint64( const unsigned char* buf ) {
+    return get_uint32(buf) | ((unsigned long long)get_uint32(buf + 4) << 32);
+}
+
+static unsigned long long now_ns( clockid_t clock ) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+  * Claim the next slot of the ring. Several threads may record at the same
+  * time; each gets its own slot and the record becomes valid for readers when
+  * trace_commit() sets its sequence number.
+  */
+static trace_record* trace_begin( int type, int fd, unsigned long long* slot ) {
+    trace_record* r;
+
+    *slot = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    r = &ring[*slot & TRACE_RING_MASK];
+    __atomic_store_n(&r->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->time = now_ns(CLOCK_MONOTONIC);
+    r->type = type;
+    r->fd = fd;
+    return r;
+}
+
+static void trace_commit( trace_record* r, unsigned long long slot ) {
+    __atomic_store_n(&r->sequence, slot + 1, __ATOMIC_RELEASE);
+}
+
+/**
+  * Record a chunk of <length> bytes sent to or received from <fd>. Only the
+  * first TRACE_DATA_SIZE bytes are kept.
+  */
+void trace_data( int type, int fd, const void* data, unsigned length ) {
+    unsigned long long slot;
+    trace_record* r = trace_begin(type, fd, &slot);
+
+    r->length = length > 0xffff ? 0xffff : length;
+    memcpy(r->data, data, length < TRACE_DATA_SIZE ? length : TRACE_DATA_SIZE);
+    trace_commit(r, slot);
+}
+
+/**
+  * Record an event with up to two numbers, e.g. the message ID and the round
+  * trip time in µs for TRACE_ACK.
+  */
+void trace_event( int type, int fd, unsigned long a, unsigned long b ) {
+    unsigned long long slot;
+    trace_record* r = trace_begin(type, fd, &slot);
+
+    r->length = 8;
+    put_uint32(r->data, a);
+    put_uint32(r->data + 4, b);
+    trace_commit(r, slot);
+}
+
+/**
+  * Record an error message. Errors make --trace-on-error save the ring.
+  */
+void trace_error( int fd, const char* format, ... ) {
+    char text[TRACE_DATA_SIZE];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if ( length >= (int)sizeof(text) )
+        length = sizeof(text) - 1;
+
+    __atomic_add_fetch(&trace_errors, 1, __ATOMIC_RELAXED);
+    trace_data(TRACE_ERROR, fd, text, length);
+}
+
+unsigned long trace_error_count( void ) {
+    return __atomic_load_n(&trace_errors, __ATOMIC_RELAXED);
+}
+
+/**
+  * Copy the record for <slot> if it is complete and has not been overwritten.
+  */
+static int trace_copy( unsigned long long slot, trace_record* copy ) {
+    const trace_record* r = &ring[slot & TRACE_RING_MASK];
+
+    if ( __atomic_load_n(&r->sequence, __ATOMIC_ACQUIRE) != slot + 1 )
+        return 0;
+    memcpy(copy, r, sizeof(trace_record));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->sequence, __ATOMIC_RELAXED) == slot + 1;
+}
+
+static int write_all( int fd, const unsigned char* buf, size_t len ) {
+    while ( len > 0 ) {
+        ssize_t written = write(fd, buf, len);
+        if ( written <= 0 )
+            return ERROR;
+        buf += written;
+        len -= written;
+    }
+    return SUCCESS;
+}
+
+/**
+  * Write the ring to <path>. Only async-signal-safe functions are used so
+  * that this may be called from a signal handler. Records written meanwhile
+  * are left out.
+  */
+int trace_save( const char* path ) {
+    unsigned char buf[TRACE_SAVE_BATCH * TRACE_FILE_RECORD_SIZE];
+    unsigned long long end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    unsigned long long start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    unsigned long long slot;
+    unsigned long count = 0;
+    int fd, used = 0, result = SUCCESS;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 )
+        return ERROR;
+
+    /* the header is completed once the number of records is known */
+    memset(buf, 0, TRACE_FILE_HEADER_SIZE);
+    memcpy(buf, TRACE_FILE_MAGIC, 8);
+    put_uint32(buf + 8, TRACE_FILE_VERSION);
+    put_uint64(buf + 16, start);
+    put_uint64(buf + 24, now_ns(CLOCK_MONOTONIC));
+    put_uint64(buf + 32, now_ns(CLOCK_REALTIME) / 1000000000ull);
+    if ( write_all(fd, buf, TRACE_FILE_HEADER_SIZE) != SUCCESS )
+        result = ERROR;
+
+    for ( slot = start; slot < end && result == SUCCESS; slot++ ) {
+        trace_record r;
+        unsigned char* out = buf + used * TRACE_FILE_RECORD_SIZE;
+
+        if ( !trace_copy(slot, &r) )
+            continue;
+
+        put_uint64(out, r.sequence);
+        put_uint64(out + 8, r.time);
+        out[16] = r.type;
+        out[17] = r.fd;
+        put_uint16(out + 18, r.length);
+        memcpy(out + 20, r.data, TRACE_DATA_SIZE);
+        count++;
+
+        if ( ++used == TRACE_SAVE_BATCH ) {
+            result = write_all(fd, buf, used * TRACE_FILE_RECORD_SIZE);
+            used = 0;
+        }
+    }
+    if ( result == SUCCESS && used > 0 )
+        result = write_all(fd, buf, used * TRACE_FILE_RECORD_SIZE);
+
+    put_uint32(buf, count);
+    if ( result == SUCCESS && pwrite(fd, buf, 4, 12) != 4 )
+        result = ERROR;
+
+    close(fd);
+    return result;
+}
+
+static void print_bytes( FILE* out, const unsigned char* data, unsigned stored, unsigned length ) {
+    unsigned i;
+
+    for ( i = 0; i < stored; i++ ) {
+        if ( i > 0 && i % 16 == 0 )
+            fprintf(out, "\n%34s", "");
+        fprintf(out, " %02x", data[i]);
+    }
+    if ( length > stored )
+        fprintf(out, " ...");
+}
+
+static void print_record( FILE* out, const unsigned char* rec, unsigned long long first ) {
+    unsigned long long time = get_uint64(rec + 8);
+    unsigned type = rec[16];
+    unsigned length = get_uint16(rec + 18);
+    const unsigned char* data = rec + 20;
+    unsigned stored = length < TRACE_DATA_SIZE ? length : TRACE_DATA_SIZE;
+    unsigned long a = get_uint32(data), b = get_uint32(data + 4);
+
+    fprintf(out, "%12.6f  fd %-3d %-8s", (time - first) / 1e9, rec[17],
+            type < sizeof(type_names) / sizeof(type_names[0]) ? type_names[type] : "?");
+
+    switch ( type ) {
+    case TRACE_TX:
+    case TRACE_RX:
+    case TRACE_PACKAGE:
+        fprintf(out, "%5u", length);
+        print_bytes(out, data, stored, length);
+        break;
+    case TRACE_ACK:
+    case TRACE_NACK:
+        fprintf(out, "message 0x%02lx after %.1f ms", a, b / 1000.0);
+        break;
+    case TRACE_TIMEOUT:
+        fprintf(out, "after %lu ms", a);
+        if ( b > 0 )
+            fprintf(out, ", %lu bytes missing", b);
+        break;
+    case TRACE_SPEED:
+        fprintf(out, "%lu baud", a);
+        break;
+    case TRACE_FLUSH:
+        fprintf(out, "%lu bytes discarded", a);
+        break;
+    case TRACE_ERROR:
+        fprintf(out, "%.*s", (int)stored, (const char*)data);
+        break;
+    }
+    fprintf(out, "\n");
+}
+
+/**
+  * Print a file written by trace_save(). Times are in seconds from the
+  * first record.
+  */
+int trace_print( const char* path, FILE* out ) {
+    unsigned char header[TRACE_FILE_HEADER_SIZE];
+    unsigned char rec[TRACE_FILE_RECORD_SIZE];
+    unsigned long count, i;
+    unsigned long long lost, saved, first = 0;
+    time_t saved_at;
+    FILE* in = fopen(path, "rb");
+
+    if ( in == NULL )
+        return ERROR;
+    if ( fread(header, 1, sizeof(header), in) != sizeof(header) ||
+            memcmp(header, TRACE_FILE_MAGIC, 8) || get_uint32(header + 8) != TRACE_FILE_VERSION ) {
+        fclose(in);
+        return ERROR;
+    }
+
+    count = get_uint32(header + 12);
+    lost = get_uint64(header + 16);
+    saved = get_uint64(header + 24);
+    saved_at = get_uint64(header + 32);
+
+    fprintf(out, "%lu records, %llu older ones overwritten, saved %s", count, lost, ctime(&saved_at));
+    for ( i = 0; i < count; i++ ) {
+        if ( fread(rec, 1, sizeof(rec), in) != sizeof(rec) ) {
+            fclose(in);
+            return ERROR;
+        }
+        if ( i == 0 )
+            first = get_uint64(rec + 8);
+        print_record(out, rec, first);
+    }
+    if ( count > 0 )
+        fprintf(out, "saved %.6f s after the first record\n", (saved - first) / 1e9);
+
+    fclose(in);
+    return SUCCESS;
+}
@@ -0,0 +1,75 @@
+/*
+
+    Control program for SkyTraq GPS data logger.
+
+    Copyright (C) 2008  Jesper Zedlitz, jesper@zedlitz.de
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111 USA
+
+ */
+
+#ifndef trace_h
+#define trace_h
+
+/*
+ * Flight recorder for the serial line. Chunks sent and received and protocol
+ * events are kept in a fixed ring in memory, the oldest records are
+ * overwritten. Recording is always on and costs a clock read and a small
+ * copy; the ring is only written to a file when something went wrong or when
+ * asked for (see --trace).
+ */
+
+enum { TRACE_TX = 1, TRACE_RX, TRACE_PACKAGE, TRACE_ACK, TRACE_NACK, TRACE_TIMEOUT,
+       TRACE_SPEED, TRACE_FLUSH, TRACE_ERROR
+     };
+
+/* bytes of each chunk that are kept, longer chunks are cut */
+#define TRACE_DATA_SIZE 44
+
+typedef struct trace_record {
+    unsigned long long  sequence;   /* number of the record + 1, 0 while it is written */
+    unsigned long long  time;       /* ns on the monotonic clock */
+    unsigned char       type;
+    unsigned char       fd;
+    unsigned short      length;     /* length of the whole chunk */
+    unsigned char       data[TRACE_DATA_SIZE];
+} trace_record;
+
+/*
+ * File format written by trace_save(), all numbers little endian:
+ *
+ *   0  "STQTRACE"
+ *   8  format version (uint32)
+ *  12  number of records (uint32)
+ *  16  records lost because the ring wrapped around (uint64)
+ *  24  monotonic clock when saved, ns (uint64)
+ *  32  system time when saved, seconds since 1970 (uint64)
+ *  40  records, oldest first, TRACE_FILE_RECORD_SIZE bytes each: sequence,
+ *      time (uint64 each), type, fd (uint8 each), length (uint16) and
+ *      TRACE_DATA_SIZE data bytes
+ */
+#define TRACE_FILE_MAGIC        "STQTRACE"
+#define TRACE_FILE_VERSION      1
+#define TRACE_FILE_HEADER_SIZE  40
+#define TRACE_FILE_RECORD_SIZE  64
+
+void trace_data( int type, int fd, const void* data, unsigned length );
+void trace_event( int type, int fd, unsigned long a, unsigned long b );
+void trace_error( int fd, const char* format, ... );
+unsigned long trace_error_count( void );
+int trace_save( const char* path );
+int trace_print( const char* path, FILE* out );
+
+#endif